@@ -38,6 +38,16 @@
 // FCY = FOSC / 4
 #define FCY (7370000UL / 4) // Internal Fast RC Oscillator, FOSC = 7.37 MHz
 
+// === Clock switching ===
+// If BOOT_OSCILLATOR is defined the bootloader switches to this oscillator at startup and switches back to
+// the oscillator selected by the FOS fuse bits before it starts the target firmware, FCY shall be the instruction
+// clock of BOOT_OSCILLATOR then. So the bootloader can run faster than the target firmware (the primary oscillator
+// with PLL, the mode is selected by the FPR fuse bits) or use FRC with any target firmware crystal.
+// The clock switching shall be enabled by the FCKSMEN fuse bits. The target firmware is started if the oscillator
+// does not switch.
+// BOOT_OSCILLATOR is the NOSC value: 0 - low power 32 kHz, 1 - FRC, 2 - LPRC, 3 - primary oscillator.
+// #define BOOT_OSCILLATOR 3
+
 // === UART ===
 // The UART port number and the pin selection shall be defined.
 // #define BOOT_UART UART1
@@ -61,7 +71,121 @@
 #define LED_ON 1
 #define LED_OFF 0
 
+// === Hardware flow control ===
+// If FLOW_CONTROL_USED is defined the bootloader drives the CTS line of the PC (RTS/CTS flow control).
+// CTS is off while the receive queue is almost full and while the CPU is stalled by the program memory
+// erase and program operations, so the PC can send the requests back to back.
+// #define FLOW_CONTROL_USED
+#define CTS_TRIS TRISBbits.TRISB1
+#define CTS_LAT LATBbits.LATB1
+#define CTS_ON 0 // the levels on the pin, the RS-232 transceiver inverts the line
+#define CTS_OFF 1
+
+// === UART receive interrupt ===
+// If UART_RX_INTERRUPT_USED is defined the received bytes are moved to the receive queue by the interrupt handler,
+// so they are not lost while the bootloader calculates CRC or tests the rows at the high baud rates.
+// The bootloader uses the alternate interrupt vector table (ALTIVT) and does not change the target firmware vectors.
+// The loader writes the handler address to the alternate vector of the boot UART receive interrupt with the target
+// firmware, so the target firmware shall not use this alternate vector (the loader rejects such firmware). The bytes are
+// polled until the vector is written.
+// UART_RX_IRQ is the interrupt number of the boot UART receiver: 9 - U1RX, 24 - U2RX.
+// #define UART_RX_INTERRUPT_USED
+#define UART_RX_IRQ 24
+#define UART_RX_IF IFS1bits.U2RXIF
+#define UART_RX_IE IEC1bits.U2RXIE
+
+// === Direct interrupt vectors ===
+// The first row is never changed, so its primary vectors jump to the target firmware handlers through the jump table
+// (one GOTO more per interrupt). If DIRECT_VECTORS_USED is defined the target firmware is started with the alternate
+// interrupt vector table (ALTIVT = 1) and the loader writes the target firmware primary vectors to the alternate
+// table, so the interrupts reach the handlers directly. The target firmware shall not use the alternate handlers
+// (_Alt...) and shall not clear ALTIVT. The receive interrupt (UART_RX_INTERRUPT_USED) cannot be used, its handler
+// would replace the target firmware primary vector.
+// #define DIRECT_VECTORS_USED
+
+// === RS-485 multi-drop bus ===
+// If NODE_ADDRESS is defined (1...254) the bootloader shares the half-duplex RS-485 bus with the other nodes.
+// The node executes only the requests with its address or the broadcast address, the broadcast requests
+// have no response. The transceiver driver is enabled by the DE pin only while the response is sent.
+// The transceiver receiver (/RE) can be tied low, the node drops its own response received back from the bus,
+// or /RE can be driven by the same pin (the inverted DE level disables the receiver while the response is sent).
+// The hardware flow control cannot be used on the bus.
+// #define NODE_ADDRESS 1
+#define DE_TRIS TRISBbits.TRISB2
+#define DE_LAT LATBbits.LATB2
+#define DE_ON 1
+#define DE_OFF 0
+
+// === Diagnostics ===
+// If DIAGNOSTICS_USED is defined the bootloader counts the received frames, the errors, the row tests and
+// the flash memory operations, and measures the erase and program time by Timer1. The loader shows the counters
+// with the --stats option. The data region shall be larger by 0x20 bytes.
+// #define DIAGNOSTICS_USED
+
+// === Optional requests ===
+// The bootloader image shall fit 0x780 program memory addresses (0x3C0 instruction words), the linker script checks
+// the size. So the requests added to speed up the loader are compiled only if they are defined. The capabilities
+// report the compiled requests, the loader uses the basic requests instead of the others. The multi-row write is
+// compiled with PACKET_BUFFER_SIZE above 255, the broadcast requests with NODE_ADDRESS.
+// READ_RANGE_USED - the rows are read by one request (the reads and the verification).
+// SWITCH_BAUD_RATE_USED - the loader switches to a higher baud rate (links the 32-bit division).
+// COMPRESSED_WRITE_USED - the repeated words of the rows are sent compressed.
+// RANGE_CRC_USED - the rows are verified by CRC-32 of the range.
+// ROW_DIGESTS_USED - the rows are compared by CRC-16 digests, the unchanged rows are not sent.
+// BLANK_CHECK_USED - the blank rows are found by one request and are not erased.
+// ERASE_RANGE_USED - the rows and the whole data EEPROM are erased by one request.
+// WRITE_EEPROM_WORDS_USED - the changed data EEPROM words are written without the row erase.
+// MASKED_WRITE_USED - only the changed words of a row are sent.
+// LINK_TEST_USED - the echo and sink requests of the link test (the -k option).
+// ERASE_AVOIDANCE_USED - the rows are programmed without the erase if the new data only clears bits (the optimized
+// program requests, the response status bit 4).
+// #define READ_RANGE_USED
+// #define SWITCH_BAUD_RATE_USED
+// #define COMPRESSED_WRITE_USED
+// #define RANGE_CRC_USED
+// #define ROW_DIGESTS_USED
+// #define BLANK_CHECK_USED
+// #define ERASE_RANGE_USED
+// #define WRITE_EEPROM_WORDS_USED
+// #define MASKED_WRITE_USED
+// #define LINK_TEST_USED
+// #define ERASE_AVOIDANCE_USED
+
+// === RAM budget ===
+// The packet buffer size (128 by default, up to 4096). The larger buffer allows the requests with several rows
+// and the frames longer than 255 bytes. The bootloader data and stack shall fit the linker script data region,
+// it shall be PACKET_BUFFER_SIZE + 0x80 bytes at least (the gld-modifier tool BOOTLOADER_RAM_SIZE parameter).
+// #define PACKET_BUFFER_SIZE 1024
+// If TX_QUEUE_SIZE is defined (a power of 2, 16...4096) the responses are written to the transmit queue and moved
+// to the UART FIFO while the bootloader receives and processes the next request. The queue shall be larger than
+// the encoded response (up to twice the response size with the escaped bytes) to release the CPU for the whole
+// response. The data region shall be larger by TX_QUEUE_SIZE bytes too.
+// #define TX_QUEUE_SIZE 256
+// If RX_QUEUE_SIZE is defined (a power of 2, 32...4096, 32 by default) the receive queue holds several requests, so
+// the PC sends the program memory row writes together without the flow control and waits for the responses once.
+// The queue shall hold 2 encoded row writes at least for that (about 110 bytes each, up to twice the request size
+// with the escaped bytes). The data region shall be larger by RX_QUEUE_SIZE - 32 bytes too.
+// #define RX_QUEUE_SIZE 512
+
 // === Waiting time at startup ===
 // The bootloader firmware waits a connection on the serial port during this period (in milliseconds).
 // After the period is expired and no connection is obtained the target firmware is started.
 #define WAIT_DELAY_MS 5000 // 5 seconds
+
+// === Fast boot ===
+// If FAST_BOOT_USED is defined the bootloader starts the target firmware immediately after reset unless an update
+// is requested, WAIT_DELAY_MS is used only for the requested update. The bootloader stays active anyway if there
+// is no target firmware. The update is requested by the defined triggers:
+// UPDATE_REQUEST_ADDRESS - the target firmware writes UPDATE_REQUEST_MAGIC to this RAM word and executes
+// the RESET instruction. The word shall be above the bootloader data region (0x800 + RAM_SIZE),
+// the bootloader clears it.
+// UPDATE_PIN - the strap or button pin is in the UPDATE_PIN_ACTIVE level at reset. The pin shall have
+// an external pull-up or pull-down resistor, the pin is read before any initialization.
+// FAST_BOOT_SNIFF_MS - the 0xAE start byte is received during this period (1...99 ms) after reset.
+// The loader repeats the start communication request every 10 ms, so the period shall be 20 ms at least.
+// #define FAST_BOOT_USED
+#define UPDATE_REQUEST_ADDRESS 0x0900
+#define UPDATE_REQUEST_MAGIC 0xB007
+// #define UPDATE_PIN PORTBbits.RB3
+#define UPDATE_PIN_ACTIVE 0
+// #define FAST_BOOT_SNIFF_MS 30
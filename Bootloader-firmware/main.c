@@ -1,6 +1,9 @@
 #include <xc.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <libpic30.h>
 
 #ifndef CONFIG_FILE
 #error CONFIG_FILE shall be defined
@@ -38,11 +41,301 @@
 
 #endif // LED_USED
 
+#ifdef FLOW_CONTROL_USED
+
+#ifndef CTS_TRIS
+#error CTS_TRIS shall be defined in the config file if FLOW_CONTROL_USED is defined
+#endif
+
+#ifndef CTS_LAT
+#error CTS_LAT shall be defined in the config file if FLOW_CONTROL_USED is defined
+#endif
+
+#ifndef CTS_ON
+#error CTS_ON shall be defined in the config file if FLOW_CONTROL_USED is defined
+#endif
+
+#ifndef CTS_OFF
+#error CTS_OFF shall be defined in the config file if FLOW_CONTROL_USED is defined
+#endif
+
+#endif // FLOW_CONTROL_USED
+
+#ifdef NODE_ADDRESS
+
+#if (NODE_ADDRESS < 1) || (NODE_ADDRESS > 254)
+#error NODE_ADDRESS shall be from 1 to 254
+#endif
+
+#ifdef FLOW_CONTROL_USED
+#error FLOW_CONTROL_USED cannot be used on the multi-drop bus (NODE_ADDRESS is defined)
+#endif
+
+#ifndef DE_TRIS
+#error DE_TRIS shall be defined in the config file if NODE_ADDRESS is defined
+#endif
+
+#ifndef DE_LAT
+#error DE_LAT shall be defined in the config file if NODE_ADDRESS is defined
+#endif
+
+#ifndef DE_ON
+#error DE_ON shall be defined in the config file if NODE_ADDRESS is defined
+#endif
+
+#ifndef DE_OFF
+#error DE_OFF shall be defined in the config file if NODE_ADDRESS is defined
+#endif
+
+#endif // NODE_ADDRESS
+
+#ifdef UART_RX_INTERRUPT_USED
+
+#ifndef UART_RX_IRQ
+#error UART_RX_IRQ shall be defined in the config file if UART_RX_INTERRUPT_USED is defined
+#endif
+
+#ifndef UART_RX_IF
+#error UART_RX_IF shall be defined in the config file if UART_RX_INTERRUPT_USED is defined
+#endif
+
+#ifndef UART_RX_IE
+#error UART_RX_IE shall be defined in the config file if UART_RX_INTERRUPT_USED is defined
+#endif
+
+// the bootloader handler would replace a target firmware primary vector, it is called if the target firmware clears ALTIVT
+#if defined(DIRECT_VECTORS_USED) && defined(UART_RX_INTERRUPT_USED)
+#error UART_RX_INTERRUPT_USED cannot be used with DIRECT_VECTORS_USED
+#endif
+
+#endif // UART_RX_INTERRUPT_USED
+
+#ifdef BOOT_OSCILLATOR
+#if (BOOT_OSCILLATOR < 0) || (BOOT_OSCILLATOR > 3)
+#error BOOT_OSCILLATOR shall be from 0 to 3 (the NOSC value)
+#endif
+#endif
+
+#ifdef FAST_BOOT_USED
+
+#if !defined(UPDATE_REQUEST_ADDRESS) && !defined(UPDATE_PIN) && !defined(FAST_BOOT_SNIFF_MS)
+#error UPDATE_REQUEST_ADDRESS, UPDATE_PIN or FAST_BOOT_SNIFF_MS shall be defined if FAST_BOOT_USED is defined
+#endif
+
+#ifdef UPDATE_REQUEST_ADDRESS
+#if (UPDATE_REQUEST_ADDRESS < 0x0800) || ((UPDATE_REQUEST_ADDRESS & 1) != 0)
+#error UPDATE_REQUEST_ADDRESS shall be an even RAM address above the bootloader data region
+#endif
+#ifndef UPDATE_REQUEST_MAGIC
+#error UPDATE_REQUEST_MAGIC shall be defined in the config file if UPDATE_REQUEST_ADDRESS is defined
+#endif
+#endif
+
+#if defined(UPDATE_PIN) && !defined(UPDATE_PIN_ACTIVE)
+#error UPDATE_PIN_ACTIVE shall be defined in the config file if UPDATE_PIN is defined
+#endif
+
+#ifdef FAST_BOOT_SNIFF_MS
+#if (FAST_BOOT_SNIFF_MS < 1) || (FAST_BOOT_SNIFF_MS > 99)
+#error FAST_BOOT_SNIFF_MS shall be from 1 to 99 (less than the Timer1 period)
+#endif
+#define FAST_BOOT_SNIFF_TICKS ((FCY / 256) * FAST_BOOT_SNIFF_MS / 1000) // Timer1 ticks
+#endif
+
+#endif // FAST_BOOT_USED
+
 #ifndef WAIT_DELAY_MS
 #error WAIT_DELAY_MS period shall be defined in the config file
 #endif
 
+#ifdef PACKET_BUFFER_SIZE
+#if (PACKET_BUFFER_SIZE < 128) || (PACKET_BUFFER_SIZE > 4096)
+#error PACKET_BUFFER_SIZE shall be from 128 to 4096
+#endif
+#define BUFFER_SIZE PACKET_BUFFER_SIZE
+#else
 #define BUFFER_SIZE 128
+#endif
+#ifdef RX_QUEUE_SIZE
+#if (RX_QUEUE_SIZE < 32) || (RX_QUEUE_SIZE > 4096) || ((RX_QUEUE_SIZE & (RX_QUEUE_SIZE - 1)) != 0)
+#error RX_QUEUE_SIZE shall be a power of 2 from 32 to 4096
+#endif
+#else
+#define RX_QUEUE_SIZE 32
+#endif
+
+#ifdef TX_QUEUE_SIZE
+#if (TX_QUEUE_SIZE < 16) || (TX_QUEUE_SIZE > 4096) || ((TX_QUEUE_SIZE & (TX_QUEUE_SIZE - 1)) != 0)
+#error TX_QUEUE_SIZE shall be a power of 2 from 16 to 4096
+#endif
+#endif
+
+#define CTS_QUEUE_MARGIN 16 // CTS is off if the receive queue has less free bytes
+#define CTS_STOP_BYTES 4 // the PC can send up to this bytes after CTS is off
+#define UART_IDLE_BYTES 2 // the line is idle if no byte is received during this time
+
+#define BAUD_RATE_DEFAULT 115200UL
+#define BAUD_RATE_FALLBACK_TICKS 10 // 1 sec, if no packet is received after the baud rate switching
+
+// UxBRG value for the baud rate
+#define UART_BRG(baudRate) ((FCY + (16 * (baudRate)) / 2) / (16 * (baudRate)) - 1)
+
+// if the baud rate error is not more than 2% (compile time check)
+#define UART_DIVIDER(baudRate) ((UART_BRG(baudRate) + 1) != 0 ? (UART_BRG(baudRate) + 1) : 1)
+#define UART_ACTUAL_BAUD_RATE(baudRate) (FCY / (16 * UART_DIVIDER(baudRate)))
+#define UART_BAUD_RATE_SUPPORTED(baudRate) (((baudRate) <= FCY / 8) \
+    && ((UART_ACTUAL_BAUD_RATE(baudRate) > (baudRate) \
+        ? UART_ACTUAL_BAUD_RATE(baudRate) - (baudRate) \
+        : (baudRate) - UART_ACTUAL_BAUD_RATE(baudRate)) * 50 <= (baudRate)))
+
+// the standard baud rates higher than BAUD_RATE_DEFAULT supported with FCY
+#define BAUD_RATE_MASK ( \
+    (UART_BAUD_RATE_SUPPORTED(230400UL) ? 0x01 : 0) \
+    | (UART_BAUD_RATE_SUPPORTED(460800UL) ? 0x02 : 0) \
+    | (UART_BAUD_RATE_SUPPORTED(921600UL) ? 0x04 : 0))
+
+#define CAPABILITY_MASK_READ_RANGE 0x0001
+#define CAPABILITY_MASK_SWITCH_BAUD_RATE 0x0002
+#define CAPABILITY_MASK_COMPRESSED_WRITE 0x0004
+#define CAPABILITY_MASK_RANGE_CRC 0x0008
+
+#define CAPABILITY_MASK_ROW_DIGESTS 0x0010
+#define CAPABILITY_MASK_BLANK_CHECK 0x0020
+#define CAPABILITY_MASK_FLOW_CONTROL 0x0040
+#define CAPABILITY_MASK_ERASE_RANGE 0x0080
+#define CAPABILITY_MASK_WRITE_EEPROM_WORDS 0x0100
+#define CAPABILITY_MASK_MASKED_WRITE 0x0200
+#define CAPABILITY_MASK_MULTI_ROW_WRITE 0x0400
+#define CAPABILITY_MASK_LINK_TEST 0x0800
+#define CAPABILITY_MASK_BROADCAST 0x1000
+#define CAPABILITY_MASK_RX_INTERRUPT 0x2000
+#define CAPABILITY_MASK_DIAGNOSTICS 0x4000
+#define CAPABILITY_MASK_DIRECT_VECTORS 0x8000
+
+#ifdef READ_RANGE_USED
+#define CAPABILITY_MASK_READ_RANGE_USED CAPABILITY_MASK_READ_RANGE
+#else
+#define CAPABILITY_MASK_READ_RANGE_USED 0
+#endif
+
+#ifdef SWITCH_BAUD_RATE_USED
+#define CAPABILITY_MASK_SWITCH_BAUD_RATE_USED CAPABILITY_MASK_SWITCH_BAUD_RATE
+#else
+#define CAPABILITY_MASK_SWITCH_BAUD_RATE_USED 0
+#endif
+
+#ifdef COMPRESSED_WRITE_USED
+#define CAPABILITY_MASK_COMPRESSED_WRITE_USED CAPABILITY_MASK_COMPRESSED_WRITE
+#else
+#define CAPABILITY_MASK_COMPRESSED_WRITE_USED 0
+#endif
+
+#ifdef RANGE_CRC_USED
+#define CAPABILITY_MASK_RANGE_CRC_USED CAPABILITY_MASK_RANGE_CRC
+#else
+#define CAPABILITY_MASK_RANGE_CRC_USED 0
+#endif
+
+#ifdef ROW_DIGESTS_USED
+#define CAPABILITY_MASK_ROW_DIGESTS_USED CAPABILITY_MASK_ROW_DIGESTS
+#else
+#define CAPABILITY_MASK_ROW_DIGESTS_USED 0
+#endif
+
+#ifdef BLANK_CHECK_USED
+#define CAPABILITY_MASK_BLANK_CHECK_USED CAPABILITY_MASK_BLANK_CHECK
+#else
+#define CAPABILITY_MASK_BLANK_CHECK_USED 0
+#endif
+
+#ifdef ERASE_RANGE_USED
+#define CAPABILITY_MASK_ERASE_RANGE_USED CAPABILITY_MASK_ERASE_RANGE
+#else
+#define CAPABILITY_MASK_ERASE_RANGE_USED 0
+#endif
+
+#ifdef WRITE_EEPROM_WORDS_USED
+#define CAPABILITY_MASK_WRITE_EEPROM_WORDS_USED CAPABILITY_MASK_WRITE_EEPROM_WORDS
+#else
+#define CAPABILITY_MASK_WRITE_EEPROM_WORDS_USED 0
+#endif
+
+#ifdef MASKED_WRITE_USED
+#define CAPABILITY_MASK_MASKED_WRITE_USED CAPABILITY_MASK_MASKED_WRITE
+#else
+#define CAPABILITY_MASK_MASKED_WRITE_USED 0
+#endif
+
+#ifdef LINK_TEST_USED
+#define CAPABILITY_MASK_LINK_TEST_USED CAPABILITY_MASK_LINK_TEST
+#else
+#define CAPABILITY_MASK_LINK_TEST_USED 0
+#endif
+
+#ifdef FLOW_CONTROL_USED
+#define CAPABILITY_MASK_FLOW_CONTROL_USED CAPABILITY_MASK_FLOW_CONTROL
+#else
+#define CAPABILITY_MASK_FLOW_CONTROL_USED 0
+#endif
+
+#ifdef NODE_ADDRESS
+#define CAPABILITY_MASK_BROADCAST_USED CAPABILITY_MASK_BROADCAST
+#else
+#define CAPABILITY_MASK_BROADCAST_USED 0
+#endif
+
+#ifdef UART_RX_INTERRUPT_USED
+#define CAPABILITY_MASK_RX_INTERRUPT_USED CAPABILITY_MASK_RX_INTERRUPT
+// the alternate interrupt vector table starts from 0x000084, the vectors of the interrupts follow 8 trap vectors
+#define UART_RX_VECTOR_ADDRESS (0x000094 + 2 * UART_RX_IRQ)
+#else
+#define CAPABILITY_MASK_RX_INTERRUPT_USED 0
+#endif
+
+#ifdef DIAGNOSTICS_USED
+#define CAPABILITY_MASK_DIAGNOSTICS_USED CAPABILITY_MASK_DIAGNOSTICS
+#define DIAGNOSTICS_COUNT(counter) (++diagnostics.counter)
+#else
+#define CAPABILITY_MASK_DIAGNOSTICS_USED 0
+#define DIAGNOSTICS_COUNT(counter) ((void)0)
+#endif
+
+#ifdef DIRECT_VECTORS_USED
+#define CAPABILITY_MASK_DIRECT_VECTORS_USED CAPABILITY_MASK_DIRECT_VECTORS
+#else
+#define CAPABILITY_MASK_DIRECT_VECTORS_USED 0
+#endif
+
+// the 128 bytes buffer has one program memory row only
+#if BUFFER_SIZE > 0xFF
+#define MULTI_ROW_WRITE_USED
+#define CAPABILITY_MASK_MULTI_ROW_WRITE_USED CAPABILITY_MASK_MULTI_ROW_WRITE
+#else
+#define CAPABILITY_MASK_MULTI_ROW_WRITE_USED 0
+#endif
+
+#define BROADCAST_ADDRESS 0xFF // the request is executed by all nodes without the response
+
+#define RANGE_CRC_FLAG_HIGH_BYTE 0x01
+
+#define ROW_DIGESTS_FLAG_PROGRAM_MEMORY 0x01 // program memory rows, data EEPROM rows otherwise
+#define MAX_ROW_DIGEST_COUNT 32
+
+#define BLANK_CHECK_FLAG_PROGRAM_MEMORY 0x01 // program memory rows, data EEPROM rows otherwise
+#define MAX_BLANK_CHECK_ROW_COUNT 256
+
+#define ERASE_RANGE_FLAG_PROGRAM_MEMORY 0x01 // program memory rows, data EEPROM rows otherwise
+#define ERASE_RANGE_FLAG_FORCE 0x02 // erase the blank rows too
+#define ERASE_RANGE_FLAG_BULK 0x04 // the range is the whole data EEPROM
+
+#define LINK_TEST_FLAG_ECHO 0x01 // the response has the request data, the data size only otherwise
+
+#define DIAGNOSTICS_FLAG_CLEAR 0x01 // the counters are cleared after the response
+#define DIAGNOSTICS_TICK_FREQUENCY (FCY / 256) // Timer1 with the 1:256 prescaler
+
+#define MAX_EEPROM_WORD_COUNT (BUFFER_SIZE < 1024 ? (BUFFER_SIZE - 3) / 4 : 255) // with the sequence byte
+
+#define CONFIG_WORD_COUNT 7
 
 #define PROGRAM_MEMORY_ROW_SIZE 64
 #define DATA_EEPROM_ROW_SIZE 32
@@ -51,6 +344,10 @@ enum RXState
 {
     RX_STATE_HEADER,
     RX_STATE_LENGTH,
+#if BUFFER_SIZE > 0xFF
+    RX_STATE_LONG_LENGTH_LSB,
+    RX_STATE_LONG_LENGTH_MSB,
+#endif
     RX_STATE_DATA,
     RX_STATE_CRC_LSB,
     RX_STATE_CRC_MSB
@@ -58,13 +355,19 @@ enum RXState
 
 #define REQUEST_MASK_FORCE 0x01
 #define REQUEST_MASK_PROGRAM 0x02
+#define REQUEST_MASK_COMPRESSED 0x04
 #define REQUEST_MASK_PROGRAM_MEMORY 0x08
 #define REQUEST_MASK_DATA_EEPROM 0x10
+#define REQUEST_MASK_MASKED 0x40 // program memory only
+#define REQUEST_MASK_SEQUENCE 0x80
+
+#define NAK_RESPONSE_ID 0x00 // the response to a frame with a wrong CRC (protocol version 2)
 
 #define MODIFY_STATUS_MASK_ERASE_DONE 0x01
 #define MODIFY_STATUS_MASK_ERROR_ERASE 0x02
 #define MODIFY_STATUS_MASK_PROGRAM_DONE 0x04
 #define MODIFY_STATUS_MASK_ERROR_PROGRAM 0x08
+#define MODIFY_STATUS_MASK_ERASE_AVOIDED 0x10 // the row is programmed without the erase (only 1 -> 0 bit changes)
 
 struct StartCommunicationResponse
 {
@@ -73,6 +376,17 @@ struct StartCommunicationResponse
     uint8_t signature[8]; // dsPIC30F
     uint16_t bootloaderSize;
     uint32_t bootloaderBaseAddress;
+    // protocol version 2
+    uint16_t rxQueueSize;
+    uint16_t capabilities; // CAPABILITY_MASK*
+    uint16_t maxPacketSize;
+    uint16_t baudRates; // BAUD_RATE_MASK
+    uint16_t deviceId;
+    uint16_t configWords[CONFIG_WORD_COUNT];
+#ifdef UART_RX_INTERRUPT_USED
+    uint32_t rxHandlerAddress; // written to the alternate vector by the host
+    uint16_t rxVectorAddress;
+#endif
 };
 
 struct ReadFlashMemoryRequest
@@ -88,12 +402,183 @@ struct ReadFlashMemoryResponse
     uint8_t data[96];
 };
 
+struct ReadFlashMemoryRangeRequest
+{
+    uint8_t requestId; // 0x02
+    uint8_t tblpag;
+    uint16_t offset;
+    uint8_t rowCount;
+};
+
+struct ReadFlashMemoryRangeResponse
+{
+    uint8_t responseId; // 0xFD
+    uint8_t rowIndex;
+    uint8_t data[96];
+};
+
+struct SwitchBaudRateRequest
+{
+    uint8_t requestId; // 0x04
+    uint8_t reserved[3];
+    uint32_t baudRate;
+};
+
+struct SwitchBaudRateResponse
+{
+    uint8_t responseId; // 0xFB
+    uint8_t status; // 0 - switched, 1 - not supported
+    uint16_t reserved;
+    uint32_t baudRate; // actual baud rate
+};
+
+struct CalculateRangeCrcRequest
+{
+    uint8_t requestId; // 0x05
+    uint8_t tblpag;
+    uint16_t offset;
+    uint16_t rowCount;
+    uint8_t flags; // RANGE_CRC_FLAG*
+};
+
+struct CalculateRangeCrcResponse
+{
+    uint8_t responseId; // 0xFA
+    uint8_t reserved[3];
+    uint32_t crc; // CRC-32
+};
+
+struct CalculateRowDigestsRequest
+{
+    uint8_t requestId; // 0x06
+    uint8_t tblpag;
+    uint16_t offset;
+    uint8_t rowCount;
+    uint8_t flags; // ROW_DIGESTS_FLAG*
+};
+
+struct CalculateRowDigestsResponse
+{
+    uint8_t responseId; // 0xF9
+    uint8_t reserved;
+    uint16_t digests[MAX_ROW_DIGEST_COUNT]; // CRC-16/MCRF4XX of each row
+};
+
+struct BlankCheckRequest
+{
+    uint8_t requestId; // 0x07
+    uint8_t tblpag;
+    uint16_t offset;
+    uint16_t rowCount;
+    uint8_t flags; // BLANK_CHECK_FLAG*
+};
+
+struct BlankCheckResponse
+{
+    uint8_t responseId; // 0xF8
+    uint8_t reserved[3];
+    uint8_t bitmap[MAX_BLANK_CHECK_ROW_COUNT / 8]; // bit is set if the row is not blank, LSB first
+};
+
+struct EraseRangeRequest
+{
+    uint8_t requestId; // 0x20
+    uint8_t tblpag;
+    uint16_t offset;
+    uint16_t rowCount;
+    uint8_t flags; // ERASE_RANGE_FLAG*
+};
+
+struct EraseRangeResponse
+{
+    uint8_t responseId; // 0xDF
+    uint8_t status; // MODIFY_STATUS_MASK*
+    uint16_t rowCount; // the processed rows, the error row index if an error
+    uint16_t eraseCount;
+};
+
+struct EEPROMWord
+{
+    uint16_t offset;
+    uint16_t data;
+};
+
+struct WriteEEPROMWordsRequest
+{
+    uint8_t requestId; // 0x21
+    uint8_t tblpag;
+    struct EEPROMWord words[MAX_EEPROM_WORD_COUNT];
+};
+
+struct WriteEEPROMWordsResponse
+{
+    uint8_t responseId; // 0xDE
+    uint8_t status; // MODIFY_STATUS_MASK*
+    uint8_t wordCount; // the processed words, the error word index if an error
+    uint8_t eraseCount;
+    uint8_t programCount;
+};
+
+struct LinkTestRequest
+{
+    uint8_t requestId; // 0x22
+    uint8_t flags; // LINK_TEST_FLAG*
+    uint8_t data[BUFFER_SIZE - 3]; // with the sequence byte
+};
+
+// the echo response is the request data with the response ID
+struct LinkTestResponse
+{
+    uint8_t responseId; // 0xDD
+    uint8_t flags;
+    uint16_t size; // the received data size
+};
+
+struct BroadcastStatusResponse
+{
+    uint8_t responseId; // 0xDC
+    uint8_t status; // MODIFY_STATUS_MASK* of all broadcast requests
+    uint16_t requestCount; // the executed broadcast requests
+};
+
+#ifdef DIAGNOSTICS_USED
+// the counters wrap around, the host reads them with the clear flag before the operation
+struct Diagnostics
+{
+    uint16_t frameCount; // the received frames with the right CRC
+    uint16_t crcErrorCount; // the received frames with a wrong CRC
+    uint16_t droppedFrameCount; // the frames not completed (a wrong byte stuffing, a new start byte, a wrong length)
+    uint16_t overrunCount; // the UART receive buffer overruns
+    uint16_t rowTestCount; // the row compare passes (the blank, data and bit clearing tests)
+    uint16_t skippedRowCount; // the rows not erased and not programmed, they already have the data
+    uint16_t eraseCount; // the erase operations
+    uint16_t programCount; // the program operations
+    uint32_t rowTicks; // the row modify time including the tests, the erase and program operations
+    uint32_t eraseTicks;
+    uint32_t programTicks;
+};
+
+struct ReadDiagnosticsRequest
+{
+    uint8_t requestId; // 0x24
+    uint8_t flags; // DIAGNOSTICS_FLAG*
+};
+
+struct ReadDiagnosticsResponse
+{
+    uint8_t responseId; // 0xDB
+    uint8_t reserved[3];
+    uint32_t tickFrequency; // DIAGNOSTICS_TICK_FREQUENCY
+    struct Diagnostics diagnostics;
+};
+#endif
+
 struct ModifyFlashMemoryRequest
 {
     uint8_t requestId; // REQUEST_MASK*
     uint8_t tblpag;
     uint16_t offset;
-    uint8_t data[96];
+    uint8_t data[96 + 4]; // the masked request has the word mask after the data
 };
 
 struct ModifyFlashMemoryResponse
@@ -102,59 +587,266 @@ struct ModifyFlashMemoryResponse
     uint8_t status;
 };
 
+// the response to the request with several rows
+struct ModifyFlashMemoryRowsResponse
+{
+    uint8_t responseId; // 0xFF - WriteFlashMemoryRequest.requestId
+    uint8_t status; // the bits of all rows
+    uint8_t rowCount; // the processed rows, the error row index if an error
+    uint8_t eraseCount;
+    uint8_t programCount;
+    uint8_t eraseAvoidedCount;
+};
+
 static enum RXState rxState = RX_STATE_HEADER;
 static bool rxAD = false; // if the previous byte is 0xAD
 static unsigned rxSize; 
 
+static uint8_t rxQueue[RX_QUEUE_SIZE];
+static unsigned rxQueueHead = 0;
+static unsigned rxQueueTail = 0;
+
+#ifdef TX_QUEUE_SIZE
+static uint8_t txQueue[TX_QUEUE_SIZE];
+static unsigned txQueueHead = 0;
+static unsigned txQueueTail = 0;
+#endif
+
+#ifdef UART_RX_INTERRUPT_USED
+static bool rxInterruptUsed = false; // the alternate vector points to the handler
+#endif
+
 static union
 {
     uint8_t bytes[BUFFER_SIZE];
     struct StartCommunicationResponse startCommunicationResponse;
     struct ReadFlashMemoryRequest readFlashMemoryReqest;
     struct ReadFlashMemoryResponse readFlashMemoryResponse;
+    struct ReadFlashMemoryRangeRequest readFlashMemoryRangeRequest;
+    struct ReadFlashMemoryRangeResponse readFlashMemoryRangeResponse;
+    struct SwitchBaudRateRequest switchBaudRateRequest;
+    struct SwitchBaudRateResponse switchBaudRateResponse;
+    struct CalculateRangeCrcRequest calculateRangeCrcRequest;
+    struct CalculateRangeCrcResponse calculateRangeCrcResponse;
+    struct CalculateRowDigestsRequest calculateRowDigestsRequest;
+    struct CalculateRowDigestsResponse calculateRowDigestsResponse;
+    struct BlankCheckRequest blankCheckRequest;
+    struct BlankCheckResponse blankCheckResponse;
+    struct EraseRangeRequest eraseRangeRequest;
+    struct EraseRangeResponse eraseRangeResponse;
+    struct WriteEEPROMWordsRequest writeEEPROMWordsRequest;
+    struct WriteEEPROMWordsResponse writeEEPROMWordsResponse;
+    struct LinkTestRequest linkTestRequest;
+    struct LinkTestResponse linkTestResponse;
+    struct BroadcastStatusResponse broadcastStatusResponse;
+#ifdef DIAGNOSTICS_USED
+    struct ReadDiagnosticsRequest readDiagnosticsRequest;
+    struct ReadDiagnosticsResponse readDiagnosticsResponse;
+#endif
     struct ModifyFlashMemoryRequest modifyFlashMemoryRequest;
     struct ModifyFlashMemoryResponse modifyFlashMemoryResponse;
+    struct ModifyFlashMemoryRowsResponse modifyFlashMemoryRowsResponse;
 } buffer;
 static unsigned bufferSize;
+static uint8_t *rowData; // the data of the current row of the modify request
 
 static uint16_t crc;
+#ifdef RANGE_CRC_USED
+static uint32_t rangeCrc;
+#endif
+
+static bool sequenceUsed; // if the current request has a sequence number
+static uint8_t sequence;
 
 static bool communicationStarted = false;
+#ifdef FAST_BOOT_USED
+static bool fastBoot = false; // no update is requested, the target firmware is started without WAIT_DELAY_MS
+#endif
+static bool nakEnabled = false; // the host supports the protocol version 2
+
+#ifdef NODE_ADDRESS
+static bool broadcast; // the current request has the broadcast address
+static uint8_t broadcastStatus = 0;
+static uint16_t broadcastCount = 0;
+#endif
+
+#ifdef DIAGNOSTICS_USED
+static struct Diagnostics diagnostics;
+#endif
+
+#ifdef SWITCH_BAUD_RATE_USED
+static uint8_t baudRateFallbackTicks = 0; // 0 if the current baud rate is confirmed by a received packet
+#endif
 
 extern void BOOTLOADER_BASE_ADDRESS(void);
 extern void BOOTLOADER_SIZE(void);
+#ifdef ERASE_RANGE_USED
+extern void DATA_EEPROM_ADDRESS(void); // 0x800000 if the device has no data EEPROM
+#endif
 
 static uint32_t bootloaderBaseAddress;
 static uint16_t bootloaderSize;
 
+#ifdef BOOT_OSCILLATOR
+static uint8_t resetOscillator; // the oscillator selected by the FOSC fuse, it is restored for the target firmware
+#endif
+
+// CRC-16/MCRF4XX of the 4-bit values, the table is read by PSV from the program memory (no RAM is used)
+static const uint16_t __attribute__((space(psv))) crcTable[16] =
+{
+    0x0000, 0x1081, 0x2102, 0x3183, 0x4204, 0x5285, 0x6306, 0x7387,
+    0x8408, 0x9489, 0xA50A, 0xB58B, 0xC60C, 0xD68D, 0xE70E, 0xF78F
+};
+
 static inline void crc_init(void)
 {
     crc = 0xFFFF;
 }
 
+// 2 table steps instead of 8 bit steps
 static void crcAppendByte(uint8_t byte)
 {
-    unsigned i;
     crc ^= byte;
-    for (i = 0; i < 8; ++i)
+    crc = (crc >> 4) ^ crcTable[crc & 0x0F];
+    crc = (crc >> 4) ^ crcTable[crc & 0x0F];
+}
+
+#ifdef RANGE_CRC_USED
+// CRC-32 (reflected 0x04C11DB7) of the 4-bit values, the bit steps are too slow for the 64 rows of the request
+static const uint32_t __attribute__((space(psv))) rangeCrcTable[16] =
+{
+    0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+    0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+};
+
+// PSVPAG shall select rangeCrcTable
+static void rangeCrcAppendByte(uint8_t byte)
+{
+    rangeCrc ^= byte;
+    rangeCrc = (rangeCrc >> 4) ^ rangeCrcTable[rangeCrc & 0x0F];
+    rangeCrc = (rangeCrc >> 4) ^ rangeCrcTable[rangeCrc & 0x0F];
+}
+#endif
+
+// moves the received bytes from the UART to the receive queue
+static void uartReceive(void)
+{
+    unsigned head;
+    while ((BOOT_UART.uxsta & (1 << 0)) != 0) // test URXDA
     {
-        if ((crc & 0x0001) != 0)
-        {
-            crc >>= 1;
-            crc ^= 0x8408;
-        }
-        else
-        {
-            crc >>= 1;
-        }
+        head = (rxQueueHead + 1) & (RX_QUEUE_SIZE - 1);
+        if (head == rxQueueTail) break; // the queue is full
+        rxQueue[rxQueueHead] = BOOT_UART.uxrxreg;
+        rxQueueHead = head;
+    }
+    if ((BOOT_UART.uxsta & (1 << 1)) != 0) DIAGNOSTICS_COUNT(overrunCount);
+    BOOT_UART.uxsta &= ~(1 << 1); // clear receive buffer overrun error bit (OERR)
+
+#ifdef FLOW_CONTROL_USED
+    if (((rxQueueHead - rxQueueTail) & (RX_QUEUE_SIZE - 1)) >= RX_QUEUE_SIZE - CTS_QUEUE_MARGIN) CTS_LAT = CTS_OFF;
+#endif
+}
+
+#ifdef UART_RX_INTERRUPT_USED
+// the bytes are received while the bootloader calculates CRC or tests the rows,
+// the CPU is still stalled during the program memory erase and program operations
+void __attribute__((interrupt, no_auto_psv)) uartRxInterrupt(void)
+{
+    UART_RX_IF = 0;
+    uartReceive();
+}
+
+// the interrupt is enabled only if the alternate vector points to the handler,
+// the host writes the vector with the target firmware, so it can be erased
+static void uartCheckRxVector(void)
+{
+    uint32_t handlerAddress = __builtin_tbladdress(uartRxInterrupt);
+
+    TBLPAG = UART_RX_VECTOR_ADDRESS >> 16;
+    rxInterruptUsed =
+        (__builtin_tblrdl((uint16_t)UART_RX_VECTOR_ADDRESS) == (uint16_t)handlerAddress)
+        && (__builtin_tblrdh((uint16_t)UART_RX_VECTOR_ADDRESS) == (uint16_t)(handlerAddress >> 16));
+    UART_RX_IE = rxInterruptUsed;
+}
+#endif
+
+#ifdef TX_QUEUE_SIZE
+// moves the bytes from the transmit queue to the UART FIFO while it is not full
+static void uartTransmit(void)
+{
+    while ((txQueueHead != txQueueTail) && ((BOOT_UART.uxsta & (1 << 9)) == 0)) // test UTXBF
+    {
+        BOOT_UART.uxtxreg = txQueue[txQueueTail];
+        txQueueTail = (txQueueTail + 1) & (TX_QUEUE_SIZE - 1);
+    }
+}
+#endif
+
+// polls the UART, the interrupt handler does not change the receive queue at the same time
+static void uartRead(void)
+{
+#ifdef UART_RX_INTERRUPT_USED
+    UART_RX_IE = 0;
+#endif
+    uartReceive();
+#ifdef UART_RX_INTERRUPT_USED
+    UART_RX_IE = rxInterruptUsed;
+#endif
+#ifdef TX_QUEUE_SIZE
+    // the response is transmitted while the next request is received and processed
+    uartTransmit();
+#endif
+}
+
+#ifdef FLOW_CONTROL_USED
+// stops the PC before the CPU is stalled, the bytes sent after CTS off are moved to the receive queue
+static void uartStop(void)
+{
+    CTS_LAT = CTS_OFF;
+    __delay32(CTS_STOP_BYTES * 10UL * 16 * (BOOT_UART.uxbrg + 1)); // the bytes fit the UART FIFO
+    uartRead();
+}
+#else
+// the PC sends the pipelined program memory requests together and waits for their responses,
+// so the rest of them is moved to the receive queue before the CPU is stalled
+static void uartStop(void)
+{
+    unsigned idleBytes = 0;
+    unsigned head;
+
+    if (!sequenceUsed) return; // the protocol version 1 requests are not pipelined
+    while (idleBytes < UART_IDLE_BYTES)
+    {
+        head = rxQueueHead;
+        __delay32(10UL * 16 * (BOOT_UART.uxbrg + 1)); // one byte, it fits the UART FIFO
+        uartRead();
+        idleBytes = (rxQueueHead == head) ? idleBytes + 1 : 0;
+    }
+}
+#endif
+
+#ifdef TX_QUEUE_SIZE
+static void uartWrite(uint8_t data)
+{
+    unsigned head = (txQueueHead + 1) & (TX_QUEUE_SIZE - 1);
+    while (head == txQueueTail) // the queue is full
+    {
+        uartRead();
+#ifdef WDT_ENABLED
+        __builtin_clrwdt();
+#endif
     }
-}
 
+    txQueue[txQueueHead] = data;
+    txQueueHead = head;
+    uartTransmit();
+}
+#else
 static void uartWrite(uint8_t data)
 {
     while ((BOOT_UART.uxsta & (1 << 9)) != 0) // UTXBF
     {
-        // an empty loop
+        uartRead();
 #ifdef WDT_ENABLED
         __builtin_clrwdt();
 #endif
@@ -162,6 +854,35 @@ static void uartWrite(uint8_t data)
     
     BOOT_UART.uxtxreg = data;
 }
+#endif
+
+// waits until all bytes are transmitted
+static void uartFlush(void)
+{
+    while (
+#ifdef TX_QUEUE_SIZE
+        (txQueueHead != txQueueTail) ||
+#endif
+        ((BOOT_UART.uxsta & (1 << 8)) == 0)) // test TRMT
+    {
+        uartRead();
+#ifdef WDT_ENABLED
+        __builtin_clrwdt();
+#endif
+    }
+}
+
+#ifdef SWITCH_BAUD_RATE_USED
+static void uartSetBRG(uint16_t brg)
+{
+    uartFlush();
+    BOOT_UART.uxbrg = brg;
+
+    // drop the bytes received at the previous baud rate
+    rxQueueTail = rxQueueHead;
+    rxState = RX_STATE_HEADER;
+}
+#endif
 
 static void uartWriteWithAD(uint8_t data)
 {
@@ -185,9 +906,37 @@ static void writeResponse(void)
 {
     unsigned i;
     crc_init();
+
+#ifdef NODE_ADDRESS
+    if (broadcast)
+    {
+        // the second byte of the write responses is the status, the 'Start communication' response has no status
+        if (buffer.bytes[0] != 0xFF) broadcastStatus |= buffer.bytes[1];
+        ++broadcastCount;
+        return;
+    }
+#endif
+    
+    if (sequenceUsed) buffer.bytes[bufferSize++] = sequence;
+#ifdef NODE_ADDRESS
+    buffer.bytes[bufferSize++] = NODE_ADDRESS;
+    DE_LAT = DE_ON;
+#endif
     
     uartWrite(0xAE);
-    uartWriteWithAD(bufferSize);
+#if BUFFER_SIZE > 0xFF
+    if (bufferSize > 0xFF)
+    {
+        // the long frame, the zero length byte is followed by the 16-bit length
+        uartWrite(0x00);
+        uartWriteWithAD(bufferSize);
+        uartWriteWithAD(bufferSize >> 8);
+    }
+    else
+#endif
+    {
+        uartWriteWithAD(bufferSize);
+    }
     
     for (i = 0; i < bufferSize; ++i)
     {
@@ -197,6 +946,69 @@ static void writeResponse(void)
     
     uartWriteWithAD(crc);
     uartWriteWithAD(crc >> 8);
+
+#ifdef NODE_ADDRESS
+    // the bus is released for the other nodes
+    uartFlush();
+    DE_LAT = DE_OFF;
+
+    // the response is received back if the transceiver receiver is always enabled (/RE low), the echo passes
+    // the address filter (the response ID without bit 7 can be a request ID), so it is dropped
+    do
+    {
+        rxQueueTail = rxQueueHead;
+        uartRead();
+    }
+    while (rxQueueTail != rxQueueHead);
+    rxState = RX_STATE_HEADER;
+#endif
+}
+
+#ifdef DIAGNOSTICS_USED
+// Timer1 ticks since the start value, the time shall be shorter than the Timer1 period (100 ms)
+static uint16_t timerTicksSince(uint16_t startTicks)
+{
+    uint16_t ticks = TMR1;
+    return (ticks >= startTicks) ? ticks - startTicks : ticks + PR1 + 1 - startTicks;
+}
+#endif
+
+// starts the erase or program operation set in NVMCON and waits for the end,
+// the CPU is stalled during the program memory operations, the UART is polled during the data EEPROM ones
+static void nvmWrite(void)
+{
+#ifdef DIAGNOSTICS_USED
+    uint16_t startTicks = TMR1;
+    bool erase = ((NVMCON & (1 << 6)) != 0); // test ERASE
+#endif
+
+#ifdef WDT_ENABLED
+    __builtin_clrwdt();
+#endif
+    __builtin_write_NVM();
+    while (NVMCONbits.WR)
+    {
+        uartRead();
+#ifdef WDT_ENABLED
+        __builtin_clrwdt();
+#endif
+    }
+#ifdef WDT_ENABLED
+    __builtin_clrwdt();
+#endif
+
+#ifdef DIAGNOSTICS_USED
+    if (erase)
+    {
+        ++diagnostics.eraseCount;
+        diagnostics.eraseTicks += timerTicksSince(startTicks);
+    }
+    else
+    {
+        ++diagnostics.programCount;
+        diagnostics.programTicks += timerTicksSince(startTicks);
+    }
+#endif
 }
 
 // TBLPAG should be set
@@ -205,6 +1017,7 @@ static bool testErasedProgramMemory(void)
     unsigned i;
     uint16_t offset = buffer.modifyFlashMemoryRequest.offset;
             
+    DIAGNOSTICS_COUNT(rowTestCount);
     for (i = 0; i < PROGRAM_MEMORY_ROW_SIZE / 2; ++i)
     {
         if ((__builtin_tblrdl(offset) != 0xFFFF)
@@ -224,8 +1037,9 @@ static bool testProgramMemory(void)
     uint16_t data;
     unsigned i;
     uint16_t offset = buffer.modifyFlashMemoryRequest.offset;
-    uint8_t *p = buffer.modifyFlashMemoryRequest.data;
+    uint8_t *p = rowData;
 
+    DIAGNOSTICS_COUNT(rowTestCount);
     for (i = 0; i < PROGRAM_MEMORY_ROW_SIZE / 2; ++i)
     {
         data = *(p++);
@@ -241,12 +1055,42 @@ static bool testProgramMemory(void)
     return true;
 }
 
+#ifdef ERASE_AVOIDANCE_USED
+// TBLPAG should be set
+// if the new data only clears bits of the current data, so the row can be programmed without the erase
+static bool testClearingProgramMemory(void)
+{
+    uint16_t data;
+    uint8_t high;
+    unsigned i;
+    uint16_t offset = buffer.modifyFlashMemoryRequest.offset;
+    uint8_t *p = rowData;
+
+    DIAGNOSTICS_COUNT(rowTestCount);
+    for (i = 0; i < PROGRAM_MEMORY_ROW_SIZE / 2; ++i)
+    {
+        data = *(p++);
+        data |= (uint16_t)*(p++) << 8;
+        high = *(p++);
+        if (((__builtin_tblrdl(offset) & data) != data)
+            || ((__builtin_tblrdh(offset) & high) != high))
+        {
+            return false;
+        }
+        offset += 2;
+    }
+    
+    return true;
+}
+#endif
+
 // TBLPAG should be set
 static bool testErasedDataEEPROM(void)
 {
     unsigned i;
     uint16_t offset = buffer.modifyFlashMemoryRequest.offset;
             
+    DIAGNOSTICS_COUNT(rowTestCount);
     for (i = 0; i < DATA_EEPROM_ROW_SIZE / 2; ++i)
     {
         if (__builtin_tblrdl(offset) != 0xFFFF) return false;
@@ -256,14 +1100,37 @@ static bool testErasedDataEEPROM(void)
     return true;
 }
 
+#ifdef ERASE_AVOIDANCE_USED
+// TBLPAG should be set
+// if the new data only clears bits of the current data, so the row can be programmed without the erase
+static bool testClearingDataEEPROM(void)
+{
+    uint16_t data;
+    unsigned i;
+    uint16_t offset = buffer.modifyFlashMemoryRequest.offset;
+    uint16_t *p = (uint16_t*)rowData;
+
+    DIAGNOSTICS_COUNT(rowTestCount);
+    for (i = 0; i < DATA_EEPROM_ROW_SIZE / 2; ++i)
+    {
+        data = *(p++);
+        if ((__builtin_tblrdl(offset) & data) != data) return false;
+        offset += 2;
+    }
+    
+    return true;
+}
+#endif
+
 // TBLPAG should be set
 static bool testDataEEPROM(void)
 {
     uint16_t data;
     unsigned i;
     uint16_t offset = buffer.modifyFlashMemoryRequest.offset;
-    uint16_t *p = (uint16_t*)buffer.modifyFlashMemoryRequest.data;
+    uint16_t *p = (uint16_t*)rowData;
 
+    DIAGNOSTICS_COUNT(rowTestCount);
     for (i = 0; i < DATA_EEPROM_ROW_SIZE / 2; ++i)
     {
         data = *(p++);
@@ -276,8 +1143,16 @@ static bool testDataEEPROM(void)
 
 static void startCommunicationPacket(void)
 {
+    unsigned i;
+
+    // the optional second request byte is the protocol version supported by the host
+    bool version2 = ((bufferSize >= 2) && (buffer.bytes[1] >= 2));
+
     buffer.startCommunicationResponse.responseId = 0xFF;
-    buffer.startCommunicationResponse.protocolVersion = 1;
+    buffer.startCommunicationResponse.protocolVersion = version2 ? 2 : 1;
+#ifndef NODE_ADDRESS
+    nakEnabled = version2; // the address of a corrupted frame is not known on the multi-drop bus
+#endif
     buffer.startCommunicationResponse.signature[0] = 'd';
     buffer.startCommunicationResponse.signature[1] = 's';
     buffer.startCommunicationResponse.signature[2] = 'P';
@@ -288,23 +1163,47 @@ static void startCommunicationPacket(void)
     buffer.startCommunicationResponse.signature[7] = 'F';
     buffer.startCommunicationResponse.bootloaderSize = bootloaderSize;
     buffer.startCommunicationResponse.bootloaderBaseAddress = bootloaderBaseAddress;
+    buffer.startCommunicationResponse.rxQueueSize = RX_QUEUE_SIZE;
+    buffer.startCommunicationResponse.capabilities = CAPABILITY_MASK_READ_RANGE_USED | CAPABILITY_MASK_SWITCH_BAUD_RATE_USED
+        | CAPABILITY_MASK_COMPRESSED_WRITE_USED | CAPABILITY_MASK_RANGE_CRC_USED | CAPABILITY_MASK_ROW_DIGESTS_USED
+        | CAPABILITY_MASK_BLANK_CHECK_USED | CAPABILITY_MASK_FLOW_CONTROL_USED | CAPABILITY_MASK_ERASE_RANGE_USED
+        | CAPABILITY_MASK_WRITE_EEPROM_WORDS_USED | CAPABILITY_MASK_MASKED_WRITE_USED | CAPABILITY_MASK_MULTI_ROW_WRITE_USED
+        | CAPABILITY_MASK_LINK_TEST_USED | CAPABILITY_MASK_BROADCAST_USED | CAPABILITY_MASK_RX_INTERRUPT_USED
+        | CAPABILITY_MASK_DIAGNOSTICS_USED | CAPABILITY_MASK_DIRECT_VECTORS_USED;
+    buffer.startCommunicationResponse.maxPacketSize = BUFFER_SIZE;
+#ifdef SWITCH_BAUD_RATE_USED
+    buffer.startCommunicationResponse.baudRates = BAUD_RATE_MASK;
+#else
+    buffer.startCommunicationResponse.baudRates = 0;
+#endif
+
+    // the host does not need the separate read requests for the device ID and the config words
+    TBLPAG = 0xFF;
+    buffer.startCommunicationResponse.deviceId = __builtin_tblrdl(0x0000);
+    TBLPAG = 0xF8;
+    for (i = 0; i < CONFIG_WORD_COUNT; ++i)
+    {
+        buffer.startCommunicationResponse.configWords[i] = __builtin_tblrdl(i * 2);
+    }
+#ifdef UART_RX_INTERRUPT_USED
+    buffer.startCommunicationResponse.rxHandlerAddress = __builtin_tbladdress(uartRxInterrupt);
+    buffer.startCommunicationResponse.rxVectorAddress = UART_RX_VECTOR_ADDRESS;
+#endif
     
-    bufferSize = sizeof buffer.startCommunicationResponse;  
+    bufferSize = version2
+        ? sizeof buffer.startCommunicationResponse
+        : offsetof(struct StartCommunicationResponse, rxQueueSize);
     writeResponse();
     
     communicationStarted = true;
 }
 
-static void readFlashMemoryPacket(void)
+// TBLPAG should be set
+static void readRow(uint16_t offset, uint8_t *p)
 {
-    uint16_t offset = buffer.readFlashMemoryReqest.offset;
     uint16_t data;
     unsigned i;
-    
-    TBLPAG = buffer.readFlashMemoryReqest.tblpag;
 
-    buffer.readFlashMemoryResponse.responseId = 0xFE;
-    uint8_t *p = buffer.readFlashMemoryResponse.data;
     for (i = 0; i < PROGRAM_MEMORY_ROW_SIZE / 2; ++i)
     {
         data = __builtin_tblrdl(offset);
@@ -314,13 +1213,238 @@ static void readFlashMemoryPacket(void)
         *(p++) = data;
         offset += 2;
     }
+}
+
+static void readFlashMemoryPacket(void)
+{
+    TBLPAG = buffer.readFlashMemoryReqest.tblpag;
+
+    buffer.readFlashMemoryResponse.responseId = 0xFE;
+    readRow(buffer.readFlashMemoryReqest.offset, buffer.readFlashMemoryResponse.data);
     
     bufferSize = sizeof buffer.readFlashMemoryResponse;
     writeResponse();
 }
 
+#ifdef READ_RANGE_USED
+static void readFlashMemoryRangePacket(void)
+{
+    uint16_t offset = buffer.readFlashMemoryRangeRequest.offset;
+    uint8_t rowCount = buffer.readFlashMemoryRangeRequest.rowCount;
+    uint8_t rowIndex;
+
+    TBLPAG = buffer.readFlashMemoryRangeRequest.tblpag;
+
+    // one response for each row, the responses are sent without waiting for the next requests
+    for (rowIndex = 0; rowIndex < rowCount; ++rowIndex)
+    {
+        buffer.readFlashMemoryRangeResponse.responseId = 0xFD;
+        buffer.readFlashMemoryRangeResponse.rowIndex = rowIndex;
+        readRow(offset, buffer.readFlashMemoryRangeResponse.data);
+
+        bufferSize = sizeof buffer.readFlashMemoryRangeResponse;
+        writeResponse();
+
+        offset += PROGRAM_MEMORY_ROW_SIZE;
+        if (offset == 0) ++TBLPAG;
+    }
+}
+#endif
+
+#ifdef RANGE_CRC_USED
+static void calculateRangeCrcPacket(void)
+{
+    uint16_t offset = buffer.calculateRangeCrcRequest.offset;
+    uint16_t rowCount = buffer.calculateRangeCrcRequest.rowCount;
+    bool highByte = ((buffer.calculateRangeCrcRequest.flags & RANGE_CRC_FLAG_HIGH_BYTE) != 0);
+    uint8_t *p;
+    unsigned i;
+
+    TBLPAG = buffer.calculateRangeCrcRequest.tblpag;
+    PSVPAG = __builtin_psvpage(rangeCrcTable); // the tables can be in the different pages
+
+    rangeCrc = 0xFFFFFFFF;
+    while (rowCount-- != 0)
+    {
+        // the row is read to the response data area
+        p = buffer.readFlashMemoryResponse.data;
+        readRow(offset, p);
+        for (i = 0; i < PROGRAM_MEMORY_ROW_SIZE / 2; ++i)
+        {
+            rangeCrcAppendByte(*(p++));
+            rangeCrcAppendByte(*(p++));
+            if (highByte) rangeCrcAppendByte(*p);
+            ++p;
+            
+            // the calculation is long, the next requests can be received
+            uartRead();
+#ifdef WDT_ENABLED
+            __builtin_clrwdt();
+#endif
+        }
+
+        offset += PROGRAM_MEMORY_ROW_SIZE;
+        if (offset == 0) ++TBLPAG;
+    }
+    PSVPAG = __builtin_psvpage(crcTable);
+
+    buffer.calculateRangeCrcResponse.responseId = 0xFA;
+    buffer.calculateRangeCrcResponse.reserved[0] = 0;
+    buffer.calculateRangeCrcResponse.reserved[1] = 0;
+    buffer.calculateRangeCrcResponse.reserved[2] = 0;
+    buffer.calculateRangeCrcResponse.crc = ~rangeCrc;
+
+    bufferSize = sizeof buffer.calculateRangeCrcResponse;
+    writeResponse();
+}
+#endif
+
+#ifdef ROW_DIGESTS_USED
+static void calculateRowDigestsPacket(void)
+{
+    uint16_t offset = buffer.calculateRowDigestsRequest.offset;
+    uint8_t rowCount = buffer.calculateRowDigestsRequest.rowCount;
+    bool programMemory = ((buffer.calculateRowDigestsRequest.flags & ROW_DIGESTS_FLAG_PROGRAM_MEMORY) != 0);
+    unsigned wordCount = programMemory ? PROGRAM_MEMORY_ROW_SIZE / 2 : DATA_EEPROM_ROW_SIZE / 2;
+    uint16_t *digest = buffer.calculateRowDigestsResponse.digests;
+    uint16_t data;
+    unsigned i;
+
+    if (rowCount > MAX_ROW_DIGEST_COUNT) return;
+
+    TBLPAG = buffer.calculateRowDigestsRequest.tblpag;
+
+    buffer.calculateRowDigestsResponse.responseId = 0xF9;
+    buffer.calculateRowDigestsResponse.reserved = 0;
+    bufferSize = offsetof(struct CalculateRowDigestsResponse, digests) + rowCount * sizeof(uint16_t);
+
+    // the response CRC is calculated by writeResponse() later, so the CRC variable can be used here
+    while (rowCount-- != 0)
+    {
+        crc_init();
+        for (i = 0; i < wordCount; ++i)
+        {
+            data = __builtin_tblrdl(offset);
+            crcAppendByte(data);
+            crcAppendByte(data >> 8);
+            if (programMemory) crcAppendByte(__builtin_tblrdh(offset));
+            offset += 2;
+
+            uartRead();
+#ifdef WDT_ENABLED
+            __builtin_clrwdt();
+#endif
+        }
+        if (offset == 0) ++TBLPAG;
+
+        *(digest++) = crc;
+    }
+
+    writeResponse();
+}
+#endif
+
+#ifdef BLANK_CHECK_USED
+static void blankCheckPacket(void)
+{
+    uint16_t rowCount = buffer.blankCheckRequest.rowCount;
+    bool programMemory = ((buffer.blankCheckRequest.flags & BLANK_CHECK_FLAG_PROGRAM_MEMORY) != 0);
+    uint8_t *p = buffer.blankCheckResponse.bitmap;
+    uint8_t mask = 0x01;
+
+    if (rowCount > MAX_BLANK_CHECK_ROW_COUNT) return;
+
+    TBLPAG = buffer.blankCheckRequest.tblpag;
+    bufferSize = offsetof(struct BlankCheckResponse, bitmap) + (rowCount + 7) / 8;
+
+    // the request offset is the same field as buffer.modifyFlashMemoryRequest.offset used by testErased*(),
+    // it is not overlapped by the bitmap
+    while (rowCount-- != 0)
+    {
+        if (mask == 0x01) *p = 0;
+        if (programMemory ? !testErasedProgramMemory() : !testErasedDataEEPROM()) *p |= mask;
+        mask <<= 1;
+        if (mask == 0)
+        {
+            mask = 0x01;
+            ++p;
+        }
+
+        buffer.modifyFlashMemoryRequest.offset += programMemory ? PROGRAM_MEMORY_ROW_SIZE : DATA_EEPROM_ROW_SIZE;
+        if (buffer.modifyFlashMemoryRequest.offset == 0) ++TBLPAG;
+
+        uartRead();
+#ifdef WDT_ENABLED
+        __builtin_clrwdt();
+#endif
+    }
+
+    buffer.blankCheckResponse.responseId = 0xF8;
+    buffer.blankCheckResponse.reserved[0] = 0;
+    buffer.blankCheckResponse.reserved[1] = 0;
+    buffer.blankCheckResponse.reserved[2] = 0;
+
+    writeResponse();
+}
+#endif
+
+#ifdef BOOT_OSCILLATOR
+// the builtins write the unlock sequences, returns false if the oscillator is not ready in time
+static bool switchOscillator(uint8_t oscillator)
+{
+    unsigned timeout = 0xFFFF;
+
+    if (OSCCONbits.COSC == oscillator) return true;
+
+    __builtin_write_OSCCONH(oscillator); // NOSC, the other bits are read-only
+    __builtin_write_OSCCONL((uint8_t)OSCCON | 0x01); // OSWEN = 1
+    while (OSCCONbits.OSWEN != 0)
+    {
+        if (--timeout == 0) return false;
+#ifdef WDT_ENABLED
+        __builtin_clrwdt();
+#endif
+    }
+
+    return (OSCCONbits.COSC == oscillator);
+}
+#endif
+
+#ifdef FAST_BOOT_USED
+// the RAM request is cleared, so the next reset starts the target firmware again
+static bool updateRequested(void)
+{
+    bool requested = false;
+
+#ifdef UPDATE_REQUEST_ADDRESS
+    volatile uint16_t *updateRequest = (volatile uint16_t*)UPDATE_REQUEST_ADDRESS;
+    if (*updateRequest == UPDATE_REQUEST_MAGIC)
+    {
+        *updateRequest = 0x0000;
+        requested = true;
+    }
+#endif
+
+#ifdef UPDATE_PIN
+    if (UPDATE_PIN == UPDATE_PIN_ACTIVE) requested = true;
+#endif
+
+    return requested;
+}
+#endif
+
 static void startFirmware(void)
 {
+#ifdef UART_RX_INTERRUPT_USED
+    UART_RX_IE = 0;
+#endif
+#ifdef DIRECT_VECTORS_USED
+    // the interrupts of the target firmware do not pass the jump table
+    INTCON2bits.ALTIVT = 1;
+#elif defined(UART_RX_INTERRUPT_USED)
+    INTCON2bits.ALTIVT = 0;
+#endif
+
     // restore peripheral register values
     BOOT_UART.uxsta = 0x0000;
     BOOT_UART.uxmode = 0x0000;
@@ -333,10 +1457,30 @@ static void startFirmware(void)
 	LED_LAT = 0;
 #endif
 
+#ifdef FLOW_CONTROL_USED
+    CTS_TRIS = 1;
+    CTS_LAT = 0;
+#endif
+
+#ifdef NODE_ADDRESS
+    DE_TRIS = 1;
+    DE_LAT = 0;
+#endif
+
     ADPCFG = 0x0000;
+    CORCON &= ~(1 << 2); // PSV = 0
+    PSVPAG = 0x0000;
+
+#ifdef BOOT_OSCILLATOR
+    // the UART is off, so the clock can be switched
+    switchOscillator(resetOscillator);
+#endif
     
     // clear interrupt flags
     IFS0bits.T1IF = 0;
+#ifdef UART_RX_INTERRUPT_USED
+    UART_RX_IF = 0;
+#endif
     
 #ifdef WDT_ENABLED
         __builtin_clrwdt();
@@ -354,18 +1498,48 @@ static void startFirmwarePacket(void)
     bufferSize = 1;
     writeResponse();
 
-    // flush UART
-    while ((BOOT_UART.uxsta & (1 << 8)) == 0) // test TRMT
-    {
-        // an empty loop
-#ifdef WDT_ENABLED
-        __builtin_clrwdt();
-#endif
-    }
+    uartFlush();
     
     startFirmware();
 }
 
+#ifdef SWITCH_BAUD_RATE_USED
+static void switchBaudRatePacket(void)
+{
+    uint32_t baudRate = buffer.switchBaudRateRequest.baudRate;
+    uint32_t brg = 0x10000; // not supported
+    uint32_t actualBaudRate = 0;
+
+    if ((baudRate != 0) && (baudRate <= FCY / 8)) // UxBRG >= 0
+    {
+        brg = UART_BRG(baudRate);
+        actualBaudRate = FCY / (16 * (brg + 1));
+    }
+
+    buffer.switchBaudRateResponse.responseId = 0xFB;
+    buffer.switchBaudRateResponse.reserved = 0;
+    buffer.switchBaudRateResponse.baudRate = actualBaudRate;
+
+    // the error shall not be more than 2%
+    if ((brg > 0xFFFF)
+        || ((actualBaudRate > baudRate ? actualBaudRate - baudRate : baudRate - actualBaudRate) * 50 > baudRate))
+    {
+        buffer.switchBaudRateResponse.status = 1;
+        bufferSize = sizeof buffer.switchBaudRateResponse;
+        writeResponse();
+        return;
+    }
+
+    buffer.switchBaudRateResponse.status = 0;
+    bufferSize = sizeof buffer.switchBaudRateResponse;
+    writeResponse();
+
+    // the response is sent at the old baud rate
+    uartSetBRG(brg);
+    baudRateFallbackTicks = BAUD_RATE_FALLBACK_TICKS;
+}
+#endif
+
 static uint8_t modifyProgramMemoryInternal(void)
 {
     uint16_t offset;
@@ -375,6 +1549,16 @@ static uint8_t modifyProgramMemoryInternal(void)
     unsigned status = 0;
       
     TBLPAG = buffer.modifyFlashMemoryRequest.tblpag;
+
+#ifdef UART_RX_INTERRUPT_USED
+    // the vector row can be erased, the vector is checked again after the request
+    if ((buffer.modifyFlashMemoryRequest.tblpag == (UART_RX_VECTOR_ADDRESS >> 16))
+        && (buffer.modifyFlashMemoryRequest.offset == (uint16_t)(UART_RX_VECTOR_ADDRESS & ~(PROGRAM_MEMORY_ROW_SIZE - 1))))
+    {
+        rxInterruptUsed = false;
+        UART_RX_IE = 0;
+    }
+#endif
     
     if (((buffer.modifyFlashMemoryRequest.requestId & REQUEST_MASK_PROGRAM) != 0)
         && ((buffer.modifyFlashMemoryRequest.requestId & REQUEST_MASK_FORCE) == 0)
@@ -383,19 +1567,24 @@ static uint8_t modifyProgramMemoryInternal(void)
         return status;
     }
     
+#ifdef ERASE_AVOIDANCE_USED
+    // the erase is avoided if the new data only clears bits
+    if (((buffer.modifyFlashMemoryRequest.requestId & (REQUEST_MASK_PROGRAM | REQUEST_MASK_FORCE)) == REQUEST_MASK_PROGRAM)
+        && !testErasedProgramMemory()
+        && testClearingProgramMemory())
+    {
+        status |= MODIFY_STATUS_MASK_ERASE_AVOIDED;
+    }
+    else
+#endif
     if (((buffer.modifyFlashMemoryRequest.requestId & REQUEST_MASK_FORCE) != 0) 
         || !testErasedProgramMemory())
     {
         NVMCON = 0x4041;
         NVMADRU = buffer.modifyFlashMemoryRequest.tblpag;
         NVMADR = buffer.modifyFlashMemoryRequest.offset;
-#ifdef WDT_ENABLED
-        __builtin_clrwdt();
-#endif
-        __builtin_write_NVM();
-#ifdef WDT_ENABLED
-        __builtin_clrwdt();
-#endif
+        uartStop();
+        nvmWrite();
         status |= MODIFY_STATUS_MASK_ERASE_DONE;
         if (!testErasedProgramMemory())
         {
@@ -410,7 +1599,7 @@ static uint8_t modifyProgramMemoryInternal(void)
         {
             NVMCON = 0x4001;
             offset = buffer.modifyFlashMemoryRequest.offset;
-            p = buffer.modifyFlashMemoryRequest.data;
+            p = rowData;
             for (i = 0; i < PROGRAM_MEMORY_ROW_SIZE / 2; ++i)
             {
                 data = *(p++);
@@ -420,13 +1609,8 @@ static uint8_t modifyProgramMemoryInternal(void)
                 __builtin_tblwth(offset, data);
                 offset += 2;
             }
-#ifdef WDT_ENABLED
-            __builtin_clrwdt();
-#endif
-            __builtin_write_NVM();
-#ifdef WDT_ENABLED
-            __builtin_clrwdt();
-#endif
+            uartStop();
+            nvmWrite();
             status |= MODIFY_STATUS_MASK_PROGRAM_DONE;
             if (!testProgramMemory())
             {
@@ -438,16 +1622,6 @@ static uint8_t modifyProgramMemoryInternal(void)
     return status;
 }
 
-static void modifyProgramMemoryPacket(void)
-{
-    uint8_t status = modifyProgramMemoryInternal();
-    buffer.modifyFlashMemoryResponse.responseId = 0xFF - buffer.bytes[0];
-    buffer.modifyFlashMemoryResponse.status = status;
-    
-    bufferSize = sizeof buffer.modifyFlashMemoryResponse;
-    writeResponse();
-}
-
 static uint8_t modifyDataEEPROMInternal(void)
 {
     uint16_t offset;
@@ -465,23 +1639,23 @@ static uint8_t modifyDataEEPROMInternal(void)
         return status;
     }
     
+#ifdef ERASE_AVOIDANCE_USED
+    // the erase is avoided if the new data only clears bits
+    if (((buffer.modifyFlashMemoryRequest.requestId & (REQUEST_MASK_PROGRAM | REQUEST_MASK_FORCE)) == REQUEST_MASK_PROGRAM)
+        && !testErasedDataEEPROM()
+        && testClearingDataEEPROM())
+    {
+        status |= MODIFY_STATUS_MASK_ERASE_AVOIDED;
+    }
+    else
+#endif
     if (((buffer.modifyFlashMemoryRequest.requestId & REQUEST_MASK_FORCE) != 0) 
         || !testErasedDataEEPROM())
     {
         NVMCON = 0x4045;
         NVMADRU = buffer.modifyFlashMemoryRequest.tblpag;
         NVMADR = buffer.modifyFlashMemoryRequest.offset;
-#ifdef WDT_ENABLED
-        __builtin_clrwdt();
-#endif
-        __builtin_write_NVM();
-        while (NVMCONbits.WR)
-        {
-            // an empty loop
-#ifdef WDT_ENABLED
-            __builtin_clrwdt();
-#endif
-        }
+        nvmWrite();
         status |= MODIFY_STATUS_MASK_ERASE_DONE;
         if (!testErasedDataEEPROM())
         {
@@ -496,24 +1670,14 @@ static uint8_t modifyDataEEPROMInternal(void)
         {
             NVMCON = 0x4005;
             offset = buffer.modifyFlashMemoryRequest.offset;
-            p = (uint16_t*)buffer.modifyFlashMemoryRequest.data;
+            p = (uint16_t*)rowData;
             for (i = 0; i < DATA_EEPROM_ROW_SIZE / 2; ++i)
             {
                 data = *(p++);
                 __builtin_tblwtl(offset, data);
                 offset += 2;
             }
-#ifdef WDT_ENABLED
-            __builtin_clrwdt();
-#endif
-            __builtin_write_NVM();
-            while (NVMCONbits.WR)
-            {
-                // an empty loop
-#ifdef WDT_ENABLED
-                __builtin_clrwdt();
-#endif
-            }
+            nvmWrite();
             status |= MODIFY_STATUS_MASK_PROGRAM_DONE;
             if (!testDataEEPROM())
             {
@@ -525,30 +1689,450 @@ static uint8_t modifyDataEEPROMInternal(void)
     return status;
 }
 
-static void modifyDataEEPROMPacket(void)
+// the row of buffer.modifyFlashMemoryRequest, 0 status if the row already has the data
+static uint8_t modifyRow(bool programMemory)
+{
+    uint8_t status;
+#ifdef DIAGNOSTICS_USED
+    uint16_t startTicks = TMR1;
+#endif
+
+    status = programMemory ? modifyProgramMemoryInternal() : modifyDataEEPROMInternal();
+
+#ifdef DIAGNOSTICS_USED
+    diagnostics.rowTicks += timerTicksSince(startTicks);
+    if (status == 0) ++diagnostics.skippedRowCount;
+#endif
+    return status;
+}
+
+// the raw data of the request can have several consecutive rows, they are processed one by one,
+// the data of the next rows is moved to the data start after each row
+static void modifyFlashMemoryPacket(bool programMemory)
 {
-    uint8_t status = modifyDataEEPROMInternal();
+    uint8_t status;
+#ifdef MULTI_ROW_WRITE_USED
+    unsigned dataSize = programMemory ? PROGRAM_MEMORY_ROW_SIZE / 2 * 3 : DATA_EEPROM_ROW_SIZE;
+    unsigned rowCount = 1;
+    unsigned rowIndex;
+    uint8_t rowStatus;
+    uint8_t eraseCount = 0;
+    uint8_t programCount = 0;
+    uint8_t eraseAvoidedCount = 0;
+
+    if (((buffer.bytes[0] & (REQUEST_MASK_PROGRAM | REQUEST_MASK_COMPRESSED | REQUEST_MASK_MASKED)) == REQUEST_MASK_PROGRAM)
+        && (bufferSize > offsetof(struct ModifyFlashMemoryRequest, data) + dataSize))
+    {
+        rowCount = (bufferSize - offsetof(struct ModifyFlashMemoryRequest, data)) / dataSize;
+    }
+
+    rowData = buffer.modifyFlashMemoryRequest.data;
+    status = 0;
+    for (rowIndex = 0; rowIndex < rowCount; ++rowIndex)
+    {
+        rowStatus = modifyRow(programMemory);
+        status |= rowStatus;
+        if ((rowStatus & MODIFY_STATUS_MASK_ERASE_DONE) != 0) ++eraseCount;
+        if ((rowStatus & MODIFY_STATUS_MASK_PROGRAM_DONE) != 0) ++programCount;
+        if ((rowStatus & MODIFY_STATUS_MASK_ERASE_AVOIDED) != 0) ++eraseAvoidedCount;
+        if ((rowStatus & (MODIFY_STATUS_MASK_ERROR_ERASE | MODIFY_STATUS_MASK_ERROR_PROGRAM)) != 0) break;
+
+        buffer.modifyFlashMemoryRequest.offset += programMemory ? PROGRAM_MEMORY_ROW_SIZE : DATA_EEPROM_ROW_SIZE;
+        rowData += dataSize;
+    }
+#else
+    rowData = buffer.modifyFlashMemoryRequest.data;
+    status = modifyRow(programMemory);
+#endif
+
+#ifdef UART_RX_INTERRUPT_USED
+    if (programMemory) uartCheckRxVector();
+#endif
+
     buffer.modifyFlashMemoryResponse.responseId = 0xFF - buffer.bytes[0];
     buffer.modifyFlashMemoryResponse.status = status;
-    
     bufferSize = sizeof buffer.modifyFlashMemoryResponse;
+#ifdef MULTI_ROW_WRITE_USED
+    if (rowCount > 1)
+    {
+        buffer.modifyFlashMemoryRowsResponse.rowCount = rowIndex;
+        buffer.modifyFlashMemoryRowsResponse.eraseCount = eraseCount;
+        buffer.modifyFlashMemoryRowsResponse.programCount = programCount;
+        buffer.modifyFlashMemoryRowsResponse.eraseAvoidedCount = eraseAvoidedCount;
+        bufferSize = sizeof buffer.modifyFlashMemoryRowsResponse;
+    }
+#endif
+    writeResponse();
+}
+
+#ifdef ERASE_RANGE_USED
+static void eraseRangePacket(void)
+{
+    uint32_t address = ((uint32_t)buffer.eraseRangeRequest.tblpag << 16) | buffer.eraseRangeRequest.offset;
+    uint16_t rowCount = buffer.eraseRangeRequest.rowCount;
+    uint8_t flags = buffer.eraseRangeRequest.flags;
+    bool programMemory = ((flags & ERASE_RANGE_FLAG_PROGRAM_MEMORY) != 0);
+    uint16_t rowIndex;
+    uint16_t eraseCount = 0;
+    uint8_t status = 0;
+    uint8_t rowStatus;
+    bool bulk;
+
+    // the rows are erased by the modify request functions
+    buffer.modifyFlashMemoryRequest.requestId =
+        (programMemory ? REQUEST_MASK_PROGRAM_MEMORY : REQUEST_MASK_DATA_EEPROM)
+        | (((flags & ERASE_RANGE_FLAG_FORCE) != 0) ? REQUEST_MASK_FORCE : 0);
+
+    if (!programMemory && ((flags & ERASE_RANGE_FLAG_BULK) != 0))
+    {
+        // the bulk erase is allowed only if the range is the whole data EEPROM, nothing is erased otherwise
+        if ((rowCount == 0)
+            || (address != __builtin_tbladdress(DATA_EEPROM_ADDRESS))
+            || (address + (uint32_t)rowCount * DATA_EEPROM_ROW_SIZE != 0x800000))
+        {
+            status = MODIFY_STATUS_MASK_ERROR_ERASE;
+            rowCount = 0;
+        }
+
+        bulk = ((flags & ERASE_RANGE_FLAG_FORCE) != 0) && (rowCount != 0);
+        TBLPAG = address >> 16;
+        buffer.modifyFlashMemoryRequest.offset = address;
+        for (rowIndex = 0; rowIndex < rowCount; ++rowIndex)
+        {
+            if (!testErasedDataEEPROM()) bulk = true;
+            buffer.modifyFlashMemoryRequest.offset += DATA_EEPROM_ROW_SIZE;
+        }
+
+        if (bulk)
+        {
+            NVMCON = 0x4046;
+            nvmWrite();
+            status |= MODIFY_STATUS_MASK_ERASE_DONE;
+            ++eraseCount;
+        }
+
+        // the rows are tested (and erased again if needed) by the loop below
+        buffer.modifyFlashMemoryRequest.requestId &= ~REQUEST_MASK_FORCE;
+    }
+
+    for (rowIndex = 0; rowIndex < rowCount; ++rowIndex, address += programMemory ? PROGRAM_MEMORY_ROW_SIZE : DATA_EEPROM_ROW_SIZE)
+    {
+        // the zero row and the bootloader image (without the jump table) are protected
+        if (programMemory
+            && ((address == 0)
+                || ((address >= bootloaderBaseAddress + 2 * PROGRAM_MEMORY_ROW_SIZE)
+                    && (address < bootloaderBaseAddress + bootloaderSize))))
+        {
+            continue;
+        }
+
+        buffer.modifyFlashMemoryRequest.tblpag = address >> 16;
+        buffer.modifyFlashMemoryRequest.offset = address;
+        rowStatus = modifyRow(programMemory);
+        if ((rowStatus & MODIFY_STATUS_MASK_ERASE_DONE) != 0) ++eraseCount;
+        status |= rowStatus;
+        if ((status & MODIFY_STATUS_MASK_ERROR_ERASE) != 0) break;
+
+        uartRead();
+#ifdef WDT_ENABLED
+        __builtin_clrwdt();
+#endif
+    }
+
+#ifdef UART_RX_INTERRUPT_USED
+    if (programMemory) uartCheckRxVector();
+#endif
+
+    buffer.eraseRangeResponse.responseId = 0xDF;
+    buffer.eraseRangeResponse.status = status;
+    buffer.eraseRangeResponse.rowCount = rowIndex;
+    buffer.eraseRangeResponse.eraseCount = eraseCount;
+
+    bufferSize = sizeof buffer.eraseRangeResponse;
+    writeResponse();
+}
+#endif
+
+#ifdef WRITE_EEPROM_WORDS_USED
+// the single word operations, so a few changed words do not need the whole row erase and program
+static void writeEEPROMWordsPacket(void)
+{
+    uint8_t wordCount;
+    struct EEPROMWord *p = buffer.writeEEPROMWordsRequest.words;
+    uint8_t wordIndex;
+    uint8_t eraseCount = 0;
+    uint8_t programCount = 0;
+    uint8_t status = 0;
+    uint16_t current;
+
+    if ((bufferSize < offsetof(struct WriteEEPROMWordsRequest, words))
+        || (bufferSize > sizeof buffer.writeEEPROMWordsRequest))
+    {
+        return;
+    }
+    wordCount = (bufferSize - offsetof(struct WriteEEPROMWordsRequest, words)) / sizeof(struct EEPROMWord);
+
+    TBLPAG = buffer.writeEEPROMWordsRequest.tblpag;
+
+    for (wordIndex = 0; wordIndex < wordCount; ++wordIndex, ++p)
+    {
+        current = __builtin_tblrdl(p->offset);
+        if (current == p->data) continue;
+
+        // the word is erased only if the new data sets bits
+        if ((current & p->data) != p->data)
+        {
+            NVMCON = 0x4044;
+            NVMADRU = buffer.writeEEPROMWordsRequest.tblpag;
+            NVMADR = p->offset;
+            nvmWrite();
+            status |= MODIFY_STATUS_MASK_ERASE_DONE;
+            ++eraseCount;
+            if (__builtin_tblrdl(p->offset) != 0xFFFF)
+            {
+                status |= MODIFY_STATUS_MASK_ERROR_ERASE;
+                break;
+            }
+        }
+        else
+        {
+            status |= MODIFY_STATUS_MASK_ERASE_AVOIDED;
+        }
+
+        if (p->data != 0xFFFF)
+        {
+            NVMCON = 0x4004;
+            __builtin_tblwtl(p->offset, p->data);
+            nvmWrite();
+            status |= MODIFY_STATUS_MASK_PROGRAM_DONE;
+            ++programCount;
+            if (__builtin_tblrdl(p->offset) != p->data)
+            {
+                status |= MODIFY_STATUS_MASK_ERROR_PROGRAM;
+                break;
+            }
+        }
+    }
+
+    buffer.writeEEPROMWordsResponse.responseId = 0xDE;
+    buffer.writeEEPROMWordsResponse.status = status;
+    buffer.writeEEPROMWordsResponse.wordCount = wordIndex;
+    buffer.writeEEPROMWordsResponse.eraseCount = eraseCount;
+    buffer.writeEEPROMWordsResponse.programCount = programCount;
+
+    bufferSize = sizeof buffer.writeEEPROMWordsResponse;
+    writeResponse();
+}
+#endif
+
+#ifdef LINK_TEST_USED
+// the echo or sink request to measure the link, the flash memory is not accessed
+static void linkTestPacket(void)
+{
+    if (bufferSize < offsetof(struct LinkTestRequest, data)) return;
+
+    if ((buffer.linkTestRequest.flags & LINK_TEST_FLAG_ECHO) == 0)
+    {
+        buffer.linkTestResponse.size = bufferSize - offsetof(struct LinkTestRequest, data);
+        bufferSize = sizeof buffer.linkTestResponse;
+    }
+    buffer.linkTestResponse.responseId = 0xDD;
+
+    writeResponse();
+}
+#endif
+
+#ifdef DIAGNOSTICS_USED
+// the counters since the previous clear, the response is built before the counters are cleared
+static void readDiagnosticsPacket(void)
+{
+    bool clear = (bufferSize >= sizeof buffer.readDiagnosticsRequest)
+        && ((buffer.readDiagnosticsRequest.flags & DIAGNOSTICS_FLAG_CLEAR) != 0);
+
+    buffer.readDiagnosticsResponse.responseId = 0xDB;
+    buffer.readDiagnosticsResponse.reserved[0] = 0;
+    buffer.readDiagnosticsResponse.reserved[1] = 0;
+    buffer.readDiagnosticsResponse.reserved[2] = 0;
+    buffer.readDiagnosticsResponse.tickFrequency = DIAGNOSTICS_TICK_FREQUENCY;
+    buffer.readDiagnosticsResponse.diagnostics = diagnostics;
+    if (clear) memset(&diagnostics, 0, sizeof diagnostics);
+
+    bufferSize = sizeof buffer.readDiagnosticsResponse;
+    writeResponse();
+}
+#endif
+
+#ifdef NODE_ADDRESS
+// the status of the broadcast requests since the previous 'Broadcast status' request
+static void broadcastStatusPacket(void)
+{
+    buffer.broadcastStatusResponse.responseId = 0xDC;
+    buffer.broadcastStatusResponse.status = broadcastStatus;
+    buffer.broadcastStatusResponse.requestCount = broadcastCount;
+    broadcastStatus = 0;
+    broadcastCount = 0;
+
+    bufferSize = sizeof buffer.broadcastStatusResponse;
     writeResponse();
 }
+#endif
+
+#ifdef COMPRESSED_WRITE_USED
+// decodes the run-length encoded data of the compressed modify request in place,
+// the data is decoded from the end, so the decoded bytes do not overwrite the unread ones
+// returns false if the data is wrong
+static bool decompressData(unsigned size)
+{
+    uint8_t *p = buffer.modifyFlashMemoryRequest.data;
+    unsigned r; // read index
+    unsigned w = size; // write index
+    uint8_t control;
+    uint8_t count;
+    uint8_t value;
+
+    if ((buffer.bytes[0] & REQUEST_MASK_COMPRESSED) == 0) return true;
+    if (bufferSize <= offsetof(struct ModifyFlashMemoryRequest, data)) return false;
+    r = bufferSize - offsetof(struct ModifyFlashMemoryRequest, data);
+
+    while (r != 0)
+    {
+        control = p[--r];
+        count = (control & 0x7F) + 1;
+        if (count > w) return false;
+        if ((control & 0x80) != 0) // repeated byte
+        {
+            if (r == 0) return false;
+            value = p[--r];
+            while (count-- != 0) p[--w] = value;
+        }
+        else // literal bytes
+        {
+            if (count > r) return false;
+            while (count-- != 0) p[--w] = p[--r];
+        }
+    }
+
+    return w == 0;
+}
+#else
+// the compressed requests are not executed
+#define decompressData(size) ((buffer.bytes[0] & REQUEST_MASK_COMPRESSED) == 0)
+#endif
+
+#ifdef MASKED_WRITE_USED
+// merges the words of the masked modify request with the current row in place, the last 4 bytes of the request
+// are the word mask, the data has only the words with the mask bit set, the other words are read from the row
+// returns false if the data is wrong
+static bool mergeMaskedData(void)
+{
+    uint8_t *p = buffer.modifyFlashMemoryRequest.data;
+    unsigned r; // read index
+    unsigned w = PROGRAM_MEMORY_ROW_SIZE / 2 * 3; // write index
+    uint16_t offset = buffer.modifyFlashMemoryRequest.offset + PROGRAM_MEMORY_ROW_SIZE;
+    uint32_t mask;
+    uint16_t data;
+
+    if ((buffer.bytes[0] & REQUEST_MASK_MASKED) == 0) return true;
+    if (bufferSize < offsetof(struct ModifyFlashMemoryRequest, data) + 4) return false;
+    r = bufferSize - offsetof(struct ModifyFlashMemoryRequest, data) - 4;
+    mask = ((uint32_t)p[r + 3] << 24) | ((uint32_t)p[r + 2] << 16) | ((uint16_t)p[r + 1] << 8) | p[r];
+
+    // the words are merged from the row end, so the written words do not overwrite the unread ones
+    TBLPAG = buffer.modifyFlashMemoryRequest.tblpag;
+    while (w != 0)
+    {
+        w -= 3;
+        offset -= 2;
+        if ((mask & 0x80000000UL) != 0)
+        {
+            if (r < 3) return false;
+            r -= 3;
+            p[w + 2] = p[r + 2];
+            p[w + 1] = p[r + 1];
+            p[w] = p[r];
+        }
+        else
+        {
+            data = __builtin_tblrdl(offset);
+            p[w] = data;
+            p[w + 1] = data >> 8;
+            p[w + 2] = __builtin_tblrdh(offset);
+        }
+        mask <<= 1;
+    }
+
+    return r == 0;
+}
+#else
+// the masked requests are not executed
+#define mergeMaskedData() ((buffer.bytes[0] & REQUEST_MASK_MASKED) == 0)
+#endif
 
 static void processInputPacket(void)
 {
+#ifdef NODE_ADDRESS
+    // the node address is the last byte of the request, it is added to the response after the sequence number
+    if (bufferSize < 2) return;
+    --bufferSize;
+    if ((buffer.bytes[bufferSize] != NODE_ADDRESS) && (buffer.bytes[bufferSize] != BROADCAST_ADDRESS)) return;
+    broadcast = (buffer.bytes[bufferSize] == BROADCAST_ADDRESS);
+#endif
+
+    // the sequence number is the last byte of the request, it is returned as the last byte of the response
+    sequenceUsed = ((buffer.bytes[0] & REQUEST_MASK_SEQUENCE) != 0);
+    if (sequenceUsed)
+    {
+        if (bufferSize < 2) return;
+        sequence = buffer.bytes[--bufferSize];
+        buffer.bytes[0] &= ~REQUEST_MASK_SEQUENCE;
+    }
+
+#ifdef SWITCH_BAUD_RATE_USED
+    baudRateFallbackTicks = 0; // the packet is received, so the current baud rate works
+#endif
+
     if (buffer.bytes[0] == 0x00) startCommunicationPacket();
     else if (communicationStarted)
     {
         if (buffer.bytes[0] == 0x01) readFlashMemoryPacket();
+#ifdef READ_RANGE_USED
+        else if (buffer.bytes[0] == 0x02) readFlashMemoryRangePacket();
+#endif
         else if (buffer.bytes[0] == 0x03) startFirmwarePacket();
+#ifdef SWITCH_BAUD_RATE_USED
+        else if (buffer.bytes[0] == 0x04) switchBaudRatePacket();
+#endif
+#ifdef RANGE_CRC_USED
+        else if (buffer.bytes[0] == 0x05) calculateRangeCrcPacket();
+#endif
+#ifdef ROW_DIGESTS_USED
+        else if (buffer.bytes[0] == 0x06) calculateRowDigestsPacket();
+#endif
+#ifdef BLANK_CHECK_USED
+        else if (buffer.bytes[0] == 0x07) blankCheckPacket();
+#endif
+#ifdef ERASE_RANGE_USED
+        else if (buffer.bytes[0] == 0x20) eraseRangePacket();
+#endif
+#ifdef WRITE_EEPROM_WORDS_USED
+        else if (buffer.bytes[0] == 0x21) writeEEPROMWordsPacket();
+#endif
+#ifdef LINK_TEST_USED
+        else if (buffer.bytes[0] == 0x22) linkTestPacket();
+#endif
+#ifdef NODE_ADDRESS
+        else if (buffer.bytes[0] == 0x23) broadcastStatusPacket();
+#endif
+#ifdef DIAGNOSTICS_USED
+        else if (buffer.bytes[0] == 0x24) readDiagnosticsPacket();
+#endif
         else if ((buffer.bytes[0] & REQUEST_MASK_PROGRAM_MEMORY) != 0)
         {
-            modifyProgramMemoryPacket();
+            if (mergeMaskedData() && decompressData(PROGRAM_MEMORY_ROW_SIZE / 2 * 3)) modifyFlashMemoryPacket(true);
         }
         else if ((buffer.bytes[0] & REQUEST_MASK_DATA_EEPROM) != 0)
         {
-            modifyDataEEPROMPacket();
+            if (decompressData(DATA_EEPROM_ROW_SIZE)) modifyFlashMemoryPacket(false);
         }
     }
 }
@@ -556,12 +2140,20 @@ static void processInputPacket(void)
 static void rxTask(void)
 {
     unsigned data;
-    if ((BOOT_UART.uxsta & (1 << 0)) == 0) return; // test URXDA
-    data = BOOT_UART.uxrxreg;
-    BOOT_UART.uxsta &= ~(1 << 1); // clear receive buffer overrun error bit (OERR)
+    uartRead();
+#ifdef FLOW_CONTROL_USED
+    if (((rxQueueHead - rxQueueTail) & (RX_QUEUE_SIZE - 1)) < RX_QUEUE_SIZE - CTS_QUEUE_MARGIN) CTS_LAT = CTS_ON;
+#endif
+    if (rxQueueHead == rxQueueTail) return;
+    data = rxQueue[rxQueueTail];
+    rxQueueTail = (rxQueueTail + 1) & (RX_QUEUE_SIZE - 1);
     
     if (data == 0xAE)
     {
+#ifdef FAST_BOOT_USED
+        fastBoot = false; // the start byte during the sniff period
+#endif
+        if (rxState != RX_STATE_HEADER) DIAGNOSTICS_COUNT(droppedFrameCount);
         rxState = RX_STATE_LENGTH;
         rxAD = false;
         return;
@@ -581,6 +2173,7 @@ static void rxTask(void)
                 data = 0xAE;
                 break;
             default:
+                DIAGNOSTICS_COUNT(droppedFrameCount);
                 rxState = RX_STATE_HEADER;
                 return;
         }
@@ -600,8 +2193,31 @@ static void rxTask(void)
             rxSize = data;
             bufferSize = 0;
             crc_init();
-            if ((rxSize == 0) || (rxSize > BUFFER_SIZE)) rxState = RX_STATE_HEADER;
+#if BUFFER_SIZE > 0xFF
+            if (rxSize == 0) rxState = RX_STATE_LONG_LENGTH_LSB; // the long frame
+#else
+            if ((rxSize == 0) || (rxSize > BUFFER_SIZE))
+            {
+                DIAGNOSTICS_COUNT(droppedFrameCount);
+                rxState = RX_STATE_HEADER;
+            }
+#endif
             break;
+#if BUFFER_SIZE > 0xFF
+        case RX_STATE_LONG_LENGTH_LSB:
+            rxState = RX_STATE_LONG_LENGTH_MSB;
+            rxSize = data;
+            break;
+        case RX_STATE_LONG_LENGTH_MSB:
+            rxState = RX_STATE_DATA;
+            rxSize |= data << 8;
+            if ((rxSize == 0) || (rxSize > BUFFER_SIZE))
+            {
+                DIAGNOSTICS_COUNT(droppedFrameCount);
+                rxState = RX_STATE_HEADER;
+            }
+            break;
+#endif
         case RX_STATE_DATA:
             buffer.bytes[bufferSize++] = data;
             crcAppendByte(data);
@@ -614,7 +2230,23 @@ static void rxTask(void)
         case RX_STATE_CRC_MSB:
             rxState = RX_STATE_HEADER;
             crcAppendByte(data);
-            if (crc == 0) processInputPacket();
+            if (crc == 0)
+            {
+                DIAGNOSTICS_COUNT(frameCount);
+                processInputPacket();
+            }
+            else
+            {
+                DIAGNOSTICS_COUNT(crcErrorCount);
+                if (nakEnabled)
+                {
+                    // the frame is received completely, so the host can resend it without waiting for the timeout
+                    buffer.bytes[0] = NAK_RESPONSE_ID;
+                    bufferSize = 1;
+                    sequenceUsed = false;
+                    writeResponse();
+                }
+            }
             break;
     }
 }
@@ -624,28 +2256,67 @@ int main(void)
     unsigned tickCount = 0;
 
     ADPCFG = 0xFFFF; // no ADC pins
+
+#ifdef BOOT_OSCILLATOR
+    resetOscillator = OSCCONbits.COSC;
+#endif
+
+    bootloaderBaseAddress = __builtin_tbladdress(BOOTLOADER_BASE_ADDRESS);
+    bootloaderSize = __builtin_tbladdress(BOOTLOADER_SIZE);
+	
+    TBLPAG = (bootloaderBaseAddress >> 16);
+    communicationStarted =
+        ((__builtin_tblrdl((uint16_t)bootloaderBaseAddress) == 0xFFFF)
+        && (__builtin_tblrdh((uint16_t)bootloaderBaseAddress) == 0x00FF));
+
+#ifdef FAST_BOOT_USED
+    // the bootloader is not skipped if the jump table is erased (no target firmware)
+    fastBoot = !communicationStarted && !updateRequested();
+#ifndef FAST_BOOT_SNIFF_MS
+    // the peripherals are not initialized yet
+    if (fastBoot) startFirmware();
+#endif
+#endif
+
+#ifdef BOOT_OSCILLATOR
+    // FCY is the instruction clock of the boot oscillator, so the timer and the UART are initialized after the switch,
+    // the target firmware is started if the oscillator fails
+    if (!switchOscillator(BOOT_OSCILLATOR)) startFirmware();
+#endif
+
+    // the CRC table is read through the PSV window
+    PSVPAG = __builtin_psvpage(crcTable);
+    CORCON |= (1 << 2); // PSV = 1
     
 #ifdef LED_USED
     LED_LAT = LED_ON;
     LED_TRIS = 0;
 #endif
+
+#ifdef FLOW_CONTROL_USED
+    CTS_LAT = CTS_ON;
+    CTS_TRIS = 0;
+#endif
+
+#ifdef NODE_ADDRESS
+    DE_LAT = DE_OFF;
+    DE_TRIS = 0;
+#endif
     
     // Timer 1 initialization
     PR1 = (FCY + (10 * 256) / 2) / (10 * 256) - 1; // period = 100 ms
     T1CON = (3 << 4) | (1 << 15); // TCKPS = 3, TON = 1
 
     // UART initialization
-    BOOT_UART.uxbrg = (FCY  + (16 * 115200UL) / 2) / (16 * 115200UL) - 1;
+    BOOT_UART.uxbrg = UART_BRG(BAUD_RATE_DEFAULT);
     BOOT_UART.uxmode = (1 << 15) | UART_ALTIO; // UARTEN = 1, ALTIO
     BOOT_UART.uxsta = (1 << 10); // UTXEN = 1
-    
-    bootloaderBaseAddress = __builtin_tbladdress(BOOTLOADER_BASE_ADDRESS);
-    bootloaderSize = __builtin_tbladdress(BOOTLOADER_SIZE);
-	
-    TBLPAG = (bootloaderBaseAddress >> 16);
-    communicationStarted =
-        ((__builtin_tblrdl((uint16_t)bootloaderBaseAddress) == 0xFFFF)
-        && (__builtin_tblrdh((uint16_t)bootloaderBaseAddress) == 0x00FF));
+
+#ifdef UART_RX_INTERRUPT_USED
+    // the target firmware vectors are not used by the bootloader
+    INTCON2bits.ALTIVT = 1;
+    uartCheckRxVector();
+#endif
     
     while (true)
     {
@@ -653,6 +2324,11 @@ int main(void)
         __builtin_clrwdt();
 #endif
 
+#ifdef FAST_BOOT_SNIFF_MS
+        // no start byte is received during the sniff period
+        if (fastBoot && ((tickCount != 0) || (TMR1 >= FAST_BOOT_SNIFF_TICKS))) startFirmware();
+#endif
+
         if (IFS0bits.T1IF != 0)
         {
 			++tickCount;
@@ -666,6 +2342,13 @@ int main(void)
             {
                 startFirmware();
             }
+
+#ifdef SWITCH_BAUD_RATE_USED
+            if ((baudRateFallbackTicks != 0) && (--baudRateFallbackTicks == 0))
+            {
+                uartSetBRG(UART_BRG(BAUD_RATE_DEFAULT));
+            }
+#endif
         }
         
         rxTask();
@@ -22,6 +22,12 @@ static const OptionInfo OPTION_INFO[] = {
     { OPTION_MASK_MODEL, "m", "model" },
     { OPTION_MASK_ALL, "a", "all" },
     { OPTION_MASK_NO_SMART, "s", "no-smart" },
+    { OPTION_MASK_BAUD_RATE, "b", "baud" },
+    { OPTION_MASK_FAST_VERIFY, "c", "fast-verify" },
+    { OPTION_MASK_LINK_TEST, "k", "link-test" },
+    { OPTION_MASK_NODES, "n", "nodes" },
+    { OPTION_MASK_CRC_BENCHMARK, "", "crc-benchmark" }, // no short name
+    { OPTION_MASK_STATS, "", "stats" },
 };
 
 static size_t getOptionIndex(const char *optionName, const char *originalParam)
@@ -76,6 +82,33 @@ static unsigned parseUnsigned(const char *str, const char *originalParam)
     return result;
 }
 
+// the comma separated node addresses (1...254)
+static std::vector<unsigned> parseNodeAddresses(const std::string &str, const char *originalParam)
+{
+    std::vector<unsigned> result;
+
+    size_t start = 0;
+    while (true)
+    {
+        size_t end = str.find(',', start);
+        if (end == std::string::npos) end = str.size();
+        if (end == start) errorExit("Node address must be defined: %s", originalParam);
+
+        unsigned address = parseUnsigned(str.substr(start, end - start).c_str(), originalParam);
+        if ((address < 1) || (address > 254)) errorExit("Node address must be from 1 to 254: %s", originalParam);
+        if (std::find(result.begin(), result.end(), address) != result.end())
+        {
+            errorExit("Duplicated node address: %s", originalParam);
+        }
+        result.push_back(address);
+
+        if (end == str.size()) break;
+        start = end + 1;
+    }
+
+    return result;
+}
+
 void commandLineParser(int argc, char *argv[], CommandLineParams *params)
 {
     *params = CommandLineParams();
@@ -93,7 +126,7 @@ void commandLineParser(int argc, char *argv[], CommandLineParams *params)
             unsigned optionMask = OPTION_INFO[index].mask;
             if ((optionMask & params->optionMask) != 0)
             {
-                errorExit("Dupliacted option: %s", param);
+                errorExit("Duplicated option: %s", param);
             }
             params->optionMask |= optionMask;
 
@@ -101,11 +134,23 @@ void commandLineParser(int argc, char *argv[], CommandLineParams *params)
             {
                 params->timeout = parseUnsigned(optionValue.c_str(), param);
             }
+            else if (optionMask == OPTION_MASK_BAUD_RATE)
+            {
+                params->baudRate = parseUnsigned(optionValue.c_str(), param);
+            }
             else if (optionMask == OPTION_MASK_MODEL)
             {
                 if (optionValue.empty()) errorExit("Model name must be defined: %s", param);
                 params->model = optionValue;
             }
+            else if (optionMask == OPTION_MASK_NODES)
+            {
+                params->nodeAddresses = parseNodeAddresses(optionValue, param);
+            }
+            else if (optionMask == OPTION_MASK_LINK_TEST)
+            {
+                params->linkTestPattern = optionValue;
+            }
             else if (!optionValue.empty())
             {
                 errorExit("Option syntax error: %s", param);
@@ -13,7 +13,13 @@ const unsigned
     OPTION_MASK_FORCE = 0x00000100,
     OPTION_MASK_MODEL = 0x00000200,
     OPTION_MASK_ALL = 0x00000400,
-    OPTION_MASK_NO_SMART = 0x00000800;
+    OPTION_MASK_NO_SMART = 0x00000800,
+    OPTION_MASK_BAUD_RATE = 0x00001000,
+    OPTION_MASK_FAST_VERIFY = 0x00002000,
+    OPTION_MASK_LINK_TEST = 0x00004000,
+    OPTION_MASK_NODES = 0x00008000,
+    OPTION_MASK_CRC_BENCHMARK = 0x00010000,
+    OPTION_MASK_STATS = 0x00020000;
     
 struct CommandLineParams
 {
@@ -21,6 +27,9 @@ struct CommandLineParams
     unsigned optionMask = 0;
     std::string model;
     unsigned timeout = 0;
+    unsigned baudRate = 0;
+    std::string linkTestPattern; // empty - all patterns
+    std::vector<unsigned> nodeAddresses; // the nodes of the multi-drop bus
 };
 
 void commandLineParser(int argc, char *argv[], CommandLineParams *params);
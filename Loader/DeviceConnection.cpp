@@ -1,19 +1,61 @@
 #include "Stable.h"
 #include "DeviceConnection.h"
 #include "MemoryLayout.h"
+#include "FirmwareImage.h"
 #include "ErrorExit.h"
 
 const uint8_t
     REQUEST_MASK_FORCE = 0x01,
     REQUEST_MASK_PROGRAM = 0x02,
+    REQUEST_MASK_COMPRESSED = 0x04,
     REQUEST_MASK_PROGRAM_MEMORY = 0x08,
-    REQUEST_MASK_DATA_EEPROM = 0x10;
+    REQUEST_MASK_DATA_EEPROM = 0x10,
+    REQUEST_MASK_MASKED = 0x40,
+    REQUEST_MASK_SEQUENCE = 0x80;
     
+const uint8_t
+    RANGE_CRC_FLAG_HIGH_BYTE = 0x01;
+
+const uint8_t
+    ROW_DIGESTS_FLAG_PROGRAM_MEMORY = 0x01;
+
+const uint8_t
+    BLANK_CHECK_FLAG_PROGRAM_MEMORY = 0x01;
+
+const uint8_t
+    ERASE_RANGE_FLAG_PROGRAM_MEMORY = 0x01,
+    ERASE_RANGE_FLAG_FORCE = 0x02,
+    ERASE_RANGE_FLAG_BULK = 0x04;
+
+const uint8_t
+    LINK_TEST_FLAG_ECHO = 0x01;
+
+const uint8_t
+    DIAGNOSTICS_FLAG_CLEAR = 0x01;
+
 const uint8_t
     MODIFY_STATUS_MASK_ERASE_DONE = 0x01,
     MODIFY_STATUS_MASK_ERROR_ERASE = 0x02,
     MODIFY_STATUS_MASK_PROGRAM_DONE = 0x04,
-    MODIFY_STATUS_MASK_ERROR_PROGRAM = 0x08;
+    MODIFY_STATUS_MASK_ERROR_PROGRAM = 0x08,
+    MODIFY_STATUS_MASK_ERASE_AVOIDED = 0x10;
+
+// the order of the StartCommunicationResponse.baudRates bits
+const unsigned BAUD_RATES_STANDARD[] = { 230400, 460800, 921600 };
+
+const unsigned PROTOCOL_VERSION = 2; // the highest supported protocol version
+
+const unsigned BAUD_RATE_FALLBACK_TIME = 1000; // ms, the device returns to BAUD_RATE_DEFAULT if no packet is received
+
+const uint8_t NAK_RESPONSE_ID = 0x00; // the device response to a frame with a wrong CRC (protocol version 2)
+const unsigned NAK_RETRY_COUNT = 10;
+const unsigned NAK_IDLE_TIME = 50; // ms, no responses from the device after NAK, so the queued requests are done
+
+const size_t FLOW_CONTROL_WINDOW_SIZE = 1024; // the pending frames with the flow control, limits the resent requests
+
+const unsigned FLASH_OPERATION_TIME = 3; // ms, the row erase or program operation, the nodes do not receive the broadcast requests
+const unsigned FLASH_OPERATION_TIME_MAX = 24; // ms, the operation time is doubled while the nodes lose the requests
+const unsigned BROADCAST_BATCH_OPERATIONS = 32; // the flash memory operations of the broadcast requests between the node polls
 
 struct StartCommunicationResponse
 {
@@ -22,6 +64,16 @@ struct StartCommunicationResponse
     uint8_t signature[8]; // dsPIC30F
     uint16_t bootloaderSize;
     uint32_t bootloaderBaseAddress;
+    // protocol version 2
+    uint16_t rxQueueSize;
+    uint16_t capabilities; // CAPABILITY_MASK_*
+    uint16_t maxPacketSize;
+    uint16_t baudRates; // bit mask of BAUD_RATES_STANDARD
+    uint16_t deviceId;
+    uint16_t configWords[7];
+    // CAPABILITY_MASK_RX_INTERRUPT
+    uint32_t rxHandlerAddress;
+    uint16_t rxVectorAddress;
 };
 
 struct ReadFlashMemoryRequest
@@ -37,17 +89,180 @@ struct ReadFlashMemoryResponse
     uint8_t data[96];
 };
 
+struct ReadFlashMemoryRangeRequest
+{
+    uint8_t requestId; // 0x02
+    uint8_t tblpag;
+    uint16_t offset;
+    uint8_t rowCount;
+};
+
+struct ReadFlashMemoryRangeResponse
+{
+    uint8_t responseId; // 0xFD
+    uint8_t rowIndex;
+    uint8_t data[96];
+};
+
 struct StartFirmwareResponse
 {
     uint8_t responseId; // 0xF0
 };
 
+struct SwitchBaudRateRequest
+{
+    uint8_t requestId; // 0x04
+    uint8_t reserved[3];
+    uint32_t baudRate;
+};
+
+struct SwitchBaudRateResponse
+{
+    uint8_t responseId; // 0xFB
+    uint8_t status; // 0 - switched, 1 - not supported
+    uint16_t reserved;
+    uint32_t baudRate; // actual device baud rate
+};
+
+struct CalculateRangeCrcRequest
+{
+    uint8_t requestId; // 0x05
+    uint8_t tblpag;
+    uint16_t offset;
+    uint16_t rowCount;
+    uint8_t flags; // RANGE_CRC_FLAG_*
+};
+
+struct CalculateRangeCrcResponse
+{
+    uint8_t responseId; // 0xFA
+    uint8_t reserved[3];
+    uint32_t crc; // CRC-32
+};
+
+struct CalculateRowDigestsRequest
+{
+    uint8_t requestId; // 0x06
+    uint8_t tblpag;
+    uint16_t offset;
+    uint8_t rowCount;
+    uint8_t flags; // ROW_DIGESTS_FLAG_*
+};
+
+struct CalculateRowDigestsResponse
+{
+    uint8_t responseId; // 0xF9
+    uint8_t reserved;
+    uint16_t digests[DeviceConnection::MAX_ROW_DIGEST_COUNT]; // CRC-16/MCRF4XX
+};
+
+struct BlankCheckRequest
+{
+    uint8_t requestId; // 0x07
+    uint8_t tblpag;
+    uint16_t offset;
+    uint16_t rowCount;
+    uint8_t flags; // BLANK_CHECK_FLAG_*
+};
+
+struct BlankCheckResponse
+{
+    uint8_t responseId; // 0xF8
+    uint8_t reserved[3];
+    uint8_t bitmap[DeviceConnection::MAX_BLANK_CHECK_ROW_COUNT / 8]; // the bit is set if the row is not blank, LSB first
+};
+
+struct EraseRangeRequest
+{
+    uint8_t requestId; // 0x20
+    uint8_t tblpag;
+    uint16_t offset;
+    uint16_t rowCount;
+    uint8_t flags; // ERASE_RANGE_FLAG_*
+};
+
+struct EraseRangeResponse
+{
+    uint8_t responseId; // 0xDF
+    uint8_t status; // MODIFY_STATUS_MASK_*
+    uint16_t rowCount; // the processed rows, the error row index if an error
+    uint16_t eraseCount;
+};
+
+struct EEPROMWord
+{
+    uint16_t offset;
+    uint16_t data;
+};
+
+struct WriteEEPROMWordsRequest
+{
+    uint8_t requestId; // 0x21
+    uint8_t tblpag;
+    EEPROMWord words[DeviceConnection::MAX_EEPROM_WORD_COUNT];
+};
+
+struct WriteEEPROMWordsResponse
+{
+    uint8_t responseId; // 0xDE
+    uint8_t status; // MODIFY_STATUS_MASK_*
+    uint8_t wordCount; // the processed words, the error word index if an error
+    uint8_t eraseCount;
+    uint8_t programCount;
+};
+
+struct LinkTestRequest
+{
+    uint8_t requestId; // 0x22
+    uint8_t flags; // LINK_TEST_FLAG_*
+    uint8_t data[1]; // the variable size
+};
+
+// the echo response is the request data with the response ID
+struct LinkTestResponse
+{
+    uint8_t responseId; // 0xDD
+    uint8_t flags;
+    uint16_t size; // the received data size
+};
+
+struct BroadcastStatusResponse
+{
+    uint8_t responseId; // 0xDC
+    uint8_t status; // MODIFY_STATUS_MASK_* of all broadcast requests
+    uint16_t requestCount; // the executed broadcast requests
+};
+
+struct ReadDiagnosticsRequest
+{
+    uint8_t requestId; // 0x24
+    uint8_t flags; // DIAGNOSTICS_FLAG_*
+};
+
+struct ReadDiagnosticsResponse
+{
+    uint8_t responseId; // 0xDB
+    uint8_t reserved[3];
+    uint32_t tickFrequency;
+    uint16_t frameCount;
+    uint16_t crcErrorCount;
+    uint16_t droppedFrameCount;
+    uint16_t overrunCount;
+    uint16_t rowTestCount;
+    uint16_t skippedRowCount;
+    uint16_t eraseCount;
+    uint16_t programCount;
+    uint32_t rowTicks;
+    uint32_t eraseTicks;
+    uint32_t programTicks;
+};
+
 struct ModifyFlashMemoryRequest
 {
     uint8_t requestId; // REQUEST_MASK*
     uint8_t tblpag;
     uint16_t offset;
-    uint8_t data[96];
+    uint8_t data[96 + 4]; // the masked request has the word mask after the data
 };
 
 struct ModifyFlashMemoryResponse
@@ -56,10 +271,22 @@ struct ModifyFlashMemoryResponse
     uint8_t status;
 };
 
-DeviceConnection::DeviceConnection(const std::shared_ptr<SerialPort> &serialPort):
-    _serialPort(serialPort)
+// the response to the request with several rows
+struct ModifyFlashMemoryRowsResponse
+{
+    uint8_t responseId; // 0xFF - WriteFlashMemoryRequest.requestId
+    uint8_t status; // the bits of all rows
+    uint8_t rowCount; // the processed rows, the error row index if an error
+    uint8_t eraseCount;
+    uint8_t programCount;
+    uint8_t eraseAvoidedCount;
+};
+
+DeviceConnection::DeviceConnection(const std::shared_ptr<SerialPort> &serialPort, unsigned nodeAddress):
+    _serialPort(serialPort),
+    _nodeAddress(nodeAddress)
 {
-    _packetTransiver = std::make_shared<PacketTransiver>(_serialPort);
+    _packetTransiver = std::make_shared<PacketTransiver>(_serialPort, _nodeAddress);
 }
 
 DeviceConnection::~DeviceConnection()
@@ -70,23 +297,35 @@ void DeviceConnection::startCommunication(unsigned timeout)
 {
     std::vector<uint8_t> startCommunicationRequest;
     startCommunicationRequest.push_back(0x00);
+    startCommunicationRequest.push_back(PROTOCOL_VERSION);
 
     _serialPort->purge();
 
+    // the broadcast request keeps the other nodes of the bus in the bootloader while the node is connected
+    PacketTransiver broadcastTransiver(_serialPort, NODE_ADDRESS_BROADCAST);
+
     unsigned startTime = GetTickCount();
     while ((timeout == 0) || (GetTickCount() - startTime < timeout * 1000))
     {
+        if (_nodeAddress != NODE_ADDRESS_NONE) broadcastTransiver.sendPacket(startCommunicationRequest);
         _packetTransiver->sendPacket(startCommunicationRequest);
 
         if (_packetTransiver->pool())
         {
-            if (_packetTransiver->receivedPacket().size() < sizeof(StartCommunicationResponse)) continue;
+            size_t responseSize = _packetTransiver->receivedPacket().size();
+            if (responseSize < offsetof(StartCommunicationResponse, rxQueueSize)) continue;
             StartCommunicationResponse *startCommunicationResponse = (StartCommunicationResponse*)_packetTransiver->receivedPacket().data();
             if (startCommunicationResponse->responseId != 0xFF) continue;
-            if (startCommunicationResponse->protocolVersion != 1)
+            if ((startCommunicationResponse->protocolVersion == 0)
+                || (startCommunicationResponse->protocolVersion > PROTOCOL_VERSION))
             {
                 errorExit("Unsupported protocol version (%u)", (unsigned)startCommunicationResponse->protocolVersion);
             }
+            if ((startCommunicationResponse->protocolVersion >= 2)
+                && (responseSize < offsetof(StartCommunicationResponse, capabilities) + sizeof startCommunicationResponse->capabilities))
+            {
+                continue;
+            }
             if (memcmp(startCommunicationResponse->signature, "dsPIC30F", 8) != 0)
             {
                 errorExit("Unsupported device serial");
@@ -94,6 +333,40 @@ void DeviceConnection::startCommunication(unsigned timeout)
 
             _bootloaderParams.address = startCommunicationResponse->bootloaderBaseAddress;
             _bootloaderParams.size = startCommunicationResponse->bootloaderSize;
+            _protocolVersion = startCommunicationResponse->protocolVersion;
+            if (_protocolVersion >= 2)
+            {
+                _rxQueueSize = startCommunicationResponse->rxQueueSize;
+            }
+            // the first protocol version 2 bootloaders do not have the capability block
+            _capabilities = DeviceCapabilities();
+            if ((_protocolVersion >= 2) && (responseSize >= offsetof(StartCommunicationResponse, rxHandlerAddress)))
+            {
+                _capabilities.valid = true;
+                _capabilities.capabilityMask = startCommunicationResponse->capabilities;
+                _capabilities.maxPacketSize = startCommunicationResponse->maxPacketSize;
+                for (size_t i = 0; i < sizeof BAUD_RATES_STANDARD / sizeof BAUD_RATES_STANDARD[0]; ++i)
+                {
+                    if ((startCommunicationResponse->baudRates & (1 << i)) != 0)
+                    {
+                        _capabilities.baudRates.push_back(BAUD_RATES_STANDARD[i]);
+                    }
+                }
+                _capabilities.deviceId = startCommunicationResponse->deviceId;
+                _capabilities.configWords.assign(startCommunicationResponse->configWords,
+                    startCommunicationResponse->configWords + sizeof startCommunicationResponse->configWords / sizeof startCommunicationResponse->configWords[0]);
+                if ((_capabilities.capabilityMask & CAPABILITY_MASK_RX_INTERRUPT) != 0)
+                {
+                    if (responseSize < offsetof(StartCommunicationResponse, rxVectorAddress) + sizeof startCommunicationResponse->rxVectorAddress)
+                    {
+                        continue;
+                    }
+                    _capabilities.rxHandlerAddress = startCommunicationResponse->rxHandlerAddress;
+                    _capabilities.rxVectorAddress = startCommunicationResponse->rxVectorAddress;
+                }
+            }
+            _flowControl = ((_capabilities.capabilityMask & CAPABILITY_MASK_FLOW_CONTROL) != 0);
+            _serialPort->setFlowControl(_flowControl);
             _startTime = GetTickCount();
 
             return;
@@ -103,22 +376,132 @@ void DeviceConnection::startCommunication(unsigned timeout)
     errorExit("Connection timeout");
 }
 
+void DeviceConnection::startBroadcast(const std::vector<std::shared_ptr<DeviceConnection>> &nodes)
+{
+    assert((_nodeAddress == NODE_ADDRESS_BROADCAST) && !nodes.empty());
+
+    _bootloaderParams = nodes[0]->_bootloaderParams;
+    _protocolVersion = nodes[0]->_protocolVersion;
+    _capabilities = nodes[0]->_capabilities;
+    _baudRate = nodes[0]->_baudRate;
+    _startTime = GetTickCount();
+
+    for (const std::shared_ptr<DeviceConnection> &node : nodes)
+    {
+        if ((node->_capabilities.capabilityMask & CAPABILITY_MASK_BROADCAST) == 0)
+        {
+            errorExit("The node %u does not support the broadcast requests", node->_nodeAddress);
+        }
+        // the broadcast 'Start communication' requests are counted too
+        uint8_t status;
+        unsigned requestCount;
+        node->readBroadcastStatus(&status, &requestCount);
+    }
+    _broadcastNodes = nodes;
+    _broadcastRequestCount = 0;
+    _broadcastOperationCount = 0;
+    _broadcastOperationTime = FLASH_OPERATION_TIME;
+}
+
+unsigned DeviceConnection::nodeAddress() const
+{
+    return _nodeAddress;
+}
+
 const BootloaderParams &DeviceConnection::bootloaderParams() const
 {
     return _bootloaderParams;
 }
 
+unsigned DeviceConnection::protocolVersion() const
+{
+    return _protocolVersion;
+}
+
+const DeviceCapabilities &DeviceConnection::capabilities() const
+{
+    return _capabilities;
+}
+
+unsigned DeviceConnection::baudRate() const
+{
+    return _baudRate;
+}
+
+void DeviceConnection::switchBaudRate(unsigned maxBaudRate)
+{
+    if ((_capabilities.capabilityMask & CAPABILITY_MASK_SWITCH_BAUD_RATE) == 0) return;
+    // all nodes of the bus have the same baud rate
+    if (_nodeAddress != NODE_ADDRESS_NONE) return;
+
+    // the highest baud rate first
+    std::vector<unsigned> baudRates(_capabilities.baudRates.rbegin(), _capabilities.baudRates.rend());
+    if (maxBaudRate != 0)
+    {
+        baudRates.erase(std::remove_if(baudRates.begin(), baudRates.end(),
+            [maxBaudRate](unsigned baudRate) { return baudRate >= maxBaudRate; }), baudRates.end());
+        // a non-standard baud rate can be supported too
+        baudRates.insert(baudRates.begin(), maxBaudRate);
+    }
+
+    for (unsigned baudRate : baudRates)
+    {
+        if (baudRate <= _baudRate) break;
+
+        SwitchBaudRateRequest request;
+        memset(&request, 0, sizeof request);
+        request.requestId = 0x04;
+        request.baudRate = baudRate;
+
+        bool switched = false;
+        sendRequest(&request, sizeof request, sizeof(SwitchBaudRateResponse), false,
+            [&switched](const std::vector<uint8_t> &response)
+            {
+                const SwitchBaudRateResponse *switchBaudRateResponse =
+                    (const SwitchBaudRateResponse*)response.data();
+                switched = (switchBaudRateResponse->status == 0);
+            });
+        waitPendingRequests();
+        if (!switched) continue;
+
+        if (_serialPort->setBaudRate(baudRate) && checkConnection())
+        {
+            _baudRate = baudRate;
+            return;
+        }
+
+        // the device returns to the previous baud rate itself
+        if (!_serialPort->setBaudRate(_baudRate))
+        {
+            errorExit("Serial port setup error");
+        }
+        Sleep(BAUD_RATE_FALLBACK_TIME);
+        _serialPort->purge();
+    }
+}
+
 unsigned DeviceConnection::connectionTime() const
 {
     return GetTickCount() - _startTime;
 }
 
-const DeviceConnectionStatistic &DeviceConnection::connectionStatistic() const
+DeviceConnectionStatistic DeviceConnection::connectionStatistic() const
 {
-    return _connectionStatistic;
+    DeviceConnectionStatistic statistic = _connectionStatistic;
+    statistic.corruptedFrameCount = _packetTransiver->corruptedFrameCount();
+    return statistic;
 }
 
 std::vector<uint32_t> DeviceConnection::readRow(uint32_t address)
+{
+    std::vector<uint32_t> result;
+    readRowAsync(address, [&result](uint32_t, const std::vector<uint32_t> &row) { result = row; });
+    waitPendingRequests();
+
+    return result;
+}
+
+void DeviceConnection::readRowAsync(uint32_t address, const RowHandler &handler)
 {
     assert((address & ((ROW_SIZE_PROGRAM - 1) | 0xFF000000)) == 0);
 
@@ -128,75 +511,239 @@ std::vector<uint32_t> DeviceConnection::readRow(uint32_t address)
     request.tblpag = (uint8_t)(address >> 16);
     request.offset = (uint16_t)address;
 
-    requestResponse(&request, sizeof request, sizeof ReadFlashMemoryResponse);
-    const ReadFlashMemoryResponse *readFlashMemoryResponse =
-        (const ReadFlashMemoryResponse*)_packetTransiver->receivedPacket().data();
+    sendRequest(&request, sizeof request, sizeof(ReadFlashMemoryResponse), true,
+        [address, handler](const std::vector<uint8_t> &response)
+        {
+            const ReadFlashMemoryResponse *readFlashMemoryResponse =
+                (const ReadFlashMemoryResponse*)response.data();
+            handler(address, parseRow(readFlashMemoryResponse->data));
+        });
+}
 
-    std::vector<uint32_t> result(ROW_SIZE_PROGRAM / 2);
-    const uint8_t *p = readFlashMemoryResponse->data;
-    for (size_t i = 0; i < ROW_SIZE_PROGRAM / 2; ++i)
+void DeviceConnection::readRowsAsync(uint32_t address, uint32_t rowCount, const RowHandler &handler)
+{
+    assert((address & ((ROW_SIZE_PROGRAM - 1) | 0xFF000000)) == 0);
+
+    if ((_capabilities.capabilityMask & CAPABILITY_MASK_READ_RANGE) == 0)
     {
-        uint32_t x = *(p++);
-        x |= (*(p++) << 8);
-        x |= (*(p++) << 16);
-        result[i] = x;
+        for (uint32_t i = 0; i < rowCount; ++i)
+        {
+            readRowAsync(address + i * ROW_SIZE_PROGRAM, handler);
+        }
+        return;
     }
 
-    return result;
+    // a lost row restarts the whole range, so the ranges are not too long
+    const uint32_t MAX_RANGE_ROW_COUNT = 32;
+
+    while (rowCount != 0)
+    {
+        uint32_t count = std::min(rowCount, MAX_RANGE_ROW_COUNT);
+
+        ReadFlashMemoryRangeRequest request;
+        memset(&request, 0, sizeof request);
+        request.requestId = 0x02;
+        request.tblpag = (uint8_t)(address >> 16);
+        request.offset = (uint16_t)address;
+        request.rowCount = (uint8_t)count;
+
+        sendRequest(&request, offsetof(ReadFlashMemoryRangeRequest, rowCount) + sizeof request.rowCount,
+            sizeof(ReadFlashMemoryRangeResponse), true,
+            [address, handler](const std::vector<uint8_t> &response)
+            {
+                const ReadFlashMemoryRangeResponse *readFlashMemoryRangeResponse =
+                    (const ReadFlashMemoryRangeResponse*)response.data();
+                handler(address + readFlashMemoryRangeResponse->rowIndex * ROW_SIZE_PROGRAM,
+                    parseRow(readFlashMemoryRangeResponse->data));
+            },
+            count);
+
+        address += count * ROW_SIZE_PROGRAM;
+        rowCount -= count;
+    }
 }
 
-void DeviceConnection::writeProgramMemory(uint32_t address, const std::vector<uint32_t> &row, bool program, bool force)
+void DeviceConnection::calculateRangeCrcAsync(uint32_t address, uint32_t rowCount, uint32_t wordMask, const CrcHandler &handler)
 {
-    assert((address & (ROW_SIZE_PROGRAM - 1)) == 0);
-    assert(!program || (row.size() == ROW_SIZE_PROGRAM / 2));
+    assert((address & ((ROW_SIZE_PROGRAM - 1) | 0xFF000000)) == 0);
+    assert((rowCount != 0) && (rowCount <= 0xFFFF));
+
+    CalculateRangeCrcRequest request;
+    memset(&request, 0, sizeof request);
+    request.requestId = 0x05;
+    request.tblpag = (uint8_t)(address >> 16);
+    request.offset = (uint16_t)address;
+    request.rowCount = (uint16_t)rowCount;
+    request.flags = ((wordMask & 0xFF0000) != 0) ? RANGE_CRC_FLAG_HIGH_BYTE : 0x00;
+
+    sendRequest(&request, offsetof(CalculateRangeCrcRequest, flags) + sizeof request.flags,
+        sizeof(CalculateRangeCrcResponse), true,
+        [handler](const std::vector<uint8_t> &response)
+        {
+            const CalculateRangeCrcResponse *calculateRangeCrcResponse =
+                (const CalculateRangeCrcResponse*)response.data();
+            handler(calculateRangeCrcResponse->crc);
+        });
+}
+
+uint32_t DeviceConnection::calculateCrc(const std::vector<uint32_t> &words, uint32_t wordMask)
+{
+    uint32_t crc = 0xFFFFFFFF;
+    auto appendByte = [&crc](uint8_t byte)
+    {
+        crc ^= byte;
+        for (unsigned i = 0; i < 8; ++i)
+        {
+            crc = ((crc & 0x00000001) != 0) ? ((crc >> 1) ^ 0xEDB88320) : (crc >> 1);
+        }
+    };
+
+    for (uint32_t word : words)
+    {
+        appendByte((uint8_t)(word >> 0));
+        appendByte((uint8_t)(word >> 8));
+        if ((wordMask & 0xFF0000) != 0) appendByte((uint8_t)(word >> 16));
+    }
 
-    ModifyFlashMemoryRequest request;
+    return ~crc;
+}
+
+void DeviceConnection::readRowDigestsAsync(uint32_t address, uint32_t rowCount, bool programMemory, const DigestHandler &handler)
+{
+    assert((address & (((programMemory ? ROW_SIZE_PROGRAM : ROW_SIZE_DATA) - 1) | 0xFF000000)) == 0);
+    assert((rowCount != 0) && (rowCount <= MAX_ROW_DIGEST_COUNT));
+
+    CalculateRowDigestsRequest request;
     memset(&request, 0, sizeof request);
+    request.requestId = 0x06;
+    request.tblpag = (uint8_t)(address >> 16);
+    request.offset = (uint16_t)address;
+    request.rowCount = (uint8_t)rowCount;
+    request.flags = programMemory ? ROW_DIGESTS_FLAG_PROGRAM_MEMORY : 0x00;
+
+    sendRequest(&request, sizeof request,
+        offsetof(CalculateRowDigestsResponse, digests) + rowCount * sizeof(uint16_t), true,
+        [address, rowCount, handler](const std::vector<uint8_t> &response)
+        {
+            const CalculateRowDigestsResponse *calculateRowDigestsResponse =
+                (const CalculateRowDigestsResponse*)response.data();
+            handler(address, std::vector<uint16_t>(calculateRowDigestsResponse->digests, calculateRowDigestsResponse->digests + rowCount));
+        });
+}
+
+uint16_t DeviceConnection::calculateRowDigest(const std::vector<uint32_t> &row, bool programMemory)
+{
+    std::vector<uint8_t> data;
+    for (uint32_t word : row)
+    {
+        data.push_back((uint8_t)(word >> 0));
+        data.push_back((uint8_t)(word >> 8));
+        if (programMemory) data.push_back((uint8_t)(word >> 16));
+    }
+
+    return PacketTransiver::crc16(data);
+}
+
+void DeviceConnection::blankCheckAsync(uint32_t address, uint32_t rowCount, bool programMemory, const BlankCheckHandler &handler)
+{
+    assert((address & (((programMemory ? ROW_SIZE_PROGRAM : ROW_SIZE_DATA) - 1) | 0xFF000000)) == 0);
+    assert((rowCount != 0) && (rowCount <= MAX_BLANK_CHECK_ROW_COUNT));
+
+    BlankCheckRequest request;
+    memset(&request, 0, sizeof request);
+    request.requestId = 0x07;
+    request.tblpag = (uint8_t)(address >> 16);
+    request.offset = (uint16_t)address;
+    request.rowCount = (uint16_t)rowCount;
+    request.flags = programMemory ? BLANK_CHECK_FLAG_PROGRAM_MEMORY : 0x00;
+
+    sendRequest(&request, sizeof request,
+        offsetof(BlankCheckResponse, bitmap) + (rowCount + 7) / 8, true,
+        [address, rowCount, handler](const std::vector<uint8_t> &response)
+        {
+            const BlankCheckResponse *blankCheckResponse = (const BlankCheckResponse*)response.data();
+            std::vector<bool> nonBlankRows(rowCount);
+            for (uint32_t i = 0; i < rowCount; ++i)
+            {
+                nonBlankRows[i] = ((blankCheckResponse->bitmap[i / 8] >> (i % 8)) & 0x01) != 0;
+            }
+            handler(address, nonBlankRows);
+        });
+}
+
+void DeviceConnection::writeProgramMemory(uint32_t address, const std::vector<uint32_t> &row, bool program, bool force, bool masked)
+{
+    uint32_t rowCount = program ? (uint32_t)row.size() / (ROW_SIZE_PROGRAM / 2) : 1;
+    assert((address & (ROW_SIZE_PROGRAM - 1)) == 0);
+    assert(!program || ((row.size() % (ROW_SIZE_PROGRAM / 2) == 0) && (rowCount != 0) && (rowCount <= maxWriteRowCount(true))));
+    assert((rowCount == 1) || (((address & 0xFFFF) + rowCount * ROW_SIZE_PROGRAM) <= 0x10000)); // the same TBLPAG
+    assert(!masked || (program && (rowCount == 1) && ((_capabilities.capabilityMask & CAPABILITY_MASK_MASKED_WRITE) != 0)));
+
+    std::vector<uint8_t> requestBuffer(std::max(sizeof(ModifyFlashMemoryRequest),
+        offsetof(ModifyFlashMemoryRequest, data) + rowCount * (ROW_SIZE_PROGRAM / 2 * 3)));
+    ModifyFlashMemoryRequest &request = *(ModifyFlashMemoryRequest*)requestBuffer.data();
     request.requestId =
         REQUEST_MASK_PROGRAM_MEMORY
         | (program ? REQUEST_MASK_PROGRAM : 0x00)
-        | (force ? REQUEST_MASK_FORCE : 0x00);
+        | (force ? REQUEST_MASK_FORCE : 0x00)
+        | (masked ? REQUEST_MASK_MASKED : 0x00);
     request.tblpag = (uint8_t)(address >> 16);
     request.offset = (uint16_t)address;
 
     uint8_t *p = request.data;
+    uint32_t mask = 0;
     if (program)
     {
-        for (uint32_t i = 0; i < ROW_SIZE_PROGRAM / 2; ++i)
+        for (uint32_t i = 0; i < row.size(); ++i)
         {
             uint32_t x = row[i];
+            if (masked && (x == UNDEFINED_WORD)) continue;
             *(p++) = (uint8_t)(x >> 0);
             *(p++) = (uint8_t)(x >> 8);
             *(p++) = (uint8_t)(x >> 16);
+            mask |= 1u << i;
         }
     }
 
-    requestResponse(&request, p - (uint8_t*)&request, sizeof  ModifyFlashMemoryResponse);
-    const ModifyFlashMemoryResponse *modifyFlashMemoryResponse =
-        (const ModifyFlashMemoryResponse*)_packetTransiver->receivedPacket().data();
-
-    if ((modifyFlashMemoryResponse->status & MODIFY_STATUS_MASK_ERASE_DONE) != 0)
+    size_t requestSize;
+    if (masked)
     {
-        ++_connectionStatistic.programMemoryEraseCount;
+        // the device reads the word mask from the request end, the masked data is not compressed
+        *(p++) = (uint8_t)(mask >> 0);
+        *(p++) = (uint8_t)(mask >> 8);
+        *(p++) = (uint8_t)(mask >> 16);
+        *(p++) = (uint8_t)(mask >> 24);
+        requestSize = p - requestBuffer.data();
     }
-    if ((modifyFlashMemoryResponse->status & MODIFY_STATUS_MASK_PROGRAM_DONE) != 0)
+    else if (rowCount > 1)
     {
-        ++_connectionStatistic.programMemoryProgramCount;
+        requestSize = p - requestBuffer.data();
     }
-
-    if ((modifyFlashMemoryResponse->status & (MODIFY_STATUS_MASK_ERROR_ERASE | MODIFY_STATUS_MASK_ERROR_PROGRAM)) != 0)
+    else
     {
-        errorExit("Error executing the program memory operation: %s", writeStatusErrorToString(modifyFlashMemoryResponse->status).c_str());
+        requestSize = compressRequest(requestBuffer.data(), offsetof(ModifyFlashMemoryRequest, data), p - request.data);
     }
+
+    // the CPU is stalled during program memory operations, so the request is pipelined with the flow control
+    // or it is sent together with the next requests
+    sendRequest(requestBuffer.data(), requestSize,
+        rowCount > 1 ? sizeof(ModifyFlashMemoryRowsResponse) : sizeof(ModifyFlashMemoryResponse), true,
+        [this, address, rowCount](const std::vector<uint8_t> &response)
+        {
+            checkModifyResponse(response, address, rowCount, true);
+        },
+        1, program ? rowCount * 2 : 1, true);
 }
 
 void DeviceConnection::writeDataEEPROM(uint32_t address, const std::vector<uint32_t> &row, bool program, bool force)
 {
+    uint32_t rowCount = program ? (uint32_t)row.size() / (ROW_SIZE_DATA / 2) : 1;
     assert((address & (ROW_SIZE_DATA - 1)) == 0);
-    assert(!program || (row.size() == ROW_SIZE_DATA / 2));
+    assert(!program || ((row.size() % (ROW_SIZE_DATA / 2) == 0) && (rowCount != 0) && (rowCount <= maxWriteRowCount(false))));
 
-    ModifyFlashMemoryRequest request;
-    memset(&request, 0, sizeof request);
+    std::vector<uint8_t> requestBuffer(std::max(sizeof(ModifyFlashMemoryRequest),
+        offsetof(ModifyFlashMemoryRequest, data) + rowCount * ROW_SIZE_DATA));
+    ModifyFlashMemoryRequest &request = *(ModifyFlashMemoryRequest*)requestBuffer.data();
     request.requestId =
         REQUEST_MASK_DATA_EEPROM
         | (program ? REQUEST_MASK_PROGRAM : 0x00)
@@ -207,7 +754,7 @@ void DeviceConnection::writeDataEEPROM(uint32_t address, const std::vector<uint3
     uint8_t *p = request.data;
     if (program)
     {
-        for (uint32_t i = 0; i < ROW_SIZE_DATA / 2; ++i)
+        for (uint32_t i = 0; i < row.size(); ++i)
         {
             uint32_t x = row[i];
             *(p++) = (uint8_t)(x >> 0);
@@ -215,59 +762,583 @@ void DeviceConnection::writeDataEEPROM(uint32_t address, const std::vector<uint3
         }
     }
 
-    requestResponse(&request, p - (uint8_t*)&request, sizeof ModifyFlashMemoryResponse);
-    const ModifyFlashMemoryResponse *modifyFlashMemoryResponse =
-        (const ModifyFlashMemoryResponse*)_packetTransiver->receivedPacket().data();
+    size_t requestSize = (rowCount > 1)
+        ? p - requestBuffer.data()
+        : compressRequest(requestBuffer.data(), offsetof(ModifyFlashMemoryRequest, data), p - request.data);
+
+    sendRequest(requestBuffer.data(), requestSize,
+        rowCount > 1 ? sizeof(ModifyFlashMemoryRowsResponse) : sizeof(ModifyFlashMemoryResponse), true,
+        [this, address, rowCount](const std::vector<uint8_t> &response)
+        {
+            checkModifyResponse(response, address, rowCount, false);
+        },
+        1, program ? rowCount * 2 : 1);
+}
+
+void DeviceConnection::eraseRange(uint32_t address, uint32_t rowCount, bool programMemory, bool force, bool wholeDataEEPROM)
+{
+    uint32_t rowSize = programMemory ? ROW_SIZE_PROGRAM : ROW_SIZE_DATA;
+    assert((address & ((rowSize - 1) | 0xFF000000)) == 0);
+    assert((rowCount != 0) && (wholeDataEEPROM || (rowCount <= MAX_ERASE_RANGE_ROW_COUNT)));
+    assert(!programMemory || !wholeDataEEPROM);
+
+    EraseRangeRequest request;
+    memset(&request, 0, sizeof request);
+    request.requestId = 0x20;
+    request.tblpag = (uint8_t)(address >> 16);
+    request.offset = (uint16_t)address;
+    request.rowCount = (uint16_t)rowCount;
+    request.flags =
+        (programMemory ? ERASE_RANGE_FLAG_PROGRAM_MEMORY : 0x00)
+        | (force ? ERASE_RANGE_FLAG_FORCE : 0x00)
+        | (wholeDataEEPROM ? ERASE_RANGE_FLAG_BULK : 0x00);
+
+    // the CPU is stalled during program memory operations, so the request is pipelined with the flow control
+    // or it is sent together with the next requests
+    sendRequest(&request, sizeof request, sizeof(EraseRangeResponse), true,
+        [this, address, rowSize, programMemory](const std::vector<uint8_t> &response)
+        {
+            const EraseRangeResponse *eraseRangeResponse = (const EraseRangeResponse*)response.data();
+
+            if (programMemory)
+            {
+                _connectionStatistic.programMemoryEraseCount += eraseRangeResponse->eraseCount;
+            }
+            else
+            {
+                _connectionStatistic.dataEEPROMEraseCount += eraseRangeResponse->eraseCount;
+            }
 
-    if ((modifyFlashMemoryResponse->status & MODIFY_STATUS_MASK_ERASE_DONE) != 0)
+            if ((eraseRangeResponse->status & (MODIFY_STATUS_MASK_ERROR_ERASE | MODIFY_STATUS_MASK_ERROR_PROGRAM)) != 0)
+            {
+                errorExit("Error erasing the %s row at address 0x%06X: %s", programMemory ? "program memory" : "data EEPROM",
+                    address + eraseRangeResponse->rowCount * rowSize, writeStatusErrorToString(eraseRangeResponse->status).c_str());
+            }
+        },
+        1, wholeDataEEPROM ? 1 : rowCount, programMemory);
+}
+
+void DeviceConnection::writeDataEEPROMWords(const std::vector<std::pair<uint32_t, uint32_t>> &words)
+{
+    assert(!words.empty() && (words.size() <= MAX_EEPROM_WORD_COUNT));
+
+    WriteEEPROMWordsRequest request;
+    memset(&request, 0, sizeof request);
+    request.requestId = 0x21;
+    request.tblpag = (uint8_t)(words[0].first >> 16);
+    for (size_t i = 0; i < words.size(); ++i)
     {
-        ++_connectionStatistic.dataEEPROMEraseCount;
+        assert(((words[i].first & 1) == 0) && ((words[i].first >> 16) == request.tblpag));
+        request.words[i].offset = (uint16_t)words[i].first;
+        request.words[i].data = (uint16_t)words[i].second;
     }
-    if ((modifyFlashMemoryResponse->status & MODIFY_STATUS_MASK_PROGRAM_DONE) != 0)
+
+    sendRequest(&request, offsetof(WriteEEPROMWordsRequest, words) + words.size() * sizeof(EEPROMWord), sizeof(WriteEEPROMWordsResponse), true,
+        [this, words](const std::vector<uint8_t> &response)
+        {
+            const WriteEEPROMWordsResponse *writeEEPROMWordsResponse = (const WriteEEPROMWordsResponse*)response.data();
+
+            _connectionStatistic.dataEEPROMWordEraseCount += writeEEPROMWordsResponse->eraseCount;
+            _connectionStatistic.dataEEPROMWordProgramCount += writeEEPROMWordsResponse->programCount;
+
+            if ((writeEEPROMWordsResponse->status & (MODIFY_STATUS_MASK_ERROR_ERASE | MODIFY_STATUS_MASK_ERROR_PROGRAM)) != 0)
+            {
+                errorExit("Error writing the data EEPROM word at address 0x%06X: %s",
+                    writeEEPROMWordsResponse->wordCount < words.size() ? words[writeEEPROMWordsResponse->wordCount].first : 0,
+                    writeStatusErrorToString(writeEEPROMWordsResponse->status).c_str());
+            }
+        },
+        1, (unsigned)words.size() * 2);
+}
+
+void DeviceConnection::linkTestAsync(const std::vector<uint8_t> &data, bool echo, const LinkTestHandler &handler)
+{
+    assert(data.size() <= maxLinkTestDataSize());
+
+    std::vector<uint8_t> request;
+    request.push_back(0x22);
+    request.push_back(echo ? LINK_TEST_FLAG_ECHO : 0);
+    request.insert(request.end(), data.begin(), data.end());
+
+    sendRequest(request.data(), request.size(), echo ? request.size() : sizeof(LinkTestResponse), true,
+        [data, echo, handler](const std::vector<uint8_t> &response)
+        {
+            if (echo)
+            {
+                handler(std::vector<uint8_t>(response.begin() + offsetof(LinkTestRequest, data),
+                    response.begin() + offsetof(LinkTestRequest, data) + data.size()));
+            }
+            else
+            {
+                const LinkTestResponse *linkTestResponse = (const LinkTestResponse*)response.data();
+                if (linkTestResponse->size != data.size())
+                {
+                    errorExit("Wrong link test data size: %u", (unsigned)linkTestResponse->size);
+                }
+                handler(std::vector<uint8_t>());
+            }
+        });
+}
+
+size_t DeviceConnection::maxLinkTestDataSize() const
+{
+    return maxRequestSize() - offsetof(LinkTestRequest, data);
+}
+
+DeviceDiagnostics DeviceConnection::readDiagnostics(bool clear)
+{
+    assert((_capabilities.capabilityMask & CAPABILITY_MASK_DIAGNOSTICS) != 0);
+
+    ReadDiagnosticsRequest request;
+    request.requestId = 0x24;
+    request.flags = clear ? DIAGNOSTICS_FLAG_CLEAR : 0;
+
+    DeviceDiagnostics diagnostics;
+    sendRequest(&request, sizeof request, sizeof(ReadDiagnosticsResponse), false,
+        [&diagnostics](const std::vector<uint8_t> &response)
+        {
+            const ReadDiagnosticsResponse *readDiagnosticsResponse = (const ReadDiagnosticsResponse*)response.data();
+            diagnostics.tickFrequency = readDiagnosticsResponse->tickFrequency;
+            diagnostics.frameCount = readDiagnosticsResponse->frameCount;
+            diagnostics.crcErrorCount = readDiagnosticsResponse->crcErrorCount;
+            diagnostics.droppedFrameCount = readDiagnosticsResponse->droppedFrameCount;
+            diagnostics.overrunCount = readDiagnosticsResponse->overrunCount;
+            diagnostics.rowTestCount = readDiagnosticsResponse->rowTestCount;
+            diagnostics.skippedRowCount = readDiagnosticsResponse->skippedRowCount;
+            diagnostics.eraseCount = readDiagnosticsResponse->eraseCount;
+            diagnostics.programCount = readDiagnosticsResponse->programCount;
+            diagnostics.rowTicks = readDiagnosticsResponse->rowTicks;
+            diagnostics.eraseTicks = readDiagnosticsResponse->eraseTicks;
+            diagnostics.programTicks = readDiagnosticsResponse->programTicks;
+        });
+    waitPendingRequests();
+
+    return diagnostics;
+}
+
+void DeviceConnection::startFirmware()
+{
+    uint8_t requestId = 0x03;
+    requestResponse(&requestId, sizeof requestId, 1);
+}
+
+void DeviceConnection::waitPendingRequests()
+{
+    if (!_broadcastNodes.empty()) pollBroadcastNodes();
+    while (!_pendingRequests.empty()) waitResponse();
+}
+
+void DeviceConnection::sendRequest(const void *requestData, size_t requestSize, size_t responseSize, bool pipelined, const ResponseHandler &handler,
+    unsigned responseCount, unsigned operationCount, bool stalling)
+{
+    assert(requestSize != 0);
+
+    if (!_broadcastNodes.empty())
     {
-        ++_connectionStatistic.dataEEPROMProgramCount;
+        // the nodes have no responses, the next request is sent after the flash memory operations of the nodes,
+        // the nodes are polled after each batch, so the lost requests slow down the next batches
+        std::vector<uint8_t> request((const uint8_t*)requestData, (const uint8_t*)requestData + requestSize);
+        _packetTransiver->sendPacket(request);
+        Sleep(operationCount * _broadcastOperationTime);
+        ++_broadcastRequestCount;
+        _broadcastOperationCount += operationCount;
+        if (_broadcastOperationCount >= BROADCAST_BATCH_OPERATIONS) pollBroadcastNodes();
+        return;
     }
 
-    if ((modifyFlashMemoryResponse->status & (MODIFY_STATUS_MASK_ERROR_ERASE | MODIFY_STATUS_MASK_ERROR_PROGRAM)) != 0)
+    PendingRequest pendingRequest;
+    pendingRequest.requestId = *(const uint8_t*)requestData;
+    pendingRequest.sequence = _sequence++;
+    // the half-duplex bus, the node response and the next request cannot be sent at the same time
+    pendingRequest.pipelined = pipelined && (_protocolVersion >= 2) && (_nodeAddress == NODE_ADDRESS_NONE);
+    pendingRequest.stalling = stalling && !_flowControl;
+    pendingRequest.sent = false;
+    pendingRequest.responseSize = responseSize;
+    pendingRequest.responseCount = responseCount;
+    pendingRequest.receivedCount = 0;
+    pendingRequest.handler = handler;
+
+    std::vector<uint8_t> request((const uint8_t*)requestData, (const uint8_t*)requestData + requestSize);
+    if (_protocolVersion >= 2)
     {
-        errorExit("Error executing the data EEPROM operation: %s", writeStatusErrorToString(modifyFlashMemoryResponse->status).c_str());
+        request[0] |= REQUEST_MASK_SEQUENCE;
+        request.push_back(pendingRequest.sequence);
+        ++pendingRequest.responseSize;
     }
+    pendingRequest.frame = _packetTransiver->encodeRequest(request);
+
+    while (!_pendingRequests.empty()
+        && (!pendingRequest.pipelined || !canSendPipelined(pendingRequest)))
+    {
+        waitResponse();
+    }
+
+    // the pipelined stalling request waits for the next requests, so the device receives all of them
+    // before its CPU is stalled, the requests after it are kept too to preserve the order
+    bool keep = (pendingRequest.pipelined && pendingRequest.stalling)
+        || (!_pendingRequests.empty() && !_pendingRequests.back().sent);
+    _pendingRequests.push_back(pendingRequest);
+    if (!keep) sendPendingFrames();
 }
 
-void DeviceConnection::startFirmware()
+void DeviceConnection::sendPendingFrames()
 {
-    uint8_t requestId = 0x03;
-    requestResponse(&requestId, sizeof requestId, 1);
+    // the frames are written without gaps, the device detects the end of them by the idle line
+    std::vector<uint8_t> frames;
+    for (PendingRequest &pendingRequest : _pendingRequests)
+    {
+        if (pendingRequest.sent) continue;
+        frames.insert(frames.end(), pendingRequest.frame.begin(), pendingRequest.frame.end());
+        pendingRequest.sent = true;
+    }
+    if (!frames.empty()) _packetTransiver->sendFrame(frames);
 }
 
 void DeviceConnection::requestResponse(const void *requestData, size_t requestSize, size_t responseSize)
 {
-    std::vector<uint8_t> request((const uint8_t*)requestData, (const uint8_t*)requestData + requestSize);
+    sendRequest(requestData, requestSize, responseSize, false, ResponseHandler());
+    waitPendingRequests();
+}
+
+bool DeviceConnection::canSendPipelined(const PendingRequest &request) const
+{
+    size_t frameSize = request.frame.size();
+    if (_flowControl)
+    {
+        // the device stops the PC while it cannot receive, so the requests are sent back to back
+        size_t pendingSize = frameSize;
+        for (const PendingRequest &pendingRequest : _pendingRequests)
+        {
+            if (!pendingRequest.pipelined) return false;
+            pendingSize += pendingRequest.frame.size();
+        }
+
+        return pendingSize <= FLOW_CONTROL_WINDOW_SIZE;
+    }
+
+    // no bytes are received while the device CPU is stalled, so the stalling requests are pipelined only with
+    // the requests sent together with them, all frames shall fit the device receive queue
+    bool stalling = request.stalling;
+    for (const PendingRequest &pendingRequest : _pendingRequests) stalling = stalling || pendingRequest.stalling;
+    if (stalling)
+    {
+        size_t unsentSize = frameSize;
+        for (const PendingRequest &pendingRequest : _pendingRequests)
+        {
+            if (!pendingRequest.pipelined || pendingRequest.sent) return false;
+            unsentSize += pendingRequest.frame.size();
+        }
+
+        return unsentSize <= _rxQueueSize;
+    }
+
+    // all pending frames and the new one shall fit the device receive queue, the oldest frame can still be
+    // in the queue at the high baud rates, it is left out only after its first response is received
+    size_t queuedSize = frameSize;
+    for (size_t i = 0; i < _pendingRequests.size(); ++i)
+    {
+        if (!_pendingRequests[i].pipelined) return false;
+        if ((i != 0) || (_pendingRequests[i].receivedCount == 0)) queuedSize += _pendingRequests[i].frame.size();
+    }
+
+    return queuedSize <= _rxQueueSize;
+}
+
+bool DeviceConnection::checkConnection()
+{
+    std::vector<uint8_t> startCommunicationRequest;
+    startCommunicationRequest.push_back(0x00);
+    startCommunicationRequest.push_back(2);
 
+    // the attempts shall be shorter than BAUD_RATE_FALLBACK_TIME
     for (unsigned i = 0; i < 3; ++i)
     {
-        _packetTransiver->sendPacket(request);
+        _serialPort->purge();
+        _packetTransiver->sendPacket(startCommunicationRequest);
+
+        unsigned startTime = GetTickCount();
+        while (GetTickCount() - startTime < 100)
+        {
+            if (_packetTransiver->pool() && (_packetTransiver->receivedPacket()[0] == 0xFF)) return true;
+        }
+    }
+
+    return false;
+}
+
+void DeviceConnection::waitResponse()
+{
+    assert(!_pendingRequests.empty());
+
+    sendPendingFrames();
+
+    unsigned timeoutCount = 0;
+    unsigned nakCount = 0;
+    bool resend = false;
+    while (timeoutCount < 3)
+    {
+        if (resend)
+        {
+            // resend all requests starting from the lost one together
+            for (PendingRequest &pendingRequest : _pendingRequests) pendingRequest.sent = false;
+            sendPendingFrames();
+        }
+        resend = true;
 
+        PendingRequest &request = _pendingRequests.front();
+        bool nakReceived = false;
         unsigned startTime = GetTickCount();
         while (GetTickCount() - startTime < 500)
         {
             if (_packetTransiver->pool())
             {
-                if (_packetTransiver->receivedPacket()[0] != (~request[0] & 0xFF)) continue;
-                if (_packetTransiver->receivedPacket().size() != responseSize)
+                const std::vector<uint8_t> &response = _packetTransiver->receivedPacket();
+                // the responses to the requests before the corrupted one are already received,
+                // so the oldest request is lost
+                if ((_protocolVersion >= 2) && (response.size() == 1) && (response[0] == NAK_RESPONSE_ID))
                 {
-                    errorExit("Wrong size for response code 0x%02X", (unsigned)_packetTransiver->receivedPacket()[0]);
+                    ++_connectionStatistic.nakCount;
+                    nakReceived = true;
+                    break;
                 }
+                if (response[0] != (~request.requestId & 0xFF)) continue;
+                if ((_protocolVersion >= 2) && ((response.size() < 2) || (response.back() != request.sequence))) continue;
+                if (response.size() != request.responseSize)
+                {
+                    errorExit("Wrong size for response code 0x%02X", (unsigned)response[0]);
+                }
+                // skip the responses repeated after resending and wait for the lost one
+                if ((request.responseCount > 1) && (response[1] != request.receivedCount)) continue;
+
+                ResponseHandler handler = request.handler;
+                if (++request.receivedCount == request.responseCount) _pendingRequests.pop_front();
+                if (handler) handler(response);
                 return;
             }
         }
 
+        if (nakReceived && (nakCount < NAK_RETRY_COUNT))
+        {
+            // the device still answers the requests queued after the corrupted one,
+            // their responses are skipped and the requests are resent without the timeout
+            ++nakCount;
+            unsigned idleStartTime = GetTickCount();
+            while (GetTickCount() - idleStartTime < NAK_IDLE_TIME)
+            {
+                if (_packetTransiver->pool()) idleStartTime = GetTickCount();
+            }
+            _serialPort->purge();
+            continue;
+        }
+
+        ++timeoutCount;
+        ++_connectionStatistic.timeoutCount;
         printf("*");
         Sleep(1000);
         _serialPort->purge();
     }
 
-    errorExit("No answer from request code 0x%02X", (unsigned)request[0]);
+    errorExit("No answer from request code 0x%02X", (unsigned)_pendingRequests.front().requestId);
+}
+
+void DeviceConnection::readBroadcastStatus(uint8_t *status, unsigned *requestCount)
+{
+    uint8_t requestId = 0x23;
+    sendRequest(&requestId, sizeof requestId, sizeof(BroadcastStatusResponse), false,
+        [status, requestCount](const std::vector<uint8_t> &response)
+        {
+            const BroadcastStatusResponse *broadcastStatusResponse = (const BroadcastStatusResponse*)response.data();
+            *status = broadcastStatusResponse->status;
+            *requestCount = broadcastStatusResponse->requestCount;
+        });
+    waitPendingRequests();
+}
+
+void DeviceConnection::pollBroadcastNodes()
+{
+    if (_broadcastRequestCount == 0) return;
+
+    bool lost = false;
+    for (const std::shared_ptr<DeviceConnection> &node : _broadcastNodes)
+    {
+        uint8_t status;
+        unsigned requestCount;
+        node->readBroadcastStatus(&status, &requestCount);
+
+        if ((status & (MODIFY_STATUS_MASK_ERROR_ERASE | MODIFY_STATUS_MASK_ERROR_PROGRAM)) != 0)
+        {
+            errorExit("Error writing the node %u: %s", node->_nodeAddress, writeStatusErrorToString(status).c_str());
+        }
+        // the node has not received the requests, the rows are written by the node connection later
+        if (requestCount < _broadcastRequestCount)
+        {
+            node->_connectionStatistic.lostBroadcastCount += _broadcastRequestCount - requestCount;
+            lost = true;
+        }
+    }
+    _broadcastRequestCount = 0;
+    _broadcastOperationCount = 0;
+
+    // a node is slower than the expected flash memory operations or the bus is noisy
+    if (lost) _broadcastOperationTime = std::min(_broadcastOperationTime * 2, FLASH_OPERATION_TIME_MAX);
+}
+
+size_t DeviceConnection::maxRequestSize() const
+{
+    return _capabilities.maxPacketSize - 1 - (_nodeAddress != NODE_ADDRESS_NONE ? 1 : 0);
+}
+
+std::vector<uint32_t> DeviceConnection::parseRow(const uint8_t *data)
+{
+    std::vector<uint32_t> result(ROW_SIZE_PROGRAM / 2);
+    const uint8_t *p = data;
+    for (size_t i = 0; i < ROW_SIZE_PROGRAM / 2; ++i)
+    {
+        uint32_t x = *(p++);
+        x |= (*(p++) << 8);
+        x |= (*(p++) << 16);
+        result[i] = x;
+    }
+
+    return result;
+}
+
+std::vector<uint8_t> DeviceConnection::compressData(const uint8_t *data, size_t size)
+{
+    const size_t MAX_COUNT = 128;
+    const size_t MIN_REPEAT_COUNT = 3;
+
+    // the count of the same bytes ending before end
+    auto repeatCount = [data, MAX_COUNT](size_t end) -> size_t
+    {
+        size_t count = 1;
+        while ((count < end) && (count < MAX_COUNT) && (data[end - count - 1] == data[end - 1])) ++count;
+        return count;
+    };
+
+    struct Token
+    {
+        std::vector<uint8_t> bytes; // the control byte is the last one
+        size_t count; // decoded bytes
+    };
+
+    // the device decodes the tokens from the data end
+    std::vector<Token> tokens;
+    size_t compressedSize = 0;
+    size_t end = size;
+    while (end != 0)
+    {
+        Token token;
+        size_t count = repeatCount(end);
+        if (count >= MIN_REPEAT_COUNT)
+        {
+            token.bytes.push_back(data[end - 1]);
+            token.bytes.push_back((uint8_t)(0x80 | (count - 1)));
+        }
+        else
+        {
+            size_t begin = end;
+            do
+            {
+                --begin;
+            }
+            while ((begin != 0) && (end - begin < MAX_COUNT) && (repeatCount(begin) < MIN_REPEAT_COUNT));
+            count = end - begin;
+            token.bytes.assign(data + begin, data + end);
+            token.bytes.push_back((uint8_t)(count - 1));
+        }
+        token.count = count;
+        end -= count;
+        compressedSize += token.bytes.size();
+        tokens.push_back(token);
+    }
+
+    if (compressedSize >= size) return std::vector<uint8_t>();
+
+    // the decoded bytes shall not overwrite the unread ones
+    size_t readIndex = compressedSize;
+    size_t writeIndex = size;
+    for (const Token &token : tokens)
+    {
+        readIndex -= token.bytes.size();
+        writeIndex -= token.count;
+        if (writeIndex < readIndex) return std::vector<uint8_t>();
+    }
+
+    std::vector<uint8_t> result;
+    result.reserve(compressedSize);
+    for (auto token = tokens.rbegin(); token != tokens.rend(); ++token)
+    {
+        result.insert(result.end(), token->bytes.begin(), token->bytes.end());
+    }
+
+    return result;
+}
+
+size_t DeviceConnection::compressRequest(uint8_t *request, size_t dataOffset, size_t dataSize) const
+{
+    if (((_capabilities.capabilityMask & CAPABILITY_MASK_COMPRESSED_WRITE) == 0) || (dataSize == 0))
+    {
+        return dataOffset + dataSize;
+    }
+
+    std::vector<uint8_t> compressedData = compressData(request + dataOffset, dataSize);
+    if (compressedData.empty()) return dataOffset + dataSize;
+
+    request[0] |= REQUEST_MASK_COMPRESSED;
+    memcpy(request + dataOffset, compressedData.data(), compressedData.size());
+
+    return dataOffset + compressedData.size();
+}
+
+void DeviceConnection::checkModifyResponse(const std::vector<uint8_t> &response, uint32_t address, uint32_t rowCount, bool programMemory)
+{
+    const ModifyFlashMemoryResponse *modifyFlashMemoryResponse = (const ModifyFlashMemoryResponse*)response.data();
+    uint8_t status = modifyFlashMemoryResponse->status;
+
+    unsigned eraseCount = ((status & MODIFY_STATUS_MASK_ERASE_DONE) != 0) ? 1 : 0;
+    unsigned programCount = ((status & MODIFY_STATUS_MASK_PROGRAM_DONE) != 0) ? 1 : 0;
+    unsigned eraseAvoidedCount = ((status & MODIFY_STATUS_MASK_ERASE_AVOIDED) != 0) ? 1 : 0;
+    uint32_t errorRowIndex = 0;
+    if (rowCount > 1)
+    {
+        const ModifyFlashMemoryRowsResponse *modifyFlashMemoryRowsResponse = (const ModifyFlashMemoryRowsResponse*)response.data();
+        eraseCount = modifyFlashMemoryRowsResponse->eraseCount;
+        programCount = modifyFlashMemoryRowsResponse->programCount;
+        eraseAvoidedCount = modifyFlashMemoryRowsResponse->eraseAvoidedCount;
+        errorRowIndex = modifyFlashMemoryRowsResponse->rowCount;
+    }
+
+    if (programMemory)
+    {
+        _connectionStatistic.programMemoryEraseCount += eraseCount;
+        _connectionStatistic.programMemoryProgramCount += programCount;
+        _connectionStatistic.programMemoryEraseAvoidedCount += eraseAvoidedCount;
+    }
+    else
+    {
+        _connectionStatistic.dataEEPROMEraseCount += eraseCount;
+        _connectionStatistic.dataEEPROMProgramCount += programCount;
+        _connectionStatistic.dataEEPROMEraseAvoidedCount += eraseAvoidedCount;
+    }
+
+    if ((status & (MODIFY_STATUS_MASK_ERROR_ERASE | MODIFY_STATUS_MASK_ERROR_PROGRAM)) != 0)
+    {
+        errorExit("Error executing the %s operation at address 0x%06X: %s", programMemory ? "program memory" : "data EEPROM",
+            address + errorRowIndex * (programMemory ? ROW_SIZE_PROGRAM : ROW_SIZE_DATA), writeStatusErrorToString(status).c_str());
+    }
+}
+
+uint32_t DeviceConnection::maxWriteRowCount(bool programMemory) const
+{
+    if ((_capabilities.capabilityMask & CAPABILITY_MASK_MULTI_ROW_WRITE) == 0) return 1;
+
+    // the request header and the row data
+    size_t dataSize = programMemory ? ROW_SIZE_PROGRAM / 2 * 3 : ROW_SIZE_DATA;
+    size_t rowCount = (maxRequestSize() - offsetof(ModifyFlashMemoryRequest, data)) / dataSize;
+    if (rowCount > MAX_WRITE_ROW_COUNT) rowCount = MAX_WRITE_ROW_COUNT;
+
+    return rowCount != 0 ? (uint32_t)rowCount : 1;
 }
 
 std::string DeviceConnection::writeStatusErrorToString(uint8_t status)
@@ -3,52 +3,234 @@
 
 #include "PacketTransiver.h"
 
+const unsigned BAUD_RATE_DEFAULT = 115200;
+
 struct BootloaderParams
 {
     uint32_t address;
     uint32_t size;
 };
 
+const unsigned
+    CAPABILITY_MASK_READ_RANGE = 0x0001,
+    CAPABILITY_MASK_SWITCH_BAUD_RATE = 0x0002,
+    CAPABILITY_MASK_COMPRESSED_WRITE = 0x0004,
+    CAPABILITY_MASK_RANGE_CRC = 0x0008,
+    CAPABILITY_MASK_ROW_DIGESTS = 0x0010,
+    CAPABILITY_MASK_BLANK_CHECK = 0x0020,
+    CAPABILITY_MASK_FLOW_CONTROL = 0x0040,
+    CAPABILITY_MASK_ERASE_RANGE = 0x0080,
+    CAPABILITY_MASK_WRITE_EEPROM_WORDS = 0x0100,
+    CAPABILITY_MASK_MASKED_WRITE = 0x0200,
+    CAPABILITY_MASK_MULTI_ROW_WRITE = 0x0400,
+    CAPABILITY_MASK_LINK_TEST = 0x0800,
+    CAPABILITY_MASK_BROADCAST = 0x1000,
+    CAPABILITY_MASK_RX_INTERRUPT = 0x2000,
+    CAPABILITY_MASK_DIAGNOSTICS = 0x4000,
+    CAPABILITY_MASK_DIRECT_VECTORS = 0x8000;
+
+// the capability block of the 'Start communication' response (protocol version 2)
+struct DeviceCapabilities
+{
+    bool valid = false; // false for the bootloaders without the capability block
+    unsigned capabilityMask = 0; // CAPABILITY_MASK_*
+    size_t maxPacketSize = 128;
+    std::vector<unsigned> baudRates; // supported standard baud rates higher than BAUD_RATE_DEFAULT
+    uint32_t deviceId = 0;
+    std::vector<uint32_t> configWords;
+    // CAPABILITY_MASK_RX_INTERRUPT, the handler address is written to the alternate vector with the target firmware
+    uint32_t rxHandlerAddress = 0;
+    uint32_t rxVectorAddress = 0;
+};
+
 struct DeviceConnectionStatistic
 {
     unsigned programMemoryEraseCount = 0;
     unsigned programMemoryProgramCount = 0;
+    unsigned programMemoryEraseAvoidedCount = 0; // programmed without the erase (only 1 -> 0 bit changes)
     unsigned dataEEPROMEraseCount = 0;
     unsigned dataEEPROMProgramCount = 0;
+    unsigned dataEEPROMEraseAvoidedCount = 0;
+    unsigned dataEEPROMWordEraseCount = 0; // the single word operations
+    unsigned dataEEPROMWordProgramCount = 0;
+    unsigned nakCount = 0; // the requests resent after the device detected a corrupted frame
+    unsigned timeoutCount = 0; // the requests resent after the response timeout
+    unsigned corruptedFrameCount = 0; // the received frames dropped by the PC
+    unsigned lostBroadcastCount = 0; // the broadcast requests not executed by the node
+};
+
+// the bootloader counters (CAPABILITY_MASK_DIAGNOSTICS), the 16-bit counters wrap around
+struct DeviceDiagnostics
+{
+    uint32_t tickFrequency = 0; // the time unit of the ticks
+    unsigned frameCount = 0; // the received frames with the right CRC
+    unsigned crcErrorCount = 0; // the received frames with a wrong CRC
+    unsigned droppedFrameCount = 0; // the frames not completed (a wrong byte stuffing, a new start byte, a wrong length)
+    unsigned overrunCount = 0; // the UART receive buffer overruns
+    unsigned rowTestCount = 0; // the row compare passes
+    unsigned skippedRowCount = 0; // the rows not erased and not programmed, they already have the data
+    unsigned eraseCount = 0;
+    unsigned programCount = 0;
+    uint32_t rowTicks = 0; // the row modify time including the tests, the erase and program operations
+    uint32_t eraseTicks = 0;
+    uint32_t programTicks = 0;
 };
 
 class DeviceConnection
 {
 public:
 
-	DeviceConnection(const std::shared_ptr<SerialPort> &serialPort);
+    typedef std::function<void(uint32_t address, const std::vector<uint32_t> &row)> RowHandler;
+    typedef std::function<void(uint32_t crc)> CrcHandler;
+    typedef std::function<void(uint32_t address, const std::vector<uint16_t> &digests)> DigestHandler;
+    typedef std::function<void(uint32_t address, const std::vector<bool> &nonBlankRows)> BlankCheckHandler;
+    typedef std::function<void(const std::vector<uint8_t> &data)> LinkTestHandler;
+
+    static const uint32_t MAX_ROW_DIGEST_COUNT = 32;
+    static const uint32_t MAX_BLANK_CHECK_ROW_COUNT = 256;
+    static const uint32_t MAX_ERASE_RANGE_ROW_COUNT = 128; // the erase time is shorter than the response timeout
+    static const uint32_t MAX_EEPROM_WORD_COUNT = 31;
+    static const uint32_t MAX_WRITE_ROW_COUNT = 32; // the write time is shorter than the response timeout
+
+    // nodeAddress - the node of the multi-drop bus (CAPABILITY_MASK_BROADCAST), the requests are not pipelined
+	DeviceConnection(const std::shared_ptr<SerialPort> &serialPort, unsigned nodeAddress = NODE_ADDRESS_NONE);
 	~DeviceConnection();
 
     void startCommunication(unsigned timeout); // timeout in seconds (0 = infinite)
+    // the connection with NODE_ADDRESS_BROADCAST sends the write requests to all connected nodes of the bus,
+    // the connection parameters are the first node ones, the nodes are polled by waitPendingRequests,
+    // the node errors are reported and the lost requests are counted in the node statistic
+    void startBroadcast(const std::vector<std::shared_ptr<DeviceConnection>> &nodes);
+    unsigned nodeAddress() const;
     const BootloaderParams &bootloaderParams() const;
+    unsigned protocolVersion() const;
+    const DeviceCapabilities &capabilities() const;
+    unsigned baudRate() const;
+
+    // switches to the highest baud rate supported by the device and the serial port,
+    // but not higher than maxBaudRate (0 - no limit), the baud rate of a bus node is not switched
+    void switchBaudRate(unsigned maxBaudRate);
     unsigned connectionTime() const; // ms
-    const DeviceConnectionStatistic &connectionStatistic() const;
+    DeviceConnectionStatistic connectionStatistic() const;
 
     // reads ROW_SIZE_PROGRAM row by address
     // address must be aligned by ROW_SIZE_PROGRAM
     std::vector<uint32_t> readRow(uint32_t address);
+    // same as readRow but the request is pipelined (protocol version 2),
+    // the handler is called when the row is received
+    void readRowAsync(uint32_t address, const RowHandler &handler);
+    // reads rowCount consecutive rows, the device streams the rows of a range (CAPABILITY_MASK_READ_RANGE),
+    // the handler is called for each row in the address order
+    void readRowsAsync(uint32_t address, uint32_t rowCount, const RowHandler &handler);
+    // calculates CRC-32 of rowCount consecutive ROW_SIZE_PROGRAM rows in the device (CAPABILITY_MASK_RANGE_CRC),
+    // the upper byte of the words is included if wordMask has it, the request is pipelined
+    void calculateRangeCrcAsync(uint32_t address, uint32_t rowCount, uint32_t wordMask, const CrcHandler &handler);
+    // CRC-32 of the words as calculateRangeCrcAsync does
+    static uint32_t calculateCrc(const std::vector<uint32_t> &words, uint32_t wordMask);
+    // reads the digests of rowCount (up to MAX_ROW_DIGEST_COUNT) consecutive program memory (ROW_SIZE_PROGRAM)
+    // or data EEPROM (ROW_SIZE_DATA) rows (CAPABILITY_MASK_ROW_DIGESTS), the request is pipelined
+    void readRowDigestsAsync(uint32_t address, uint32_t rowCount, bool programMemory, const DigestHandler &handler);
+    // the row digest as readRowDigestsAsync returns
+    static uint16_t calculateRowDigest(const std::vector<uint32_t> &row, bool programMemory);
+    // tests rowCount (up to MAX_BLANK_CHECK_ROW_COUNT) consecutive program memory (ROW_SIZE_PROGRAM)
+    // or data EEPROM (ROW_SIZE_DATA) rows for the erased state (CAPABILITY_MASK_BLANK_CHECK),
+    // the handler gets true for the rows which are not blank, the request is pipelined
+    void blankCheckAsync(uint32_t address, uint32_t rowCount, bool programMemory, const BlankCheckHandler &handler);
 
-    void writeProgramMemory(uint32_t address, const std::vector<uint32_t> &row, bool program, bool force);
+    // write requests are asynchronous, the errors are reported when the responses are received,
+    // the row data can have up to maxWriteRowCount consecutive rows (CAPABILITY_MASK_MULTI_ROW_WRITE),
+    // the program memory rows of one request shall have the same address high part (TBLPAG),
+    // masked - the device keeps its values of the UNDEFINED_WORD words (CAPABILITY_MASK_MASKED_WRITE, one row)
+    void writeProgramMemory(uint32_t address, const std::vector<uint32_t> &row, bool program, bool force, bool masked = false);
     void writeDataEEPROM(uint32_t address, const std::vector<uint32_t> &row, bool program, bool force);
+    // the rows of one write request, the device packet buffer limits it
+    uint32_t maxWriteRowCount(bool programMemory) const;
+    // erases rowCount (up to MAX_ERASE_RANGE_ROW_COUNT) consecutive program memory (ROW_SIZE_PROGRAM)
+    // or data EEPROM (ROW_SIZE_DATA) rows by one request (CAPABILITY_MASK_ERASE_RANGE),
+    // the device skips the blank rows (if not force), the zero row and the bootloader image,
+    // wholeDataEEPROM - the range is the whole data EEPROM (any row count), it is erased by one operation
+    void eraseRange(uint32_t address, uint32_t rowCount, bool programMemory, bool force, bool wholeDataEEPROM = false);
+    // writes the data EEPROM words (up to MAX_EEPROM_WORD_COUNT, address and value pairs) by the single word operations
+    // (CAPABILITY_MASK_WRITE_EEPROM_WORDS), the device erases a word only if the new value sets bits
+    void writeDataEEPROMWords(const std::vector<std::pair<uint32_t, uint32_t>> &words);
+    // sends the data (up to maxLinkTestDataSize bytes) to the device without the flash memory access
+    // (CAPABILITY_MASK_LINK_TEST), echo - the device returns the data, the handler gets the returned data
+    // (empty if not echo), the request is pipelined
+    void linkTestAsync(const std::vector<uint8_t> &data, bool echo, const LinkTestHandler &handler);
+    size_t maxLinkTestDataSize() const;
+    // reads the bootloader counters (CAPABILITY_MASK_DIAGNOSTICS), clear - the device clears them after the response
+    DeviceDiagnostics readDiagnostics(bool clear);
     void startFirmware();
 
+    // waits for the responses of all sent requests
+    void waitPendingRequests();
+
 private:
 
+    typedef std::function<void(const std::vector<uint8_t> &response)> ResponseHandler;
+
+    struct PendingRequest
+    {
+        uint8_t requestId; // without REQUEST_MASK_SEQUENCE
+        uint8_t sequence;
+        bool pipelined;
+        bool stalling; // the device CPU is stalled by the program memory operations, no bytes are received
+        bool sent; // the requests sent together with a stalling one are kept until the next wait
+        size_t responseSize;
+        unsigned responseCount; // the responses of a multi-response request have the index in the second byte
+        unsigned receivedCount;
+        std::vector<uint8_t> frame;
+        ResponseHandler handler;
+    };
+
     std::shared_ptr<SerialPort> _serialPort;
     std::shared_ptr<PacketTransiver> _packetTransiver;
+    unsigned _nodeAddress;
+    std::vector<std::shared_ptr<DeviceConnection>> _broadcastNodes;
+    unsigned _broadcastRequestCount = 0; // since the previous poll
+    unsigned _broadcastOperationCount = 0; // the flash memory operations since the previous poll
+    unsigned _broadcastOperationTime = 0; // ms, the wait for one flash memory operation of the nodes
 
     BootloaderParams _bootloaderParams;
+    unsigned _protocolVersion = 1;
+    DeviceCapabilities _capabilities;
+    unsigned _baudRate = BAUD_RATE_DEFAULT;
+    size_t _rxQueueSize = 0; // the device receive queue size in bytes
+    bool _flowControl = false; // the device stops the PC by CTS
     unsigned _startTime;
     DeviceConnectionStatistic _connectionStatistic;
 
+    uint8_t _sequence = 0;
+    std::deque<PendingRequest> _pendingRequests;
+
+    // sends the request and returns without waiting for the response,
+    // a pipelined request can be sent while the previous requests are not complete,
+    // the broadcast request waits for the flash memory operations (operationCount) of the nodes
+    // and polls the nodes after each batch,
+    // a stalling request is sent with the next requests together by the next wait without the flow control
+    void sendRequest(const void *requestData, size_t requestSize, size_t responseSize, bool pipelined, const ResponseHandler &handler,
+        unsigned responseCount = 1, unsigned operationCount = 0, bool stalling = false);
     // received packet is in _packetTransiver
     void requestResponse(const void *requestData, size_t requestSize, size_t responseSize);
+    bool canSendPipelined(const PendingRequest &request) const;
+    void sendPendingFrames(); // sends the requests which are not sent yet by one write
+    bool checkConnection(); // returns false if the device does not answer the 'Start communication' request
+    void waitResponse(); // waits for the next response of the oldest pending request
+    // reads and clears the status of the broadcast requests executed by the node
+    void readBroadcastStatus(uint8_t *status, unsigned *requestCount);
+    void pollBroadcastNodes();
+    // the request size limit without the sequence number and the node address
+    size_t maxRequestSize() const;
+
+    static std::vector<uint32_t> parseRow(const uint8_t *data);
+    // run-length encoding for the in place decoding in the device,
+    // returns an empty vector if the compressed data is not shorter or cannot be decoded in place
+    static std::vector<uint8_t> compressData(const uint8_t *data, size_t size);
+    // replaces the request data with the compressed data if possible, returns the request size
+    size_t compressRequest(uint8_t *request, size_t dataOffset, size_t dataSize) const;
 
+    // updates the statistic and exits on the errors of the 'Modify Flash Memory' response
+    void checkModifyResponse(const std::vector<uint8_t> &response, uint32_t address, uint32_t rowCount, bool programMemory);
     static std::string writeStatusErrorToString(uint8_t status);
 
 };
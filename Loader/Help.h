@@ -5,24 +5,42 @@ const char * const HELP_TEXT =
 "<loader> [-h]\n"
 "        -h, --help - show help\n"
 "\n"
-"<loader> [-i,-t,-m] <serial-port>\n"
+"<loader> [-i,-t,-b,-m,-n] <serial-port>\n"
 "        -i, --info - connect to the device and show bootloader information\n"
 "\n"
-"<loader> -p [-t,-m,-f,-e,-r] <serial-port> <firmware-file-name>\n"
-"        -p, --program - program the firmware into the device with verification\n"
+"<loader> -p [-t,-b,-m,-f,-e,-r,-n,--stats] <serial-port> <firmware-file-name>\n"
+"        -p, --program - program the firmware into the device with verification,\n"
+"                 nothing is programmed if the device image manifest matches\n"
+"                 the firmware (use -f to program anyway), several nodes of\n"
+"                 the multi-drop bus are programmed by the broadcast\n"
+"                 requests at the same time\n"
 "\n"
-"<loader> -v [-t,-m] <serial-port> <firmware-file-name>\n"
+"<loader> -v [-t,-b,-m,-c,-n,--stats] <serial-port> <firmware-file-name>\n"
 "        -v, --verify - verify if the device has the specified firmware\n"
 "\n"
-"<loader> -l [-t,-m,-a,-s] <serial-port> <firmware-file-name>\n"
+"<loader> -l [-t,-b,-m,-a,-s,-n,--stats] <serial-port> <firmware-file-name>\n"
 "        -l, --load - download the current device firmware to the file\n"
 "\n"
-"<loader> -e [-t,-m,-f] <serial-port>\n"
+"<loader> -e [-t,-b,-m,-f,-n,--stats] <serial-port>\n"
 "        -e, --erase - erase all device memory excluding the bootloader\n"
 "\n"
+"<loader> -k[=<pattern>] [-t,-b,-m,-n,--stats] <serial-port>\n"
+"        -k, --link-test - measure the throughput, the round trip time and\n"
+"                 the error rate of the serial line, the pattern is random,\n"
+"                 zero, ramp or stuffing (0xAD/0xAE bytes)\n"
+"                 (default: all patterns)\n"
+"\n"
+"<loader> --crc-benchmark\n"
+"        --crc-benchmark - check the packet CRC-16 against \"123456789\" and\n"
+"                          measure its throughput on this PC\n"
+"\n"
 "Options:\n"
 "        -t=<secs>, --timeout=<secs> - connection timeout in seconds\n"
 "                                      (0 - infinite, default: 0)\n"
+"        -b=<baud>, --baud=<baud> - the maximal baud rate, the loader switches\n"
+"                                   to the highest baud rate supported by\n"
+"                                   the device after the connection\n"
+"                                   (default: no limit, 115200 - no switch)\n"
 "        -m=<model>, --model=<model> - check if the device has the specified\n"
 "                                      model (default: no check)\n"
 "        -f, --force - force overwrite the memory even if it has same content\n"
@@ -32,16 +50,32 @@ const char * const HELP_TEXT =
 "        -r, --no-run - do not run the firmware after programing (default: run)\n"
 "        -a, -all - include the bootloader into the firmware image\n"
 "                   (default: no)\n"
+"        -c, --fast-verify - compare CRC of memory ranges calculated by the\n"
+"                            device, read only the mismatching rows\n"
+"                            (default: no)\n"
 "        -s, --no-smart - do not exclude unprogrammed memory areas from the\n"
 "                         firmware image (default: exclude)\n"
+"        -n=<nodes>, --nodes=<nodes> - the comma separated addresses (1...254)\n"
+"                                      of the RS-485 multi-drop bus nodes,\n"
+"                                      -l, -e and -k accept one node only,\n"
+"                                      not with -b (default: no bus)\n"
+"        --stats - show the bootloader counters of the frames, the row tests\n"
+"                  and the flash memory operations with -p, -v, -l, -e and\n"
+"                  -k (default: no)\n"
 "\n"
 "Examples:\n"
 "        <loader> COM3 - show bootloader information\n"
 "        <loader> -p -e -r COM3 firmware.hex - erase and program the device\n"
 "                 with the \"firmware.hex\" file, do not run the firmware\n"
 "        <loader> -v COM3 firmware.hex - verify the device firmware\n"
+"        <loader> -v -b=921600 COM3 firmware.hex - verify the device firmware\n"
+"                 at up to 921600 baud\n"
 "        <loader> -l -a COM3 firmware.hex - download the device firmware to the\n"
 "                 \"firmware.hex\" file with the bootloader\n"
-"        <loader> -e COM3 - erase the device memory excluding the bootloader\n";
+"        <loader> -e COM3 - erase the device memory excluding the bootloader\n"
+"        <loader> -k=stuffing -b=460800 COM3 - test the serial line at up to\n"
+"                 460800 baud with the 0xAD/0xAE bytes\n"
+"        <loader> -p -n=1,2,3 COM3 firmware.hex - program the nodes 1, 2 and 3\n"
+"                 of the bus\n";
 
 #endif // !__HELP_H_INCLUDED_
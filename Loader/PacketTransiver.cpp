@@ -2,8 +2,9 @@
 #include "PacketTransiver.h"
 
 
-PacketTransiver::PacketTransiver(const std::shared_ptr<SerialPort> &serialPort):
-    _serialPort(serialPort)
+PacketTransiver::PacketTransiver(const std::shared_ptr<SerialPort> &serialPort, unsigned nodeAddress):
+    _serialPort(serialPort),
+    _nodeAddress(nodeAddress)
 {
 }
 
@@ -23,6 +24,7 @@ bool PacketTransiver::pool()
 
         if (byte == 0xAE)
         {
+            if (_rxState != RX_STATE_HEADER) ++_corruptedFrameCount;
             _rxState = RX_STATE_LENGTH;
             _rxAD = false;
             continue;
@@ -42,6 +44,7 @@ bool PacketTransiver::pool()
                 byte = 0xAE;
                 break;
             default:
+                ++_corruptedFrameCount;
                 _rxState = RX_STATE_HEADER;
                 continue;
             }
@@ -60,7 +63,20 @@ bool PacketTransiver::pool()
             _rxState = RX_STATE_DATA;
             _rxSize = byte;
             _receivedPacket.clear();
-            if (_rxSize == 0) _rxState = RX_STATE_HEADER;
+            if (_rxSize == 0) _rxState = RX_STATE_LONG_LENGTH_LSB;
+            break;
+        case RX_STATE_LONG_LENGTH_LSB:
+            _rxState = RX_STATE_LONG_LENGTH_MSB;
+            _rxSize = byte;
+            break;
+        case RX_STATE_LONG_LENGTH_MSB:
+            _rxState = RX_STATE_DATA;
+            _rxSize |= (size_t)byte << 8;
+            if (_rxSize == 0)
+            {
+                ++_corruptedFrameCount;
+                _rxState = RX_STATE_HEADER;
+            }
             break;
         case RX_STATE_DATA:
             _receivedPacket.push_back(byte);
@@ -73,12 +89,19 @@ bool PacketTransiver::pool()
         case RX_STATE_CRC_MSB:
             _rxState = RX_STATE_HEADER;
             _receivedPacket.push_back(byte);
-            if (crc16(_receivedPacket) == 0)
+            if (crc16(_receivedPacket) != 0)
             {
-                _receivedPacket.resize(_rxSize);
-                return true;
+                ++_corruptedFrameCount;
+                break;
             }
-            break;
+            _receivedPacket.resize(_rxSize);
+            if (_nodeAddress != NODE_ADDRESS_NONE)
+            {
+                // the responses of the other nodes are skipped
+                if ((_receivedPacket.size() < 2) || (_receivedPacket.back() != _nodeAddress)) break;
+                _receivedPacket.pop_back();
+            }
+            return true;
         }
     }
 
@@ -90,13 +113,48 @@ const std::vector<uint8_t> &PacketTransiver::receivedPacket() const
     return _receivedPacket;
 }
 
+unsigned PacketTransiver::corruptedFrameCount() const
+{
+    return _corruptedFrameCount;
+}
+
 void PacketTransiver::sendPacket(const std::vector<uint8_t> &data)
+{
+    sendFrame(encodeRequest(data));
+}
+
+void PacketTransiver::sendFrame(const std::vector<uint8_t> &frame)
+{
+    _serialPort->write(frame.data(), frame.size());
+    _serialPort->flush();
+}
+
+std::vector<uint8_t> PacketTransiver::encodeRequest(const std::vector<uint8_t> &data) const
+{
+    if (_nodeAddress == NODE_ADDRESS_NONE) return encodePacket(data);
+
+    std::vector<uint8_t> request(data);
+    request.push_back((uint8_t)_nodeAddress);
+    return encodePacket(request);
+}
+
+std::vector<uint8_t> PacketTransiver::encodePacket(const std::vector<uint8_t> &data)
 {
     std::vector<uint8_t> buffer;
-    buffer.reserve(0x100);
+    buffer.reserve(data.size() * 2 + 8);
 
+    assert(!data.empty() && (data.size() <= 0xFFFF));
     buffer.push_back(0xAE);
-    pushByteAD((uint8_t)data.size(), &buffer);
+    if (data.size() > 0xFF)
+    {
+        buffer.push_back(0x00);
+        pushByteAD((uint8_t)data.size(), &buffer);
+        pushByteAD((uint8_t)(data.size() >> 8), &buffer);
+    }
+    else
+    {
+        pushByteAD((uint8_t)data.size(), &buffer);
+    }
 
     for (uint8_t byte : data)
     {
@@ -107,11 +165,44 @@ void PacketTransiver::sendPacket(const std::vector<uint8_t> &data)
     pushByteAD((uint8_t)crc, &buffer);
     pushByteAD((uint8_t)(crc >> 8), &buffer);
 
-    _serialPort->write(buffer.data(), buffer.size());
-    _serialPort->flush();
+    return buffer;
+}
+
+// the CRC of the byte values, the table is calculated once
+static const std::vector<uint16_t> &crc16Table()
+{
+    static const std::vector<uint16_t> table = []()
+    {
+        std::vector<uint16_t> result(256);
+        for (unsigned i = 0; i < 256; ++i)
+        {
+            uint16_t crc = (uint16_t)i;
+            for (unsigned b = 0; b < 8; ++b)
+            {
+                crc = ((crc & 0x0001) != 0) ? ((crc >> 1) ^ 0x8408) : (crc >> 1);
+            }
+            result[i] = crc;
+        }
+        return result;
+    }();
+
+    return table;
 }
 
 uint16_t PacketTransiver::crc16(const std::vector<uint8_t> &data)
+{
+    const std::vector<uint16_t> &table = crc16Table();
+    uint16_t crc = 0xFFFF;
+
+    for (uint8_t byte : data)
+    {
+        crc = (crc >> 8) ^ table[(crc ^ byte) & 0xFF];
+    }
+
+    return crc;
+}
+
+uint16_t PacketTransiver::crc16Bitwise(const std::vector<uint8_t> &data)
 {
     uint16_t crc = 0xFFFF;
 
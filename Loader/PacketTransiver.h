@@ -7,33 +7,55 @@ enum RXState
 {
     RX_STATE_HEADER,
     RX_STATE_LENGTH,
+    RX_STATE_LONG_LENGTH_LSB,
+    RX_STATE_LONG_LENGTH_MSB,
     RX_STATE_DATA,
     RX_STATE_CRC_LSB,
     RX_STATE_CRC_MSB
 };
 
+const unsigned
+    NODE_ADDRESS_NONE = 0x00, // the point-to-point line
+    NODE_ADDRESS_BROADCAST = 0xFF; // all nodes of the multi-drop bus
+
 class PacketTransiver
 {
 public:
 
-	PacketTransiver(const std::shared_ptr<SerialPort> &serialPort);
+    // the packets on the multi-drop bus have the node address as the last byte
+	PacketTransiver(const std::shared_ptr<SerialPort> &serialPort, unsigned nodeAddress = NODE_ADDRESS_NONE);
 	~PacketTransiver();
 
     bool pool();
     const std::vector<uint8_t> &receivedPacket() const;
+    // the received frames dropped due to a wrong CRC, a wrong byte stuffing or a missing end
+    unsigned corruptedFrameCount() const;
 
     void sendPacket(const std::vector<uint8_t> &data);
+    void sendFrame(const std::vector<uint8_t> &frame);
+    // encodePacket with the node address
+    std::vector<uint8_t> encodeRequest(const std::vector<uint8_t> &data) const;
+
+    // packet data to the frame with the start byte, the length, the byte stuffing and the CRC,
+    // the packets longer than 255 bytes have the zero length byte and the 16-bit length (protocol version 2)
+    static std::vector<uint8_t> encodePacket(const std::vector<uint8_t> &data);
+
+    // CRC-16/MCRF4XX, byte-at-a-time table
+    static uint16_t crc16(const std::vector<uint8_t> &data);
+    // CRC-16/MCRF4XX, bit-at-a-time reference for the table
+    static uint16_t crc16Bitwise(const std::vector<uint8_t> &data);
 
 private:
 
     std::shared_ptr<SerialPort> _serialPort;
+    unsigned _nodeAddress;
 
     std::vector<uint8_t> _receivedPacket;
     RXState _rxState = RX_STATE_HEADER;
     bool _rxAD = false;
     size_t _rxSize = 0;
+    unsigned _corruptedFrameCount = 0;
 
-    static uint16_t crc16(const std::vector<uint8_t> &data);
     static void pushByteAD(uint8_t data, std::vector<uint8_t> *buffer);
 
 };
@@ -77,6 +77,49 @@ void SerialPort::close()
     _handle = INVALID_HANDLE_VALUE;
 }
 
+bool SerialPort::setBaudRate(unsigned baudRate)
+{
+    assert(_handle != INVALID_HANDLE_VALUE);
+
+    DCB dcb;
+    if (!GetCommState(_handle, &dcb))
+    {
+        errorExit("Serial port setup error (%s)", _portName.c_str());
+    }
+    dcb.DCBlength = sizeof dcb;
+    dcb.BaudRate = baudRate;
+
+    return SetCommState(_handle, &dcb) != 0;
+}
+
+void SerialPort::setFlowControl(bool enabled)
+{
+    assert(_handle != INVALID_HANDLE_VALUE);
+
+    DCB dcb;
+    if (!GetCommState(_handle, &dcb))
+    {
+        errorExit("Serial port setup error (%s)", _portName.c_str());
+    }
+    dcb.DCBlength = sizeof dcb;
+    dcb.fOutxCtsFlow = enabled ? 1 : 0;
+    if (!SetCommState(_handle, &dcb))
+    {
+        errorExit("Serial port setup error (%s)", _portName.c_str());
+    }
+
+    COMMTIMEOUTS ct;
+    if (!GetCommTimeouts(_handle, &ct))
+    {
+        errorExit("Serial port setup error (%s)", _portName.c_str());
+    }
+    ct.WriteTotalTimeoutConstant = enabled ? 5000 : 500;
+    if (!SetCommTimeouts(_handle, &ct))
+    {
+        errorExit("Serial port setup error (%s)", _portName.c_str());
+    }
+}
+
 bool SerialPort::read(uint8_t *data)
 {
     assert(_handle != INVALID_HANDLE_VALUE);
@@ -11,6 +11,11 @@ public:
     void open(const std::string &portName);
     void close();
 
+    // returns false if the baud rate is not supported
+    bool setBaudRate(unsigned baudRate);
+    // CTS flow control for the output, the device can stop the write operations for a long time
+    void setFlowControl(bool enabled);
+
     // return false if timeout
     bool read(uint8_t *data);
     void purge();
@@ -6,9 +6,13 @@
 
 #include <string>
 #include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
 #include <algorithm>
 
 #include <stdint.h>
+#include <stddef.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <assert.h>
@@ -7,6 +7,45 @@
 #include "ErrorExit.h"
 #include "Help.h"
 
+const uint32_t IMAGE_MANIFEST_OFFSET = 4; // the reserved words after the reset jump in the jump table row
+const uint64_t IMAGE_MANIFEST_NONE = 0xFFFFFFFFFFFF; // the erased words
+
+// the trap and interrupt vectors after the reset jump, the alternate table has the same layout
+const uint32_t
+    IVT_ADDRESS = 0x000004,
+    AIVT_ADDRESS = 0x000084,
+    IVT_SIZE = 0x7C;
+
+// reads the rows selected by isRowNeeded, consecutive rows are read by one range request
+static void readDeviceRows(
+    const std::shared_ptr<DeviceConnection> &connection,
+    const MemoryRange &range,
+    const std::function<bool(uint32_t address)> &isRowNeeded,
+    const DeviceConnection::RowHandler &handler)
+{
+    uint32_t rangeAddress = range.address;
+    uint32_t rowCount = 0;
+    for (uint32_t address = range.address; address < range.address + range.size; address += ROW_SIZE_PROGRAM)
+    {
+        if (isRowNeeded(address))
+        {
+            if (rowCount == 0) rangeAddress = address;
+            ++rowCount;
+        }
+        else if (rowCount != 0)
+        {
+            connection->readRowsAsync(rangeAddress, rowCount, handler);
+            rowCount = 0;
+        }
+        if (address % 1024 == 0) printf(".");
+    }
+    if (rowCount != 0)
+    {
+        connection->readRowsAsync(rangeAddress, rowCount, handler);
+    }
+    connection->waitPendingRequests();
+}
+
 static void loadDeviceMemoryRange(
     const std::shared_ptr<DeviceConnection> &connection,
     const MemoryRange &range,
@@ -14,19 +53,32 @@ static void loadDeviceMemoryRange(
 )
 {
     memory->clear();
-    memory->reserve(range.size / 2);
-    for (uint32_t address = range.address; address < range.address + range.size; )
-    {
-        std::vector<uint32_t> row = connection->readRow(address);
-
-        for (unsigned i = 0; i < ROW_SIZE_PROGRAM / 2; ++i)
+    memory->reserve(range.size / 2 + ROW_SIZE_PROGRAM / 2);
+    readDeviceRows(connection, range,
+        [](uint32_t) { return true; },
+        [memory](uint32_t, const std::vector<uint32_t> &row)
         {
-            memory->push_back(row[i]);
-            address += 2;
-            if (address == range.address + range.size) break;
-        }
-        if (address % 1024 == 0) printf(".");
+            memory->insert(memory->end(), row.begin(), row.end());
+        });
+
+    memory->resize(range.size / 2);
+}
+
+// the bootloaders with the capability block send the config words in the 'Start communication' response
+static std::vector<uint32_t> readConfigMemory(
+    const std::shared_ptr<DeviceConnection> &connection,
+    const MemoryRange &configMemoryRange)
+{
+    std::vector<uint32_t> configMemory = connection->capabilities().configWords;
+    if (configMemory.size() < configMemoryRange.size / 2)
+    {
+        printf("Reading config memory");
+        loadDeviceMemoryRange(connection, configMemoryRange, &configMemory);
+        printf("\n");
     }
+    configMemory.resize(configMemoryRange.size / 2);
+
+    return configMemory;
 }
 
 static void checkFirmwareImage(
@@ -53,10 +105,7 @@ static void checkFirmwareImage(
     }
 
     const MemoryRange &configMemoryRange = memoryLayout.memoryRange(MEMORY_TYPE_CONFIG);
-    std::vector<uint32_t> configMemory;
-    printf("Reading config memory");
-    loadDeviceMemoryRange(connection, configMemoryRange, &configMemory);
-    printf("\n");
+    std::vector<uint32_t> configMemory = readConfigMemory(connection, configMemoryRange);
 
     for (unsigned i = 0; i < configMemoryRange.size / 2; ++i)
     {
@@ -71,12 +120,70 @@ static void checkFirmwareImage(
                 (unsigned)address, (unsigned)deviceWord, (unsigned)firmwareWord);
         }
     }
+
+    // the alternate vectors are replaced by the primary ones, so the alternate handlers cannot be used
+    if ((connection->capabilities().capabilityMask & CAPABILITY_MASK_DIRECT_VECTORS) != 0)
+    {
+        for (uint32_t address = IVT_ADDRESS; address < IVT_ADDRESS + IVT_SIZE; address += 2)
+        {
+            uint32_t alternateVector = firmwareImage.getData(address - IVT_ADDRESS + AIVT_ADDRESS);
+            if ((alternateVector != UNDEFINED_WORD) && (alternateVector != firmwareImage.getData(address)))
+            {
+                errorExit("The target firmware uses the alternate interrupt vector at address 0x%06X, the bootloader starts it with the alternate vector table",
+                    (unsigned)(address - IVT_ADDRESS + AIVT_ADDRESS));
+            }
+        }
+    }
+
+    // the bootloader handler replaces the alternate vector of the UART receive interrupt, so the target firmware
+    // shall have the default handler there, it is the most frequent alternate vector (the unused interrupts)
+    const DeviceCapabilities &capabilities = connection->capabilities();
+    if ((capabilities.capabilityMask & CAPABILITY_MASK_RX_INTERRUPT) != 0)
+    {
+        std::vector<uint32_t> alternateVectors;
+        for (uint32_t address = AIVT_ADDRESS; address < AIVT_ADDRESS + IVT_SIZE; address += 2)
+        {
+            uint32_t alternateVector = firmwareImage.getData(address);
+            if (alternateVector != UNDEFINED_WORD) alternateVectors.push_back(alternateVector);
+        }
+        uint32_t defaultVector = UNDEFINED_WORD;
+        ptrdiff_t defaultCount = 0;
+        for (uint32_t alternateVector : alternateVectors)
+        {
+            ptrdiff_t count = std::count(alternateVectors.begin(), alternateVectors.end(), alternateVector);
+            if (count > defaultCount)
+            {
+                defaultVector = alternateVector;
+                defaultCount = count;
+            }
+        }
+
+        uint32_t rxVector = firmwareImage.getData(capabilities.rxVectorAddress);
+        if ((rxVector != UNDEFINED_WORD) && (rxVector != defaultVector) && (rxVector != capabilities.rxHandlerAddress))
+        {
+            errorExit("The target firmware uses the alternate interrupt vector at address 0x%06X, the bootloader uses it for the UART receive interrupt",
+                (unsigned)capabilities.rxVectorAddress);
+        }
+    }
 }
 
-static void patchFirmwareImage(const BootloaderParams &bootloaderParams, FirmwareImage *firmwareImage)
+static void patchFirmwareImage(
+    const BootloaderParams &bootloaderParams,
+    const DeviceCapabilities &capabilities,
+    FirmwareImage *firmwareImage)
 {
     uint32_t address = bootloaderParams.address;
 
+    // the target firmware is started with the alternate vector table, the interrupts do not pass the jump table
+    if ((capabilities.capabilityMask & CAPABILITY_MASK_DIRECT_VECTORS) != 0)
+    {
+        for (uint32_t i = IVT_ADDRESS; i < IVT_ADDRESS + IVT_SIZE; i += 2)
+        {
+            uint32_t data = firmwareImage->getData(i);
+            if (data != UNDEFINED_WORD) firmwareImage->setData(i - IVT_ADDRESS + AIVT_ADDRESS, data);
+        }
+    }
+
     // copy first GOTO instruction
     firmwareImage->setData(address, firmwareImage->getData(0));
     firmwareImage->setData(0, UNDEFINED_WORD);
@@ -95,9 +202,19 @@ static void patchFirmwareImage(const BootloaderParams &bootloaderParams, Firmwar
         firmwareImage->setData(address, (data >> 16) & 0x00007F);
         address += 2;
     }
+
+    // the bootloader uses the vector of the UART receive interrupt in the table not used by the target firmware,
+    // checkFirmwareImage rejects the target firmware with its own handler there
+    if ((capabilities.capabilityMask & CAPABILITY_MASK_RX_INTERRUPT) != 0)
+    {
+        firmwareImage->setData(capabilities.rxVectorAddress, capabilities.rxHandlerAddress);
+    }
 }
 
-static void unpatchFirmwareImage(const BootloaderParams &bootloaderParams, FirmwareImage *firmwareImage)
+static void unpatchFirmwareImage(
+    const BootloaderParams &bootloaderParams,
+    const DeviceCapabilities &capabilities,
+    FirmwareImage *firmwareImage)
 {
     uint32_t address = bootloaderParams.address;
 
@@ -109,6 +226,15 @@ static void unpatchFirmwareImage(const BootloaderParams &bootloaderParams, Firmw
     firmwareImage->setData(address, UNDEFINED_WORD);
     address += 2 + 4;
 
+    // the image manifest and the bootloader vector are not a part of the target firmware
+    if (((capabilities.capabilityMask & CAPABILITY_MASK_RX_INTERRUPT) != 0)
+        && (firmwareImage->getData(capabilities.rxVectorAddress) == capabilities.rxHandlerAddress))
+    {
+        firmwareImage->setData(capabilities.rxVectorAddress, UNDEFINED_WORD);
+    }
+    firmwareImage->setData(bootloaderParams.address + IMAGE_MANIFEST_OFFSET, UNDEFINED_WORD);
+    firmwareImage->setData(bootloaderParams.address + IMAGE_MANIFEST_OFFSET + 2, UNDEFINED_WORD);
+
     // parse a jump table
     for (uint32_t i = 4; i < ROW_SIZE_PROGRAM; i += 2)
     {
@@ -123,6 +249,52 @@ static void unpatchFirmwareImage(const BootloaderParams &bootloaderParams, Firmw
     }
 }
 
+// the 48-bit FNV-1a hash of the defined program memory and data EEPROM words of the patched firmware image,
+// the erase option is a part of the image, because it erases the memory areas not specified in the image
+static uint64_t calculateImageManifest(const MemoryLayout &memoryLayout, const FirmwareImage &firmwareImage, bool erase)
+{
+    uint64_t hash = 0xCBF29CE484222325;
+    auto appendWord =
+        [&hash](uint32_t word)
+        {
+            for (unsigned i = 0; i < 4; ++i)
+            {
+                hash ^= (uint8_t)(word >> (i * 8));
+                hash *= 0x100000001B3;
+            }
+        };
+
+    appendWord(erase ? 1 : 0);
+    for (unsigned memoryType : { MEMORY_TYPE_PROGRAM, MEMORY_TYPE_DATA })
+    {
+        const MemoryRange &range = memoryLayout.memoryRange(memoryType);
+        for (uint32_t address = range.address; address < range.address + range.size; address += 2)
+        {
+            uint32_t word = firmwareImage.getData(address);
+            if (word == UNDEFINED_WORD) continue;
+            appendWord(address);
+            appendWord(word);
+        }
+    }
+
+    hash = (hash ^ (hash >> 48)) & 0xFFFFFFFFFFFF;
+    return hash != IMAGE_MANIFEST_NONE ? hash : 0;
+}
+
+// the manifest is two instruction words in the jump table row, so it is read by one request
+static uint64_t readImageManifest(const std::shared_ptr<DeviceConnection> &connection, std::vector<uint32_t> *jumpTableRow)
+{
+    *jumpTableRow = connection->readRow(connection->bootloaderParams().address);
+    return ((*jumpTableRow)[IMAGE_MANIFEST_OFFSET / 2] & WORD_MASK_PROGRAM)
+        | ((uint64_t)((*jumpTableRow)[IMAGE_MANIFEST_OFFSET / 2 + 1] & WORD_MASK_PROGRAM) << 24);
+}
+
+static void setImageManifest(const BootloaderParams &bootloaderParams, uint64_t manifest, FirmwareImage *firmwareImage)
+{
+    firmwareImage->setData(bootloaderParams.address + IMAGE_MANIFEST_OFFSET, (uint32_t)manifest & WORD_MASK_PROGRAM);
+    firmwareImage->setData(bootloaderParams.address + IMAGE_MANIFEST_OFFSET + 2, (uint32_t)(manifest >> 24) & WORD_MASK_PROGRAM);
+}
+
 static std::vector<uint32_t> getRow(const FirmwareImage &firmwareImage, uint32_t address, uint32_t size)
 {
     std::vector<uint32_t> row;
@@ -147,6 +319,16 @@ static bool isRowUndefined(const std::vector<uint32_t> &row)
     return true;
 }
 
+static bool isRowComplete(const std::vector<uint32_t> &row)
+{
+    for (size_t i = 0; i < row.size(); ++i)
+    {
+        if (row[i] == UNDEFINED_WORD) return false;
+    }
+
+    return true;
+}
+
 static bool isRowErased(const std::vector<uint32_t> &row, uint32_t mask)
 {
     for (size_t i = 0; i < row.size(); ++i)
@@ -172,24 +354,373 @@ static bool isRowEquals(const std::vector<uint32_t> &source, const std::vector<u
     return true;
 }
 
+// compares the rows defined in the firmware image with the device memory (ROW_SIZE_PROGRAM rows for all memory types)
+static void verifyDeviceRows(
+    const std::shared_ptr<DeviceConnection> &connection,
+    const FirmwareImage &firmwareImage,
+    const MemoryRange &range,
+    uint32_t mask)
+{
+    readDeviceRows(connection, range,
+        [&firmwareImage](uint32_t address)
+        {
+            return !isRowUndefined(getRow(firmwareImage, address, ROW_SIZE_PROGRAM));
+        },
+        [&firmwareImage, mask](uint32_t address, const std::vector<uint32_t> &targetRow)
+        {
+            if (!isRowEquals(getRow(firmwareImage, address, ROW_SIZE_PROGRAM), targetRow, mask))
+            {
+                errorExit("The row at address 0x%06X has different values", address);
+            }
+        });
+}
+
+// compares CRC of the rows selected by isRowNeeded with the device one,
+// the mismatching ranges are divided until the rows are found, the rows are compared as verifyDeviceRows does
+static void fastVerifyDeviceRows(
+    const std::shared_ptr<DeviceConnection> &connection,
+    const FirmwareImage &firmwareImage,
+    const MemoryRange &range,
+    uint32_t mask,
+    const std::function<bool(uint32_t address)> &isRowNeeded)
+{
+    // the device calculation time shall be shorter than the response timeout
+    const uint32_t MAX_CRC_ROW_COUNT = 64;
+
+    struct RowRange
+    {
+        uint32_t address;
+        uint32_t rowCount;
+    };
+
+    // the ranges of consecutive needed rows
+    std::vector<RowRange> rowRanges;
+    for (uint32_t address = range.address; address < range.address + range.size; address += ROW_SIZE_PROGRAM)
+    {
+        if (!isRowNeeded(address)) continue;
+        if (!rowRanges.empty()
+            && (rowRanges.back().address + rowRanges.back().rowCount * ROW_SIZE_PROGRAM == address)
+            && (rowRanges.back().rowCount < MAX_CRC_ROW_COUNT))
+        {
+            ++rowRanges.back().rowCount;
+        }
+        else
+        {
+            rowRanges.push_back({ address, 1 });
+        }
+    }
+
+    while (!rowRanges.empty())
+    {
+        std::vector<RowRange> mismatchedRanges;
+        for (const RowRange &rowRange : rowRanges)
+        {
+            uint32_t crc = DeviceConnection::calculateCrc(
+                getRow(firmwareImage, rowRange.address, rowRange.rowCount * ROW_SIZE_PROGRAM), mask);
+            connection->calculateRangeCrcAsync(rowRange.address, rowRange.rowCount, mask,
+                [crc, rowRange, &mismatchedRanges](uint32_t deviceCrc)
+                {
+                    if (deviceCrc == crc) return;
+
+                    if (rowRange.rowCount == 1)
+                    {
+                        // the undefined words of the row can have any values
+                        mismatchedRanges.push_back(rowRange);
+                        return;
+                    }
+
+                    uint32_t rowCount = rowRange.rowCount / 2;
+                    mismatchedRanges.push_back({ rowRange.address, rowCount });
+                    mismatchedRanges.push_back({ rowRange.address + rowCount * ROW_SIZE_PROGRAM, rowRange.rowCount - rowCount });
+                });
+            printf(".");
+        }
+        connection->waitPendingRequests();
+
+        rowRanges.clear();
+        for (const RowRange &rowRange : mismatchedRanges)
+        {
+            if (rowRange.rowCount != 1)
+            {
+                rowRanges.push_back(rowRange);
+                continue;
+            }
+
+            readDeviceRows(connection, { rowRange.address, ROW_SIZE_PROGRAM },
+                [](uint32_t) { return true; },
+                [&firmwareImage, mask](uint32_t address, const std::vector<uint32_t> &targetRow)
+                {
+                    if (!isRowEquals(getRow(firmwareImage, address, ROW_SIZE_PROGRAM), targetRow, mask))
+                    {
+                        errorExit("The row at address 0x%06X has different values", address);
+                    }
+                });
+        }
+    }
+}
+
+// fast verification of the rows defined in the firmware image
+static void fastVerifyDeviceRows(
+    const std::shared_ptr<DeviceConnection> &connection,
+    const FirmwareImage &firmwareImage,
+    const MemoryRange &range,
+    uint32_t mask)
+{
+    fastVerifyDeviceRows(connection, firmwareImage, range, mask,
+        [&firmwareImage](uint32_t address)
+        {
+            return !isRowUndefined(getRow(firmwareImage, address, ROW_SIZE_PROGRAM));
+        });
+}
+
+// returns the rows selected by isRowNeeded which have the same digests in the device and in the firmware image
+static std::vector<bool> readUnchangedRows(
+    const std::shared_ptr<DeviceConnection> &connection,
+    const FirmwareImage &firmwareImage,
+    const MemoryRange &range,
+    uint32_t rowSize,
+    const std::function<bool(uint32_t address)> &isRowNeeded)
+{
+    std::vector<bool> unchangedRows(range.size / rowSize);
+    bool programMemory = (rowSize == ROW_SIZE_PROGRAM);
+
+    auto handler =
+        [&firmwareImage, &range, rowSize, programMemory, &unchangedRows](uint32_t address, const std::vector<uint16_t> &digests)
+        {
+            for (size_t i = 0; i < digests.size(); ++i)
+            {
+                uint32_t rowAddress = address + i * rowSize;
+                if (digests[i] == DeviceConnection::calculateRowDigest(getRow(firmwareImage, rowAddress, rowSize), programMemory))
+                {
+                    unchangedRows[(rowAddress - range.address) / rowSize] = true;
+                }
+            }
+        };
+
+    uint32_t rangeAddress = range.address;
+    uint32_t rowCount = 0;
+    for (uint32_t address = range.address; address < range.address + range.size; address += rowSize)
+    {
+        if (isRowNeeded(address))
+        {
+            if (rowCount == 0) rangeAddress = address;
+            ++rowCount;
+            if (rowCount < DeviceConnection::MAX_ROW_DIGEST_COUNT) continue;
+        }
+        if (rowCount != 0)
+        {
+            connection->readRowDigestsAsync(rangeAddress, rowCount, programMemory, handler);
+            rowCount = 0;
+        }
+    }
+    if (rowCount != 0)
+    {
+        connection->readRowDigestsAsync(rangeAddress, rowCount, programMemory, handler);
+    }
+    connection->waitPendingRequests();
+
+    return unchangedRows;
+}
+
+// the rows which hold data in the device, all rows are treated as not blank without CAPABILITY_MASK_BLANK_CHECK
+static std::vector<bool> readNonBlankRows(
+    const std::shared_ptr<DeviceConnection> &connection,
+    const MemoryRange &range,
+    uint32_t rowSize)
+{
+    uint32_t totalRowCount = range.size / rowSize;
+    if ((connection->capabilities().capabilityMask & CAPABILITY_MASK_BLANK_CHECK) == 0)
+    {
+        return std::vector<bool>(totalRowCount, true);
+    }
+
+    std::vector<bool> nonBlankRows(totalRowCount);
+    bool programMemory = (rowSize == ROW_SIZE_PROGRAM);
+    for (uint32_t rowIndex = 0; rowIndex < totalRowCount; rowIndex += DeviceConnection::MAX_BLANK_CHECK_ROW_COUNT)
+    {
+        uint32_t rowCount = totalRowCount - rowIndex;
+        if (rowCount > DeviceConnection::MAX_BLANK_CHECK_ROW_COUNT) rowCount = DeviceConnection::MAX_BLANK_CHECK_ROW_COUNT;
+        connection->blankCheckAsync(range.address + rowIndex * rowSize, rowCount, programMemory,
+            [&range, rowSize, &nonBlankRows](uint32_t address, const std::vector<bool> &rows)
+            {
+                std::copy(rows.begin(), rows.end(), nonBlankRows.begin() + (address - range.address) / rowSize);
+            });
+    }
+    connection->waitPendingRequests();
+
+    return nonBlankRows;
+}
+
+// erases the rows, the consecutive rows are erased by one request (CAPABILITY_MASK_ERASE_RANGE),
+// the whole data EEPROM is erased by one operation
+static void eraseDeviceRows(
+    const std::shared_ptr<DeviceConnection> &connection,
+    const MemoryRange &range,
+    uint32_t rowSize,
+    bool force,
+    const std::function<bool(uint32_t address)> &isRowNeeded)
+{
+    bool programMemory = (rowSize == ROW_SIZE_PROGRAM);
+
+    if ((connection->capabilities().capabilityMask & CAPABILITY_MASK_ERASE_RANGE) == 0)
+    {
+        for (uint32_t address = range.address; address < range.address + range.size; address += rowSize)
+        {
+            if (isRowNeeded(address))
+            {
+                if (programMemory) connection->writeProgramMemory(address, std::vector<uint32_t>(), false, force);
+                else connection->writeDataEEPROM(address, std::vector<uint32_t>(), false, force);
+            }
+            if (address % 1024 == 0) printf(".");
+        }
+        return;
+    }
+
+    if (!programMemory)
+    {
+        bool wholeRange = true;
+        for (uint32_t address = range.address; address < range.address + range.size; address += rowSize)
+        {
+            if (!isRowNeeded(address)) wholeRange = false;
+        }
+        if (wholeRange)
+        {
+            connection->eraseRange(range.address, range.size / rowSize, false, force, true);
+            for (uint32_t address = range.address; address < range.address + range.size; address += 1024) printf(".");
+            return;
+        }
+    }
+
+    uint32_t rangeAddress = range.address;
+    uint32_t rowCount = 0;
+    for (uint32_t address = range.address; address < range.address + range.size; address += rowSize)
+    {
+        if (isRowNeeded(address))
+        {
+            if (rowCount == 0) rangeAddress = address;
+            ++rowCount;
+            if (rowCount == DeviceConnection::MAX_ERASE_RANGE_ROW_COUNT)
+            {
+                connection->eraseRange(rangeAddress, rowCount, programMemory, force);
+                rowCount = 0;
+            }
+        }
+        else if (rowCount != 0)
+        {
+            connection->eraseRange(rangeAddress, rowCount, programMemory, force);
+            rowCount = 0;
+        }
+        if (address % 1024 == 0) printf(".");
+    }
+    if (rowCount != 0)
+    {
+        connection->eraseRange(rangeAddress, rowCount, programMemory, force);
+    }
+}
+
+// writes the data EEPROM rows selected by isRowNeeded by the single word operations (CAPABILITY_MASK_WRITE_EEPROM_WORDS)
+// if they need not more operations than the row erase and program, the words of many rows are sent by one request,
+// returns the written rows
+static std::vector<bool> writeDataEEPROMWords(
+    const std::shared_ptr<DeviceConnection> &connection,
+    const FirmwareImage &firmwareImage,
+    const MemoryRange &range,
+    const std::function<bool(uint32_t address)> &isRowNeeded)
+{
+    std::vector<bool> writtenRows(range.size / ROW_SIZE_DATA);
+    if ((connection->capabilities().capabilityMask & CAPABILITY_MASK_WRITE_EEPROM_WORDS) == 0)
+    {
+        return writtenRows;
+    }
+
+    // the word and the row erase or program time (TDEW), us
+    const double OPERATION_TIME = 2000;
+    // the transfer time of a data byte, us
+    double byteTime = 10e6 / connection->baudRate();
+
+    std::vector<std::pair<uint32_t, uint32_t>> words;
+    // ROW_SIZE_PROGRAM rows for all memory types
+    readDeviceRows(connection, range,
+        [&isRowNeeded](uint32_t address)
+        {
+            return isRowNeeded(address) || isRowNeeded(address + ROW_SIZE_DATA);
+        },
+        [&firmwareImage, &range, &isRowNeeded, &writtenRows, &words, OPERATION_TIME, byteTime](uint32_t address, const std::vector<uint32_t> &deviceRow)
+        {
+            for (uint32_t rowOffset = 0; rowOffset < ROW_SIZE_PROGRAM; rowOffset += ROW_SIZE_DATA)
+            {
+                uint32_t rowAddress = address + rowOffset;
+                if (!isRowNeeded(rowAddress)) continue;
+
+                // a word is erased only if the new value sets bits, the erased value is not programmed
+                std::vector<uint32_t> firmwareRow = getRow(firmwareImage, rowAddress, ROW_SIZE_DATA);
+                std::vector<std::pair<uint32_t, uint32_t>> rowWords;
+                unsigned wordOperationCount = 0;
+                bool rowErase = false;
+                for (uint32_t i = 0; i < firmwareRow.size(); ++i)
+                {
+                    uint32_t current = deviceRow[rowOffset / 2 + i] & WORD_MASK_DATA;
+                    uint32_t data = firmwareRow[i] & WORD_MASK_DATA;
+                    if (current == data) continue;
+                    if ((current & data) != data)
+                    {
+                        ++wordOperationCount;
+                        rowErase = true;
+                    }
+                    if (data != WORD_MASK_DATA) ++wordOperationCount;
+                    rowWords.emplace_back(rowAddress + i * 2, data);
+                }
+
+                // the erase and program operations are compared with the transfer time, a word is sent with its offset
+                unsigned rowOperationCount = (rowErase ? 1 : 0) + (isRowErased(firmwareRow, WORD_MASK_DATA) ? 0 : 1);
+                double wordTime = wordOperationCount * OPERATION_TIME + rowWords.size() * 4 * byteTime;
+                double rowTime = rowOperationCount * OPERATION_TIME + ROW_SIZE_DATA * byteTime;
+                if (wordTime <= rowTime)
+                {
+                    words.insert(words.end(), rowWords.begin(), rowWords.end());
+                    writtenRows[(rowAddress - range.address) / ROW_SIZE_DATA] = true;
+                }
+            }
+        });
+
+    for (size_t i = 0; i < words.size(); i += DeviceConnection::MAX_EEPROM_WORD_COUNT)
+    {
+        size_t count = words.size() - i;
+        if (count > DeviceConnection::MAX_EEPROM_WORD_COUNT) count = DeviceConnection::MAX_EEPROM_WORD_COUNT;
+        connection->writeDataEEPROMWords(std::vector<std::pair<uint32_t, uint32_t>>(words.begin() + i, words.begin() + i + count));
+    }
+
+    return writtenRows;
+}
+
 static void errorExitIncompatibleOptions()
 {
     errorExit("Incompatible options (use -h to show all available options)");
 }
 
-std::shared_ptr<DeviceConnection> connectToDevice(const CommandLineParams &params, const DeviceInfo **deviceInfo)
+static std::shared_ptr<DeviceConnection> connectToNode(
+    const CommandLineParams &params,
+    const std::shared_ptr<SerialPort> &serialPort,
+    unsigned nodeAddress,
+    const DeviceInfo **deviceInfo)
 {
-    std::shared_ptr<SerialPort> serialPort = std::make_shared<SerialPort>();
-    serialPort->open(params.args[0]);
-
-    printf("Connecting to device...\n");
-    std::shared_ptr<DeviceConnection> connection = std::make_shared<DeviceConnection>(serialPort);
+    if (nodeAddress != NODE_ADDRESS_NONE) printf("Connecting to node %u...\n", nodeAddress);
+    else printf("Connecting to device...\n");
+    std::shared_ptr<DeviceConnection> connection = std::make_shared<DeviceConnection>(serialPort, nodeAddress);
     connection->startCommunication(params.timeout);
 
     const BootloaderParams &bootloaderParams = connection->bootloaderParams();
-    printf("Bootloader: address = 0x%06X, size = 0x%X\n", bootloaderParams.address, bootloaderParams.size);
+    printf("Bootloader: address = 0x%06X, size = 0x%X, protocol version = %u\n",
+        bootloaderParams.address, bootloaderParams.size, connection->protocolVersion());
+
+    connection->switchBaudRate(params.baudRate);
+    if (connection->baudRate() != BAUD_RATE_DEFAULT)
+    {
+        printf("Baud rate: %u\n", connection->baudRate());
+    }
 
-    uint32_t deviceId = connection->readRow(0xFF0000)[0];
+    const DeviceCapabilities &capabilities = connection->capabilities();
+    uint32_t deviceId = capabilities.valid ? capabilities.deviceId : connection->readRow(0xFF0000)[0];
 
     const DeviceInfo *info = getDeviceInfo(deviceId);
     if (info == nullptr)
@@ -212,9 +743,82 @@ std::shared_ptr<DeviceConnection> connectToDevice(const CommandLineParams &param
 
     *deviceInfo = info;
 
+    // the device statistic covers the operation only
+    if (((params.optionMask & OPTION_MASK_STATS) != 0)
+        && ((capabilities.capabilityMask & CAPABILITY_MASK_DIAGNOSTICS) != 0))
+    {
+        connection->readDiagnostics(true);
+    }
+
     return connection;
 }
 
+// the nodes of the multi-drop bus (-n option) shall have the same device and bootloader,
+// the broadcast connection is created for several nodes if broadcast is not nullptr
+static std::vector<std::shared_ptr<DeviceConnection>> connectToDevices(
+    const CommandLineParams &params,
+    const DeviceInfo **deviceInfo,
+    std::shared_ptr<DeviceConnection> *broadcast = nullptr)
+{
+    // the nodes answer at the default baud rate only
+    if (!params.nodeAddresses.empty() && ((params.optionMask & OPTION_MASK_BAUD_RATE) != 0))
+    {
+        errorExitIncompatibleOptions();
+    }
+
+    std::shared_ptr<SerialPort> serialPort = std::make_shared<SerialPort>();
+    serialPort->open(params.args[0]);
+
+    std::vector<unsigned> nodeAddresses = params.nodeAddresses;
+    if (nodeAddresses.empty()) nodeAddresses.push_back(NODE_ADDRESS_NONE);
+
+    std::vector<std::shared_ptr<DeviceConnection>> connections;
+    for (unsigned nodeAddress : nodeAddresses)
+    {
+        const DeviceInfo *info;
+        std::shared_ptr<DeviceConnection> connection = connectToNode(params, serialPort, nodeAddress, &info);
+        if (!connections.empty())
+        {
+            const BootloaderParams &firstParams = connections[0]->bootloaderParams();
+            if ((info != *deviceInfo)
+                || (connection->bootloaderParams().address != firstParams.address)
+                || (connection->bootloaderParams().size != firstParams.size)
+                || (connection->capabilities().rxHandlerAddress != connections[0]->capabilities().rxHandlerAddress))
+            {
+                errorExit("The node %u has other device or bootloader than the node %u",
+                    nodeAddress, connections[0]->nodeAddress());
+            }
+        }
+        *deviceInfo = info;
+        connections.push_back(connection);
+    }
+
+    if ((broadcast != nullptr) && (connections.size() > 1))
+    {
+        *broadcast = std::make_shared<DeviceConnection>(serialPort, NODE_ADDRESS_BROADCAST);
+    }
+
+    return connections;
+}
+
+static std::shared_ptr<DeviceConnection> connectToDevice(const CommandLineParams &params, const DeviceInfo **deviceInfo)
+{
+    if (params.nodeAddresses.size() > 1)
+    {
+        errorExit("The command supports one node only");
+    }
+
+    return connectToDevices(params, deviceInfo)[0];
+}
+
+static void printNodeHeader(const std::shared_ptr<DeviceConnection> &connection)
+{
+    if (connection->nodeAddress() != NODE_ADDRESS_NONE)
+    {
+        printf("--- Node %u ---\n", connection->nodeAddress());
+    }
+}
+
 static void printOperationTime(const std::shared_ptr<DeviceConnection> &connection)
 {
     unsigned time = connection->connectionTime();
@@ -224,105 +828,543 @@ static void printOperationTime(const std::shared_ptr<DeviceConnection> &connecti
 static void printOperationStatistic(const std::shared_ptr<DeviceConnection> &connection)
 {
     const DeviceConnectionStatistic &statistic = connection->connectionStatistic();
-    printf("Program memory: erase = %u, program = %u\n", statistic.programMemoryEraseCount, statistic.programMemoryProgramCount);
-    printf("Data EEPROM: erase = %u, program = %u\n", statistic.dataEEPROMEraseCount, statistic.dataEEPROMProgramCount);
+    printf("Program memory: erase = %u, program = %u, erase avoided = %u\n",
+        statistic.programMemoryEraseCount, statistic.programMemoryProgramCount, statistic.programMemoryEraseAvoidedCount);
+    printf("Data EEPROM: erase = %u, program = %u, erase avoided = %u\n",
+        statistic.dataEEPROMEraseCount, statistic.dataEEPROMProgramCount, statistic.dataEEPROMEraseAvoidedCount);
+    printf("Data EEPROM words: erase = %u, program = %u\n",
+        statistic.dataEEPROMWordEraseCount, statistic.dataEEPROMWordProgramCount);
+    if (connection->nodeAddress() != NODE_ADDRESS_NONE)
+    {
+        printf("Lost broadcast requests: %u\n", statistic.lostBroadcastCount);
+    }
+}
+
+// the bootloader counters with the PC side statistic (--stats option), the device shall not run the firmware
+static void printDeviceStatistic(const CommandLineParams &params, const std::shared_ptr<DeviceConnection> &connection)
+{
+    if ((params.optionMask & OPTION_MASK_STATS) == 0) return;
+
+    if ((connection->capabilities().capabilityMask & CAPABILITY_MASK_DIAGNOSTICS) == 0)
+    {
+        printf("Device statistic: not supported by the bootloader\n");
+        return;
+    }
+
+    DeviceDiagnostics diagnostics = connection->readDiagnostics(false);
+    const DeviceConnectionStatistic &statistic = connection->connectionStatistic();
+    auto ticksToMs = [&diagnostics](uint32_t ticks) { return 1000.0 * ticks / diagnostics.tickFrequency; };
+
+    printf("Device frames: received = %u, CRC error = %u, dropped = %u, overrun = %u\n",
+        diagnostics.frameCount, diagnostics.crcErrorCount, diagnostics.droppedFrameCount, diagnostics.overrunCount);
+    printf("PC requests: NAK = %u, timeout = %u, corrupted responses = %u\n",
+        statistic.nakCount, statistic.timeoutCount, statistic.corruptedFrameCount);
+    printf("Device rows: tests = %u, skipped = %u\n", diagnostics.rowTestCount, diagnostics.skippedRowCount);
+    printf("Device flash memory: erase = %u (%.1f ms), program = %u (%.1f ms)\n",
+        diagnostics.eraseCount, ticksToMs(diagnostics.eraseTicks),
+        diagnostics.programCount, ticksToMs(diagnostics.programTicks));
+
+    // the rest of the time is the link and the request processing
+    unsigned time = connection->connectionTime();
+    printf("Device row time: %.1f ms (%.0f%% of total time)\n",
+        ticksToMs(diagnostics.rowTicks), time != 0 ? ticksToMs(diagnostics.rowTicks) * 100 / time : 0.0);
 }
 
 static void commandInfo(const CommandLineParams &params)
 {
-    if ((params.optionMask & ~(OPTION_MASK_INFO | OPTION_MASK_TIMEOUT | OPTION_MASK_MODEL)) != 0)
+    if ((params.optionMask & ~(OPTION_MASK_INFO | OPTION_MASK_TIMEOUT | OPTION_MASK_BAUD_RATE | OPTION_MASK_MODEL | OPTION_MASK_NODES)) != 0)
     {
         errorExitIncompatibleOptions();
     }
 
     const DeviceInfo *deviceInfo;
-    connectToDevice(params, &deviceInfo);
+    std::vector<std::shared_ptr<DeviceConnection>> connections = connectToDevices(params, &deviceInfo);
+
+    for (const std::shared_ptr<DeviceConnection> &connection : connections)
+    {
+        printNodeHeader(connection);
+        std::vector<uint32_t> jumpTableRow;
+        uint64_t manifest = readImageManifest(connection, &jumpTableRow);
+        if (manifest != IMAGE_MANIFEST_NONE)
+        {
+            printf("Image manifest: 0x%012llX\n", (unsigned long long)manifest);
+        }
+        else
+        {
+            printf("Image manifest: none\n");
+        }
+    }
 }
 
-static void commandProgram(const CommandLineParams &params)
+const char * const LINK_TEST_PATTERNS[] = { "random", "zero", "ramp", "stuffing" };
+const unsigned LINK_TEST_FRAME_COUNT = 100;
+const size_t LINK_TEST_LATENCY_DATA_SIZE = 16;
+
+// the stuffing pattern has only 0xAD and 0xAE bytes, so the frame is twice longer on the wire
+static std::vector<uint8_t> getLinkTestData(const std::string &pattern, size_t size)
 {
-    if ((params.optionMask & ~(OPTION_MASK_PROGRAM | OPTION_MASK_TIMEOUT | OPTION_MASK_ERASE | OPTION_MASK_NO_RUN | OPTION_MASK_FORCE | OPTION_MASK_MODEL)) != 0)
+    std::vector<uint8_t> data(size);
+    uint32_t random = 1;
+    for (size_t i = 0; i < size; ++i)
+    {
+        if (pattern == "random")
+        {
+            random = random * 1103515245 + 12345;
+            data[i] = (uint8_t)(random >> 16);
+        }
+        else if (pattern == "zero") data[i] = 0x00;
+        else if (pattern == "ramp") data[i] = (uint8_t)i;
+        else data[i] = (i & 1) != 0 ? 0xAE : 0xAD;
+    }
+
+    return data;
+}
+
+// seconds
+static double getPerformanceTime()
+{
+    LARGE_INTEGER counter;
+    LARGE_INTEGER frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return (double)counter.QuadPart / frequency.QuadPart;
+}
+
+static void commandLinkTest(const CommandLineParams &params)
+{
+    if ((params.optionMask & ~(OPTION_MASK_LINK_TEST | OPTION_MASK_TIMEOUT | OPTION_MASK_BAUD_RATE | OPTION_MASK_MODEL | OPTION_MASK_NODES | OPTION_MASK_STATS)) != 0)
     {
         errorExitIncompatibleOptions();
     }
 
+    std::vector<std::string> patterns(std::begin(LINK_TEST_PATTERNS), std::end(LINK_TEST_PATTERNS));
+    if (!params.linkTestPattern.empty())
+    {
+        if (std::find(patterns.begin(), patterns.end(), params.linkTestPattern) == patterns.end())
+        {
+            errorExit("Unknown link test pattern: %s", params.linkTestPattern.c_str());
+        }
+        patterns.assign(1, params.linkTestPattern);
+    }
+
     const DeviceInfo *deviceInfo;
     std::shared_ptr<DeviceConnection> connection = connectToDevice(params, &deviceInfo);
 
-    MemoryLayout memoryLayout(*deviceInfo);
+    if ((connection->capabilities().capabilityMask & CAPABILITY_MASK_LINK_TEST) == 0)
+    {
+        errorExit("The bootloader does not support the link test");
+    }
 
-    printf("Loading hex file...\n");
-    FirmwareImage firmwareImage(&memoryLayout);
-    hexFileLoad(params.args[1], &firmwareImage);
+    size_t dataSize = connection->maxLinkTestDataSize();
+    unsigned mismatchCount = 0;
+    unsigned frameCount = 0;
+    printf("Frame data size: %u bytes, frames: %u\n", (unsigned)dataSize, LINK_TEST_FRAME_COUNT);
 
-    checkFirmwareImage(memoryLayout, firmwareImage, connection);
-    patchFirmwareImage(connection->bootloaderParams(), &firmwareImage);
+    for (const std::string &pattern : patterns)
+    {
+        std::vector<uint8_t> data = getLinkTestData(pattern, dataSize);
+        std::vector<uint8_t> latencyData = getLinkTestData(pattern, LINK_TEST_LATENCY_DATA_SIZE);
+        auto checkEcho =
+            [&mismatchCount](const std::vector<uint8_t> &sent)
+            {
+                return
+                    [&mismatchCount, sent](const std::vector<uint8_t> &received)
+                    {
+                        if (received != sent) ++mismatchCount;
+                    };
+            };
+
+        // the line time of the frame with the byte stuffing (10 bits per byte), the request and the echo have the same size
+        std::vector<uint8_t> request(data.size() + 3);
+        std::copy(data.begin(), data.end(), request.begin() + 2);
+        size_t frameSize = PacketTransiver::encodePacket(request).size();
+        double lineBytesPerSecond = connection->baudRate() / 10.0;
+
+        printf("Pattern \"%s\": %u bytes on the line per frame\n", pattern.c_str(), (unsigned)frameSize);
+
+        // the round trip of the short frames, one request at a time
+        std::vector<double> latencies;
+        for (unsigned i = 0; i < LINK_TEST_FRAME_COUNT; ++i)
+        {
+            double startTime = getPerformanceTime();
+            connection->linkTestAsync(latencyData, true, checkEcho(latencyData));
+            connection->waitPendingRequests();
+            latencies.push_back((getPerformanceTime() - startTime) * 1000);
+        }
+        std::sort(latencies.begin(), latencies.end());
+        auto percentile = [&latencies](unsigned p) { return latencies[(latencies.size() - 1) * p / 100]; };
+        printf("    Round trip (%u bytes): p50 = %.2f ms, p90 = %.2f ms, p99 = %.2f ms, max = %.2f ms\n",
+            (unsigned)LINK_TEST_LATENCY_DATA_SIZE, percentile(50), percentile(90), percentile(99), latencies.back());
+
+        // the frames back to back, a frame is pipelined only if it fits the device receive queue with the pending ones,
+        // so the max size frames wait for the previous response and the rate includes the turnaround time
+        double startTime = getPerformanceTime();
+        for (unsigned i = 0; i < LINK_TEST_FRAME_COUNT; ++i)
+        {
+            connection->linkTestAsync(data, true, checkEcho(data));
+        }
+        connection->waitPendingRequests();
+        double time = getPerformanceTime() - startTime;
+        printf("    Echo: %.0f bytes/s each way (%.0f%% of the line)\n",
+            LINK_TEST_FRAME_COUNT * dataSize / time, 100 * LINK_TEST_FRAME_COUNT * frameSize / time / lineBytesPerSecond);
 
-    printf("Erasing the jump table");
+        startTime = getPerformanceTime();
+        for (unsigned i = 0; i < LINK_TEST_FRAME_COUNT; ++i)
+        {
+            connection->linkTestAsync(data, false, [](const std::vector<uint8_t>&) {});
+        }
+        connection->waitPendingRequests();
+        time = getPerformanceTime() - startTime;
+        printf("    Sink: %.0f bytes/s (%.0f%% of the line)\n",
+            LINK_TEST_FRAME_COUNT * dataSize / time, 100 * LINK_TEST_FRAME_COUNT * frameSize / time / lineBytesPerSecond);
+
+        frameCount += 3 * LINK_TEST_FRAME_COUNT;
+    }
+
+    // the device sends NAK for the corrupted request frames, the lost frames are detected by the timeout
+    DeviceConnectionStatistic statistic = connection->connectionStatistic();
+    printf("Requests: %u, NAK = %u (%.2f%%), timeout = %u (%.2f%%)\n", frameCount,
+        statistic.nakCount, 100.0 * statistic.nakCount / frameCount,
+        statistic.timeoutCount, 100.0 * statistic.timeoutCount / frameCount);
+    printf("Responses: corrupted = %u (%.2f%%), echo mismatch = %u\n",
+        statistic.corruptedFrameCount, 100.0 * statistic.corruptedFrameCount / frameCount, mismatchCount);
+    printDeviceStatistic(params, connection);
+    printOperationTime(connection);
+    printf("Operation has been complete\n");
+}
+
+const uint16_t CRC_CHECK_VALUE = 0x6F91; // CRC-16/MCRF4XX of "123456789"
+const size_t CRC_BENCHMARK_DATA_SIZE = 16 * 1024 * 1024;
+
+// the table CRC of the packets against the bitwise reference, no device is needed
+static void commandCrcBenchmark(const CommandLineParams &params)
+{
+    if (params.optionMask != OPTION_MASK_CRC_BENCHMARK) errorExitIncompatibleOptions();
+
+    const char checkString[] = "123456789";
+    std::vector<uint8_t> checkData(checkString, checkString + sizeof checkString - 1);
+    uint16_t tableCheck = PacketTransiver::crc16(checkData);
+    uint16_t bitwiseCheck = PacketTransiver::crc16Bitwise(checkData);
+    printf("Check \"123456789\": table = 0x%04X, bitwise = 0x%04X, expected = 0x%04X\n",
+        tableCheck, bitwiseCheck, CRC_CHECK_VALUE);
+    if ((tableCheck != CRC_CHECK_VALUE) || (bitwiseCheck != CRC_CHECK_VALUE)) errorExit("Wrong CRC check value");
+
+    std::vector<uint8_t> data = getLinkTestData("random", CRC_BENCHMARK_DATA_SIZE);
+    auto measure = [&data](const char *name, uint16_t(*crc16)(const std::vector<uint8_t> &))
+    {
+        double startTime = getPerformanceTime();
+        uint16_t crc = crc16(data);
+        double time = getPerformanceTime() - startTime;
+        printf("%s: %.1f MB/s\n", name, data.size() / time / 1000000);
+        return crc;
+    };
+    uint16_t tableCrc = measure("Table", PacketTransiver::crc16);
+    uint16_t bitwiseCrc = measure("Bitwise", PacketTransiver::crc16Bitwise);
+    if (tableCrc != bitwiseCrc) errorExit("Table CRC mismatch: 0x%04X, bitwise: 0x%04X", tableCrc, bitwiseCrc);
+
+    printf("Operation has been complete\n");
+}
+
+// programs the firmware image with the manifest, the broadcast connection preloads the rows to all nodes
+// of the bus without the device reads, the jump table is not programmed, so the node connections
+// program the lost rows and the jump table by the differential programming after the broadcast
+static void programDevice(
+    const CommandLineParams &params,
+    const std::shared_ptr<DeviceConnection> &connection,
+    const MemoryLayout &memoryLayout,
+    const FirmwareImage &firmwareImage)
+{
+    bool broadcast = (connection->nodeAddress() == NODE_ADDRESS_BROADCAST);
     bool force = ((params.optionMask & OPTION_MASK_FORCE) != 0);
     bool erase = ((params.optionMask & OPTION_MASK_ERASE) != 0);
+    const MemoryRange &programMemoryRange = memoryLayout.memoryRange(MEMORY_TYPE_PROGRAM);
+    const MemoryRange &dataMemoryRange = memoryLayout.memoryRange(MEMORY_TYPE_DATA);
+    const BootloaderParams &bootloaderParams = connection->bootloaderParams();
+
+    // the undefined rows are erased only if they are not blank already
+    std::vector<bool> nonBlankProgramMemoryRows(programMemoryRange.size / ROW_SIZE_PROGRAM, true);
+    std::vector<bool> nonBlankDataEEPROMRows(dataMemoryRange.size / ROW_SIZE_DATA, true);
+    if (erase && !force && !broadcast)
+    {
+        nonBlankProgramMemoryRows = readNonBlankRows(connection, programMemoryRange, ROW_SIZE_PROGRAM);
+        nonBlankDataEEPROMRows = readNonBlankRows(connection, dataMemoryRange, ROW_SIZE_DATA);
+    }
+
+    auto isProgramMemoryRowWritten =
+        [&firmwareImage, &bootloaderParams, &programMemoryRange, &nonBlankProgramMemoryRows, erase](uint32_t address)
+        {
+            return (address != 0x000000) // skip the zero row
+                && (address != bootloaderParams.address) // skip the jump table first row
+                && ((address < bootloaderParams.address + 2 * ROW_SIZE_PROGRAM) // skip the bootloader image (without the jump table)
+                    || (address >= bootloaderParams.address + bootloaderParams.size))
+                && ((erase && nonBlankProgramMemoryRows[(address - programMemoryRange.address) / ROW_SIZE_PROGRAM])
+                    || !isRowUndefined(getRow(firmwareImage, address, ROW_SIZE_PROGRAM)));
+        };
+    auto isDataEEPROMRowWritten =
+        [&firmwareImage, &dataMemoryRange, &nonBlankDataEEPROMRows, erase](uint32_t address)
+        {
+            return (erase && nonBlankDataEEPROMRows[(address - dataMemoryRange.address) / ROW_SIZE_DATA])
+                || !isRowUndefined(getRow(firmwareImage, address, ROW_SIZE_DATA));
+        };
+
+    // differential programming, the rows with the same digests in the device are not sent
+    bool differential = !force && !broadcast && ((connection->capabilities().capabilityMask & CAPABILITY_MASK_ROW_DIGESTS) != 0);
+    std::vector<bool> unchangedProgramMemoryRows(programMemoryRange.size / ROW_SIZE_PROGRAM);
+    std::vector<bool> unchangedDataEEPROMRows(dataMemoryRange.size / ROW_SIZE_DATA);
+    if (differential)
+    {
+        printf("Comparing row digests...\n");
+        unchangedProgramMemoryRows = readUnchangedRows(connection, firmwareImage, programMemoryRange, ROW_SIZE_PROGRAM, isProgramMemoryRowWritten);
+        unchangedDataEEPROMRows = readUnchangedRows(connection, firmwareImage, dataMemoryRange, ROW_SIZE_DATA, isDataEEPROMRowWritten);
+    }
+
+    printf("Erasing the jump table");
     connection->writeProgramMemory(connection->bootloaderParams().address, std::vector<uint32_t>(), false, force);
     printf("\n");
 
+    if (erase)
+    {
+        printf("Erasing unused rows");
+        eraseDeviceRows(connection, programMemoryRange, ROW_SIZE_PROGRAM, force,
+            [&firmwareImage, &programMemoryRange, &unchangedProgramMemoryRows, &isProgramMemoryRowWritten](uint32_t address)
+            {
+                return isProgramMemoryRowWritten(address)
+                    && !unchangedProgramMemoryRows[(address - programMemoryRange.address) / ROW_SIZE_PROGRAM]
+                    && isRowUndefined(getRow(firmwareImage, address, ROW_SIZE_PROGRAM));
+            });
+        eraseDeviceRows(connection, dataMemoryRange, ROW_SIZE_DATA, force,
+            [&firmwareImage, &dataMemoryRange, &unchangedDataEEPROMRows, &isDataEEPROMRowWritten](uint32_t address)
+            {
+                return isDataEEPROMRowWritten(address)
+                    && !unchangedDataEEPROMRows[(address - dataMemoryRange.address) / ROW_SIZE_DATA]
+                    && isRowUndefined(getRow(firmwareImage, address, ROW_SIZE_DATA));
+            });
+        printf("\n");
+    }
+
     printf("Programing program memory");
-    const MemoryRange &programMemoryRange = memoryLayout.memoryRange(MEMORY_TYPE_PROGRAM);
-    const BootloaderParams &bootloaderParams = connection->bootloaderParams();
+    // the device keeps its words out of the firmware image in the partial rows (not with the erase option)
+    bool masked = !erase && ((connection->capabilities().capabilityMask & CAPABILITY_MASK_MASKED_WRITE) != 0);
+    unsigned unchangedRowCount = 0;
+    // the consecutive programmed rows are sent by one request if the device packet buffer allows
+    uint32_t maxRowCount = connection->maxWriteRowCount(true);
+    uint32_t rowsAddress = 0;
+    std::vector<uint32_t> rows;
+    auto writeProgramMemoryRows =
+        [&connection, &rowsAddress, &rows, force]()
+        {
+            if (rows.empty()) return;
+            connection->writeProgramMemory(rowsAddress, rows, true, force);
+            rows.clear();
+        };
     for (uint32_t address = programMemoryRange.address; address < programMemoryRange.address + programMemoryRange.size; address += ROW_SIZE_PROGRAM)
     {
-        std::vector<uint32_t> firmwareRow = getRow(firmwareImage, address, ROW_SIZE_PROGRAM);
-        if ((address != 0x000000) // skip the zero row
-            && (address != bootloaderParams.address) // skip the jump table first row
-            && ((address < bootloaderParams.address + 2 * ROW_SIZE_PROGRAM) // skip the bootloader image (without the jump table)
-                || (address >= bootloaderParams.address + bootloaderParams.size)))
+        bool rowAdded = false;
+        if (isProgramMemoryRowWritten(address))
         {
-            if (erase || !isRowUndefined(firmwareRow))
+            if (unchangedProgramMemoryRows[(address - programMemoryRange.address) / ROW_SIZE_PROGRAM])
+            {
+                ++unchangedRowCount;
+            }
+            else
             {
-                connection->writeProgramMemory(address, firmwareRow, !isRowErased(firmwareRow, WORD_MASK_PROGRAM), force);
+                // the undefined rows are already erased
+                std::vector<uint32_t> firmwareRow = getRow(firmwareImage, address, ROW_SIZE_PROGRAM);
+                if (!isRowUndefined(firmwareRow))
+                {
+                    if (masked && !isRowComplete(firmwareRow))
+                    {
+                        writeProgramMemoryRows();
+                        connection->writeProgramMemory(address, firmwareRow, true, force, true);
+                    }
+                    else if (isRowErased(firmwareRow, WORD_MASK_PROGRAM))
+                    {
+                        writeProgramMemoryRows();
+                        connection->writeProgramMemory(address, firmwareRow, false, force);
+                    }
+                    else
+                    {
+                        if (rows.empty()) rowsAddress = address;
+                        rows.insert(rows.end(), firmwareRow.begin(), firmwareRow.end());
+                        rowAdded = true;
+                    }
+                }
             }
         }
+        // the rows of one request have the same TBLPAG
+        if (!rowAdded || (rows.size() == maxRowCount * (ROW_SIZE_PROGRAM / 2)) || (((address + ROW_SIZE_PROGRAM) & 0xFFFF) == 0))
+        {
+            writeProgramMemoryRows();
+        }
         if (address % 1024 == 0) printf(".");
     }
+    writeProgramMemoryRows();
     printf("\n");
 
     printf("Programing data EEPROM");
-    const MemoryRange &dataMemoryRange = memoryLayout.memoryRange(MEMORY_TYPE_DATA);
+    // the rows with a few changed words are written by words
+    std::vector<bool> wordWrittenDataEEPROMRows(dataMemoryRange.size / ROW_SIZE_DATA);
+    if (!force && !broadcast)
+    {
+        wordWrittenDataEEPROMRows = writeDataEEPROMWords(connection, firmwareImage, dataMemoryRange,
+            [&firmwareImage, &dataMemoryRange, &unchangedDataEEPROMRows, &isDataEEPROMRowWritten](uint32_t address)
+            {
+                return isDataEEPROMRowWritten(address)
+                    && !unchangedDataEEPROMRows[(address - dataMemoryRange.address) / ROW_SIZE_DATA]
+                    && !isRowUndefined(getRow(firmwareImage, address, ROW_SIZE_DATA));
+            });
+    }
+    maxRowCount = connection->maxWriteRowCount(false);
+    auto writeDataEEPROMRows =
+        [&connection, &rowsAddress, &rows, force]()
+        {
+            if (rows.empty()) return;
+            connection->writeDataEEPROM(rowsAddress, rows, true, force);
+            rows.clear();
+        };
     for (uint32_t address = dataMemoryRange.address; address < dataMemoryRange.address + dataMemoryRange.size; address += ROW_SIZE_DATA)
     {
-        std::vector<uint32_t> firmwareRow = getRow(firmwareImage, address, ROW_SIZE_DATA);
-        if (erase || !isRowUndefined(firmwareRow))
+        bool rowAdded = false;
+        if (isDataEEPROMRowWritten(address))
         {
-            connection->writeDataEEPROM(address, firmwareRow, !isRowErased(firmwareRow, WORD_MASK_DATA), force);
+            if (unchangedDataEEPROMRows[(address - dataMemoryRange.address) / ROW_SIZE_DATA])
+            {
+                ++unchangedRowCount;
+            }
+            else if (!wordWrittenDataEEPROMRows[(address - dataMemoryRange.address) / ROW_SIZE_DATA])
+            {
+                std::vector<uint32_t> firmwareRow = getRow(firmwareImage, address, ROW_SIZE_DATA);
+                if (!isRowUndefined(firmwareRow))
+                {
+                    if (isRowErased(firmwareRow, WORD_MASK_DATA))
+                    {
+                        writeDataEEPROMRows();
+                        connection->writeDataEEPROM(address, firmwareRow, false, force);
+                    }
+                    else
+                    {
+                        if (rows.empty()) rowsAddress = address;
+                        rows.insert(rows.end(), firmwareRow.begin(), firmwareRow.end());
+                        rowAdded = true;
+                    }
+                }
+            }
+        }
+        if (!rowAdded || (rows.size() == maxRowCount * (ROW_SIZE_DATA / 2)))
+        {
+            writeDataEEPROMRows();
         }
         if (address % 1024 == 0) printf(".");
     }
+    writeDataEEPROMRows();
     printf("\n");
 
+    // all rows shall be programmed before the jump table
+    connection->waitPendingRequests();
+
+    // the digests are short, so the skipped rows are verified by CRC-32 before the jump table is programmed
+    if (differential && ((connection->capabilities().capabilityMask & CAPABILITY_MASK_RANGE_CRC) != 0))
+    {
+        printf("Verifing unchanged rows");
+        fastVerifyDeviceRows(connection, firmwareImage, programMemoryRange, WORD_MASK_PROGRAM,
+            [&unchangedProgramMemoryRows, &programMemoryRange](uint32_t address)
+            {
+                return unchangedProgramMemoryRows[(address - programMemoryRange.address) / ROW_SIZE_PROGRAM];
+            });
+        // ROW_SIZE_PROGRAM rows for all memory types
+        fastVerifyDeviceRows(connection, firmwareImage, dataMemoryRange, WORD_MASK_DATA,
+            [&unchangedDataEEPROMRows, &dataMemoryRange](uint32_t address)
+            {
+                size_t index = (address - dataMemoryRange.address) / ROW_SIZE_DATA;
+                return unchangedDataEEPROMRows[index] || unchangedDataEEPROMRows[index + 1];
+            });
+        printf("\n");
+    }
+
+    if (broadcast)
+    {
+        // the jump table and the manifest are programmed by the node connections
+        return;
+    }
+
     printf("Programing the jump table");
     connection->writeProgramMemory(connection->bootloaderParams().address,
         getRow(firmwareImage, connection->bootloaderParams().address, ROW_SIZE_PROGRAM),
         true, false /* not force*/);
+    connection->waitPendingRequests();
     printf("\n");
 
+    printDeviceStatistic(params, connection);
+
     if ((params.optionMask & OPTION_MASK_NO_RUN) == 0)
     {
         printf("Starting the target firmware\n");
         connection->startFirmware();
     }
 
-    printOperationTime(connection);
     printOperationStatistic(connection);
-    printf("Operation has been complete\n");
+    if (differential) printf("Unchanged rows: %u\n", unchangedRowCount);
 }
 
-static void commandVerify(const CommandLineParams &params)
+// the target firmware can change the data EEPROM, so it is compared with the image even if the manifest matches,
+// CRC of the whole data EEPROM is compared if the image defines all words (or erases the undefined ones),
+// the rows are read and compared otherwise
+static bool isDataEEPROMUnchanged(
+    const std::shared_ptr<DeviceConnection> &connection,
+    const MemoryLayout &memoryLayout,
+    const FirmwareImage &firmwareImage,
+    bool erase)
+{
+    const MemoryRange &range = memoryLayout.memoryRange(MEMORY_TYPE_DATA);
+    std::vector<uint32_t> words = getRow(firmwareImage, range.address, range.size);
+    if (!erase && isRowUndefined(words)) return true;
+    if (erase)
+    {
+        for (uint32_t &word : words)
+        {
+            if (word == UNDEFINED_WORD) word = WORD_MASK_DATA;
+        }
+    }
+
+    printf("Comparing data EEPROM");
+    bool unchanged = true;
+    if (isRowComplete(words) && ((connection->capabilities().capabilityMask & CAPABILITY_MASK_RANGE_CRC) != 0))
+    {
+        uint32_t crc = DeviceConnection::calculateCrc(words, WORD_MASK_DATA);
+        // ROW_SIZE_PROGRAM rows for all memory types
+        connection->calculateRangeCrcAsync(range.address, range.size / ROW_SIZE_PROGRAM, WORD_MASK_DATA,
+            [crc, &unchanged](uint32_t deviceCrc)
+            {
+                unchanged = (deviceCrc == crc);
+            });
+        connection->waitPendingRequests();
+        printf(".\n");
+        return unchanged;
+    }
+
+    readDeviceRows(connection, range,
+        [](uint32_t) { return true; },
+        [&words, &range, &unchanged](uint32_t address, const std::vector<uint32_t> &deviceRow)
+        {
+            std::vector<uint32_t> row(words.begin() + (address - range.address) / 2,
+                words.begin() + (address - range.address + ROW_SIZE_PROGRAM) / 2);
+            if (!isRowEquals(row, deviceRow, WORD_MASK_DATA)) unchanged = false;
+        });
+    printf("\n");
+
+    return unchanged;
+}
+
+static void commandProgram(const CommandLineParams &params)
 {
-    if ((params.optionMask & ~(OPTION_MASK_VERIFY | OPTION_MASK_TIMEOUT | OPTION_MASK_MODEL)) != 0)
+    if ((params.optionMask & ~(OPTION_MASK_PROGRAM | OPTION_MASK_TIMEOUT | OPTION_MASK_BAUD_RATE | OPTION_MASK_ERASE | OPTION_MASK_NO_RUN | OPTION_MASK_FORCE | OPTION_MASK_MODEL | OPTION_MASK_NODES | OPTION_MASK_STATS)) != 0)
     {
         errorExitIncompatibleOptions();
     }
 
     const DeviceInfo *deviceInfo;
-    std::shared_ptr<DeviceConnection> connection = connectToDevice(params, &deviceInfo);
+    std::shared_ptr<DeviceConnection> broadcast;
+    std::vector<std::shared_ptr<DeviceConnection>> connections = connectToDevices(params, &deviceInfo, &broadcast);
 
     MemoryLayout memoryLayout(*deviceInfo);
 
@@ -330,50 +1372,130 @@ static void commandVerify(const CommandLineParams &params)
     FirmwareImage firmwareImage(&memoryLayout);
     hexFileLoad(params.args[1], &firmwareImage);
 
-    checkFirmwareImage(memoryLayout, firmwareImage, connection);
-    patchFirmwareImage(connection->bootloaderParams(), &firmwareImage);
+    for (const std::shared_ptr<DeviceConnection> &connection : connections)
+    {
+        checkFirmwareImage(memoryLayout, firmwareImage, connection);
+    }
+    // the nodes have the same bootloader
+    patchFirmwareImage(connections[0]->bootloaderParams(), connections[0]->capabilities(), &firmwareImage);
+
+    bool force = ((params.optionMask & OPTION_MASK_FORCE) != 0);
+    bool erase = ((params.optionMask & OPTION_MASK_ERASE) != 0);
+    const BootloaderParams &bootloaderParams = connections[0]->bootloaderParams();
 
-    printf("Verifing program memory");
-    const MemoryRange &programMemoryRange = memoryLayout.memoryRange(MEMORY_TYPE_PROGRAM);
-    for (uint32_t address = programMemoryRange.address; address < programMemoryRange.address + programMemoryRange.size; address += ROW_SIZE_PROGRAM)
+    // the manifest is programmed with the jump table, so it is valid only if the previous programming was complete
+    uint64_t manifest = calculateImageManifest(memoryLayout, firmwareImage, erase);
+    std::vector<std::shared_ptr<DeviceConnection>> outdatedConnections;
+    for (const std::shared_ptr<DeviceConnection> &connection : connections)
     {
-        std::vector<uint32_t> firmwareRow = getRow(firmwareImage, address, ROW_SIZE_PROGRAM);
-        if (!isRowUndefined(firmwareRow))
+        std::vector<uint32_t> jumpTableRow;
+        if (!force
+            && (readImageManifest(connection, &jumpTableRow) == manifest)
+            && isRowEquals(getRow(firmwareImage, bootloaderParams.address, ROW_SIZE_PROGRAM), jumpTableRow, WORD_MASK_PROGRAM)
+            && isDataEEPROMUnchanged(connection, memoryLayout, firmwareImage, erase))
         {
-            std::vector<uint32_t> targetRow = connection->readRow(address);
-            if (!isRowEquals(firmwareRow, targetRow, WORD_MASK_PROGRAM))
+            printNodeHeader(connection);
+            printf("The device already has the image (manifest 0x%012llX)\n", (unsigned long long)manifest);
+            if ((params.optionMask & OPTION_MASK_NO_RUN) == 0)
             {
-                errorExit("The row at address 0x%06X has different values", address);
+                printf("Starting the target firmware\n");
+                connection->startFirmware();
             }
         }
-        if (address % 1024 == 0) printf(".");
+        else
+        {
+            outdatedConnections.push_back(connection);
+        }
     }
-    printf("\n");
+    setImageManifest(bootloaderParams, manifest, &firmwareImage);
 
-    printf("Verifing data EEPROM");
-    const MemoryRange &dataMemoryRange = memoryLayout.memoryRange(MEMORY_TYPE_DATA);
-    for (uint32_t address = dataMemoryRange.address; address < dataMemoryRange.address + dataMemoryRange.size; address += ROW_SIZE_PROGRAM /* not ROW_SIZE_DATA*/)
+    // the nodes receive the rows at the same time, the node connections check and complete them
+    if (broadcast && (outdatedConnections.size() > 1))
+    {
+        printf("--- Broadcast to %u nodes ---\n", (unsigned)outdatedConnections.size());
+        broadcast->startBroadcast(outdatedConnections);
+        programDevice(params, broadcast, memoryLayout, firmwareImage);
+    }
+
+    for (const std::shared_ptr<DeviceConnection> &connection : outdatedConnections)
+    {
+        printNodeHeader(connection);
+        programDevice(params, connection, memoryLayout, firmwareImage);
+    }
+
+    printOperationTime(connections[0]);
+    printf("Operation has been complete\n");
+}
+
+static void commandVerify(const CommandLineParams &params)
+{
+    if ((params.optionMask & ~(OPTION_MASK_VERIFY | OPTION_MASK_TIMEOUT | OPTION_MASK_BAUD_RATE | OPTION_MASK_MODEL | OPTION_MASK_FAST_VERIFY | OPTION_MASK_NODES | OPTION_MASK_STATS)) != 0)
     {
-        std::vector<uint32_t> firmwareRow = getRow(firmwareImage, address, ROW_SIZE_PROGRAM /* not ROW_SIZE_DATA*/);
-        if (!isRowUndefined(firmwareRow))
+        errorExitIncompatibleOptions();
+    }
+
+    const DeviceInfo *deviceInfo;
+    std::vector<std::shared_ptr<DeviceConnection>> connections = connectToDevices(params, &deviceInfo);
+
+    MemoryLayout memoryLayout(*deviceInfo);
+
+    printf("Loading hex file...\n");
+    FirmwareImage firmwareImage(&memoryLayout);
+    hexFileLoad(params.args[1], &firmwareImage);
+
+    for (const std::shared_ptr<DeviceConnection> &connection : connections)
+    {
+        checkFirmwareImage(memoryLayout, firmwareImage, connection);
+    }
+    // the nodes have the same bootloader
+    patchFirmwareImage(connections[0]->bootloaderParams(), connections[0]->capabilities(), &firmwareImage);
+
+    for (const std::shared_ptr<DeviceConnection> &connection : connections)
+    {
+        printNodeHeader(connection);
+
+        // the manifest does not depend on the erase option of the verification, so both variants are checked
+        std::vector<uint32_t> jumpTableRow;
+        uint64_t deviceManifest = readImageManifest(connection, &jumpTableRow);
+        if (deviceManifest == IMAGE_MANIFEST_NONE)
         {
-            std::vector<uint32_t> targetRow = connection->readRow(address);
-            if (!isRowEquals(firmwareRow, targetRow, WORD_MASK_DATA))
-            {
-                errorExit("The row at address 0x%06X has different values", address);
-            }
+            printf("The device has no image manifest\n");
         }
-        if (address % 1024 == 0) printf(".");
+        else if ((deviceManifest == calculateImageManifest(memoryLayout, firmwareImage, false))
+            || (deviceManifest == calculateImageManifest(memoryLayout, firmwareImage, true)))
+        {
+            printf("The image manifest matches (0x%012llX)\n", (unsigned long long)deviceManifest);
+        }
+        else
+        {
+            printf("The image manifest does not match (0x%012llX)\n", (unsigned long long)deviceManifest);
+        }
+
+        auto verify = verifyDeviceRows;
+        if (((params.optionMask & OPTION_MASK_FAST_VERIFY) != 0)
+            && ((connection->capabilities().capabilityMask & CAPABILITY_MASK_RANGE_CRC) != 0))
+        {
+            verify = fastVerifyDeviceRows;
+        }
+
+        printf("Verifing program memory");
+        verify(connection, firmwareImage, memoryLayout.memoryRange(MEMORY_TYPE_PROGRAM), WORD_MASK_PROGRAM);
+        printf("\n");
+
+        printf("Verifing data EEPROM");
+        verify(connection, firmwareImage, memoryLayout.memoryRange(MEMORY_TYPE_DATA), WORD_MASK_DATA);
+        printf("\n");
+
+        printDeviceStatistic(params, connection);
     }
-    printf("\n");
 
-    printOperationTime(connection);
+    printOperationTime(connections[0]);
     printf("Verification passed\n");
 }
 
 static void commandLoad(const CommandLineParams &params)
 {
-    if ((params.optionMask & ~(OPTION_MASK_LOAD | OPTION_MASK_TIMEOUT | OPTION_MASK_ALL | OPTION_MASK_NO_SMART | OPTION_MASK_MODEL)) != 0)
+    if ((params.optionMask & ~(OPTION_MASK_LOAD | OPTION_MASK_TIMEOUT | OPTION_MASK_BAUD_RATE | OPTION_MASK_ALL | OPTION_MASK_NO_SMART | OPTION_MASK_MODEL | OPTION_MASK_NODES | OPTION_MASK_STATS)) != 0)
     {
         errorExitIncompatibleOptions();
     }
@@ -401,58 +1523,63 @@ static void commandLoad(const CommandLineParams &params)
         firmwareImage.setData(address, jumpTable[(address - jumpTableRange.address) / 2]);
     }
 
-    printf("Loading program memory");
-    const MemoryRange &programMemoryRange = memoryLayout.memoryRange(MEMORY_TYPE_PROGRAM);
-    const BootloaderParams &bootloaderParams = connection->bootloaderParams();
-    for (uint32_t address = programMemoryRange.address; address < programMemoryRange.address + programMemoryRange.size; address += ROW_SIZE_PROGRAM)
-    {
-        if ((address != bootloaderParams.address) // already read
-            && (((params.optionMask & OPTION_MASK_ALL) != 0) // skip if the bootloader image is not needed
-                || ((address != 0x000000) // skip the zero row
-                    && ((address < bootloaderParams.address + 2 * ROW_SIZE_PROGRAM) // skip the bootloader image (without the jump table)
-                        || (address >= bootloaderParams.address + bootloaderParams.size)))))
+    DeviceConnection::RowHandler setImageRow =
+        [&firmwareImage](uint32_t address, const std::vector<uint32_t> &row)
         {
-            std::vector<uint32_t> row = connection->readRow(address);
             for (size_t i = 0; i < row.size(); ++i)
             {
                 firmwareImage.setData(address + i * 2, row[i]);
             }
-        }
+        };
 
-        if (address % 1024 == 0) printf(".");
+    // the blank rows are undefined in the smart mode, so they are not read
+    const MemoryRange &programMemoryRange = memoryLayout.memoryRange(MEMORY_TYPE_PROGRAM);
+    const MemoryRange &dataMemoryRange = memoryLayout.memoryRange(MEMORY_TYPE_DATA);
+    std::vector<bool> nonBlankProgramMemoryRows(programMemoryRange.size / ROW_SIZE_PROGRAM, true);
+    std::vector<bool> nonBlankDataEEPROMRows(dataMemoryRange.size / ROW_SIZE_DATA, true);
+    if ((params.optionMask & OPTION_MASK_NO_SMART) == 0)
+    {
+        nonBlankProgramMemoryRows = readNonBlankRows(connection, programMemoryRange, ROW_SIZE_PROGRAM);
+        nonBlankDataEEPROMRows = readNonBlankRows(connection, dataMemoryRange, ROW_SIZE_DATA);
     }
+
+    printf("Loading program memory");
+    const BootloaderParams &bootloaderParams = connection->bootloaderParams();
+    readDeviceRows(connection, programMemoryRange,
+        [&params, &bootloaderParams, &programMemoryRange, &nonBlankProgramMemoryRows](uint32_t address)
+        {
+            return nonBlankProgramMemoryRows[(address - programMemoryRange.address) / ROW_SIZE_PROGRAM]
+                && (address != bootloaderParams.address) // already read
+                && (((params.optionMask & OPTION_MASK_ALL) != 0) // skip if the bootloader image is not needed
+                    || ((address != 0x000000) // skip the zero row
+                        && ((address < bootloaderParams.address + 2 * ROW_SIZE_PROGRAM) // skip the bootloader image (without the jump table)
+                            || (address >= bootloaderParams.address + bootloaderParams.size))));
+        },
+        setImageRow);
     printf("\n");
 
     printf("Loading data EEPROM");
-    const MemoryRange &dataMemoryRange = memoryLayout.memoryRange(MEMORY_TYPE_DATA);
-    for (uint32_t address = dataMemoryRange.address; address < dataMemoryRange.address + dataMemoryRange.size; address += ROW_SIZE_PROGRAM /* not ROW_SIZE_DATA*/)
-    {
-        std::vector<uint32_t> row = connection->readRow(address);
-        for (size_t i = 0; i < row.size(); ++i)
+    readDeviceRows(connection, dataMemoryRange,
+        [&dataMemoryRange, &nonBlankDataEEPROMRows](uint32_t address)
         {
-            firmwareImage.setData(address + i * 2, row[i]);
-        }
-        if (address % 1024 == 0) printf(".");
-    }
+            // ROW_SIZE_PROGRAM rows are read for all memory types
+            size_t index = (address - dataMemoryRange.address) / ROW_SIZE_DATA;
+            return nonBlankDataEEPROMRows[index] || nonBlankDataEEPROMRows[index + 1];
+        },
+        setImageRow);
     printf("\n");
 
-    printf("Reading config memory");
     const MemoryRange &configMemoryRange = memoryLayout.memoryRange(MEMORY_TYPE_CONFIG);
-    const uint32_t *configMasks = deviceInfo->configMemoryMasks;
-    for (uint32_t address = configMemoryRange.address; address < configMemoryRange.address + configMemoryRange.size; address += ROW_SIZE_PROGRAM /* not ROW_SIZE_DATA*/)
+    std::vector<uint32_t> configMemory = readConfigMemory(connection, configMemoryRange);
+    for (size_t i = 0; i < configMemory.size(); ++i)
     {
-        std::vector<uint32_t> row = connection->readRow(address);
-        for (size_t i = 0; i < row.size(); ++i)
-        {
-            if (i * 2 == configMemoryRange.size) break;
-            firmwareImage.setData(address + i * 2, (row[i] | ~(*(configMasks++))) & WORD_MASK_CONFIG);
-        }
+        firmwareImage.setData(configMemoryRange.address + i * 2,
+            (configMemory[i] | ~deviceInfo->configMemoryMasks[i]) & WORD_MASK_CONFIG);
     }
-    printf("\n");
 
     if ((params.optionMask & OPTION_MASK_ALL) == 0)
     {
-        unpatchFirmwareImage(connection->bootloaderParams(), &firmwareImage);
+        unpatchFirmwareImage(connection->bootloaderParams(), connection->capabilities(), &firmwareImage);
     }
 
     if ((params.optionMask & OPTION_MASK_NO_SMART) == 0)
@@ -484,13 +1611,14 @@ static void commandLoad(const CommandLineParams &params)
     HexFileWriter hexFileWrite(params.args[1]);
     hexFileWrite.writeImage(firmwareImage, memoryLayout);
 
+    printDeviceStatistic(params, connection);
     printOperationTime(connection);
     printf("Firmware image loaded\n");
 }
 
 static void commandErase(const CommandLineParams &params)
 {
-    if ((params.optionMask & ~(OPTION_MASK_ERASE | OPTION_MASK_TIMEOUT | OPTION_MASK_FORCE | OPTION_MASK_MODEL)) != 0)
+    if ((params.optionMask & ~(OPTION_MASK_ERASE | OPTION_MASK_TIMEOUT | OPTION_MASK_BAUD_RATE | OPTION_MASK_FORCE | OPTION_MASK_MODEL | OPTION_MASK_NODES | OPTION_MASK_STATS)) != 0)
     {
         errorExitIncompatibleOptions();
     }
@@ -505,31 +1633,40 @@ static void commandErase(const CommandLineParams &params)
     connection->writeProgramMemory(connection->bootloaderParams().address, std::vector<uint32_t>(), false, force);
     printf("\n");
 
-    printf("Erasing program memory");
+    // only the rows which hold data are erased, the erase range requests skip the blank rows in the device
     const MemoryRange &programMemoryRange = memoryLayout.memoryRange(MEMORY_TYPE_PROGRAM);
-    const BootloaderParams &bootloaderParams = connection->bootloaderParams();
-    for (uint32_t address = programMemoryRange.address; address < programMemoryRange.address + programMemoryRange.size; address += ROW_SIZE_PROGRAM)
+    const MemoryRange &dataMemoryRange = memoryLayout.memoryRange(MEMORY_TYPE_DATA);
+    std::vector<bool> nonBlankProgramMemoryRows(programMemoryRange.size / ROW_SIZE_PROGRAM, true);
+    std::vector<bool> nonBlankDataEEPROMRows(dataMemoryRange.size / ROW_SIZE_DATA, true);
+    if (!force && ((connection->capabilities().capabilityMask & CAPABILITY_MASK_ERASE_RANGE) == 0))
     {
-        if ((address != 0x000000) // skip the zero row
-            && (address != bootloaderParams.address) // skip the jump table first row (already erased)
-            && ((address < bootloaderParams.address + 2 * ROW_SIZE_PROGRAM) // skip the bootloader image (without the jump table)
-                || (address >= bootloaderParams.address + bootloaderParams.size)))
-        {
-            connection->writeProgramMemory(address, std::vector<uint32_t>(), false, force);
-        }
-        if (address % 1024 == 0) printf(".");
+        nonBlankProgramMemoryRows = readNonBlankRows(connection, programMemoryRange, ROW_SIZE_PROGRAM);
+        nonBlankDataEEPROMRows = readNonBlankRows(connection, dataMemoryRange, ROW_SIZE_DATA);
     }
+
+    printf("Erasing program memory");
+    const BootloaderParams &bootloaderParams = connection->bootloaderParams();
+    eraseDeviceRows(connection, programMemoryRange, ROW_SIZE_PROGRAM, force,
+        [&bootloaderParams, &programMemoryRange, &nonBlankProgramMemoryRows](uint32_t address)
+        {
+            return (address != 0x000000) // skip the zero row
+                && (address != bootloaderParams.address) // skip the jump table first row (already erased)
+                && ((address < bootloaderParams.address + 2 * ROW_SIZE_PROGRAM) // skip the bootloader image (without the jump table)
+                    || (address >= bootloaderParams.address + bootloaderParams.size))
+                && nonBlankProgramMemoryRows[(address - programMemoryRange.address) / ROW_SIZE_PROGRAM];
+        });
     printf("\n");
 
     printf("Erasing data EEPROM");
-    const MemoryRange &dataMemoryRange = memoryLayout.memoryRange(MEMORY_TYPE_DATA);
-    for (uint32_t address = dataMemoryRange.address; address < dataMemoryRange.address + dataMemoryRange.size; address += ROW_SIZE_DATA)
-    {
-        connection->writeDataEEPROM(address, std::vector<uint32_t>(), false, force);
-        if (address % 1024 == 0) printf(".");
-    }
+    eraseDeviceRows(connection, dataMemoryRange, ROW_SIZE_DATA, force,
+        [&dataMemoryRange, &nonBlankDataEEPROMRows](uint32_t address)
+        {
+            return nonBlankDataEEPROMRows[(address - dataMemoryRange.address) / ROW_SIZE_DATA];
+        });
+    connection->waitPendingRequests();
     printf("\n");
 
+    printDeviceStatistic(params, connection);
     printOperationTime(connection);
     printOperationStatistic(connection);
     printf("Operation has been complete\n");
@@ -542,12 +1679,23 @@ int main(int argc, char *argv[])
 
     if (params.args.empty())
     {
-        if ((params.optionMask & ~OPTION_MASK_HELP)) errorExitIncompatibleOptions();
-        printf(HELP_TEXT);
+        if ((params.optionMask & OPTION_MASK_CRC_BENCHMARK) != 0)
+        {
+            commandCrcBenchmark(params);
+        }
+        else
+        {
+            if ((params.optionMask & ~OPTION_MASK_HELP)) errorExitIncompatibleOptions();
+            printf(HELP_TEXT);
+        }
     }
     else if (params.args.size() == 1)
     {
-        if ((params.optionMask & (OPTION_MASK_PROGRAM | OPTION_MASK_LOAD | OPTION_MASK_ERASE)) == 0)
+        if ((params.optionMask & OPTION_MASK_LINK_TEST) != 0)
+        {
+            commandLinkTest(params);
+        }
+        else if ((params.optionMask & (OPTION_MASK_PROGRAM | OPTION_MASK_LOAD | OPTION_MASK_ERASE)) == 0)
         {
             commandInfo(params);
         }
@@ -0,0 +1,28 @@
+#ifndef __BUS_NODE_H_INCLUDED_
+#define __BUS_NODE_H_INCLUDED_
+
+#include <stdint.h>
+#include <string>
+
+// the times are in nanoseconds of busTime()
+int64_t busTime();
+
+// the simulated node attached to the bus
+struct BusNode
+{
+    unsigned address; // NODE_ADDRESS of the firmware
+
+    // opens the flash memory file (a blank device with the bootloader if the file is new) and starts the firmware,
+    // the flash memory operations are stallScale times longer than the device ones
+    void (*start)(const std::string &flashPath, double stallScale);
+    // the byte sent by the PC or by another node ends on the bus at the time
+    void (*receive)(int64_t time, uint8_t data, unsigned baudRate);
+    // returns false if the node has not sent a byte until the time
+    bool (*transmit)(int64_t time, uint8_t *data, int64_t *byteTime);
+    // prints the flash memory operations and the errors, returns false if the node has failed
+    bool (*report)();
+};
+
+void registerBusNode(const BusNode &node);
+
+#endif // __BUS_NODE_H_INCLUDED_
@@ -0,0 +1,204 @@
+// the RS-485 multi-drop bus simulator: the bootloader nodes are connected to a pseudo terminal,
+// the loader opens the pseudo terminal as the serial port
+//
+// bus-simulator [--baud=<baud>] [--latency=<ms>] [--echo] [--stall=<scale>] <flash-directory> <port-link>
+//     --baud - the bus baud rate (default: 115200)
+//     --latency - the delay of the PC bytes by the USB serial adapter (default: 1 ms)
+//     --echo - the node transceiver receivers are always enabled (/RE tied low), the nodes receive their own responses
+//     --stall - the flash memory operations are longer than the device ones by this scale (default: 1)
+//     <flash-directory> - the node<address>.bin flash memory files, a new file is a blank device with the bootloader
+//     <port-link> - the symbolic link to the pseudo terminal created for the loader
+//
+// The simulator runs until SIGINT or SIGTERM, then it prints the node counters and exits with 1 if a node has failed
+// or the bytes of the PC and the nodes have collided on the bus.
+
+#define _XOPEN_SOURCE 600
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bus-node.h"
+
+struct BusDrive
+{
+    int driver; // -1 - the PC, the node index otherwise
+    int64_t startTime;
+    int64_t endTime;
+};
+
+static const size_t DRIVE_HISTORY_SIZE = 64;
+
+static volatile sig_atomic_t stopped = 0;
+
+static std::vector<BusNode> &busNodes()
+{
+    static std::vector<BusNode> nodes;
+    return nodes;
+}
+
+void registerBusNode(const BusNode &node)
+{
+    busNodes().push_back(node);
+}
+
+int64_t busTime()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void stop(int)
+{
+    stopped = 1;
+}
+
+static void usageExit()
+{
+    fprintf(stderr, "Usage: bus-simulator [--baud=<baud>] [--latency=<ms>] [--echo] [--stall=<scale>] <flash-directory> <port-link>\n");
+    exit(2);
+}
+
+// the pseudo terminal master, the slave is kept open so the master is not hung up when the loader exits
+static int openPseudoTerminal(const std::string &link)
+{
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if ((master < 0) || (grantpt(master) != 0) || (unlockpt(master) != 0))
+    {
+        perror("Pseudo terminal open error");
+        exit(1);
+    }
+    const char *slaveName = ptsname(master);
+    int slave = open(slaveName, O_RDWR | O_NOCTTY);
+    termios tty;
+    if ((slave < 0) || (tcgetattr(slave, &tty) != 0))
+    {
+        perror("Pseudo terminal setup error");
+        exit(1);
+    }
+    cfmakeraw(&tty);
+    tcsetattr(slave, TCSANOW, &tty);
+
+    unlink(link.c_str());
+    if (symlink(slaveName, link.c_str()) != 0)
+    {
+        perror("Pseudo terminal link error");
+        exit(1);
+    }
+    fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+    return master;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned baudRate = 115200;
+    double latency = 1.0;
+    bool echo = false;
+    double stallScale = 1.0;
+    std::vector<std::string> paths;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg.compare(0, 7, "--baud=") == 0) baudRate = (unsigned)atoi(arg.c_str() + 7);
+        else if (arg.compare(0, 10, "--latency=") == 0) latency = atof(arg.c_str() + 10);
+        else if (arg == "--echo") echo = true;
+        else if (arg.compare(0, 8, "--stall=") == 0) stallScale = atof(arg.c_str() + 8);
+        else if (arg.compare(0, 2, "--") == 0) usageExit();
+        else paths.push_back(arg);
+    }
+    if ((paths.size() != 2) || (baudRate == 0) || (latency < 0) || (stallScale <= 0)) usageExit();
+
+    std::vector<BusNode> &nodes = busNodes();
+    std::sort(nodes.begin(), nodes.end(), [](const BusNode &a, const BusNode &b) { return a.address < b.address; });
+
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+    int master = openPseudoTerminal(paths[1]);
+    for (const BusNode &node : nodes)
+    {
+        node.start(paths[0] + "/node" + std::to_string(node.address) + ".bin", stallScale);
+    }
+    printf("%u nodes on %s\n", (unsigned)nodes.size(), paths[1].c_str());
+    fflush(stdout);
+
+    const int64_t byteTime = (int64_t)(10e9 / baudRate);
+    const int64_t pcLatency = (int64_t)(latency * 1e6);
+    int64_t pcEndTime = 0;
+    std::deque<BusDrive> drives;
+    unsigned collisionCount = 0;
+
+    // the byte collides if it overlaps a byte of another driver by more than a bit
+    auto drive = [&](int driver, int64_t startTime, int64_t endTime)
+    {
+        for (const BusDrive &other : drives)
+        {
+            if ((other.driver != driver) && (startTime < other.endTime - byteTime / 10) && (other.startTime < endTime - byteTime / 10))
+            {
+                if (collisionCount++ < 10)
+                {
+                    fprintf(stderr, "Bus collision: %s and %s\n",
+                        driver < 0 ? "PC" : ("node " + std::to_string(nodes[driver].address)).c_str(),
+                        other.driver < 0 ? "PC" : ("node " + std::to_string(nodes[other.driver].address)).c_str());
+                }
+                break;
+            }
+        }
+        drives.push_back({ driver, startTime, endTime });
+        if (drives.size() > DRIVE_HISTORY_SIZE) drives.pop_front();
+    };
+
+    while (!stopped)
+    {
+        // the PC bytes are sent back to back at the bus baud rate, they are read from the pseudo terminal
+        // at this rate too, so the loader waits for the end of the bytes by flush as with a serial port
+        uint8_t buffer[256];
+        int64_t time = busTime() + pcLatency;
+        size_t count = (size_t)std::max<int64_t>(0, (time + 2 * byteTime - std::max(time, pcEndTime)) / byteTime);
+        ssize_t length = (count != 0) ? read(master, buffer, std::min(count, sizeof buffer)) : 0;
+        for (ssize_t i = 0; i < length; ++i)
+        {
+            pcEndTime = std::max(busTime() + pcLatency, pcEndTime) + byteTime;
+            drive(-1, pcEndTime - byteTime, pcEndTime);
+            for (const BusNode &node : nodes) node.receive(pcEndTime, buffer[i], baudRate);
+        }
+
+        for (size_t index = 0; index < nodes.size(); ++index)
+        {
+            uint8_t data;
+            int64_t endTime;
+            while (nodes[index].transmit(busTime(), &data, &endTime))
+            {
+                drive((int)index, endTime - byteTime, endTime);
+                if (write(master, &data, 1) != 1)
+                {
+                    perror("Pseudo terminal write error");
+                    return 1;
+                }
+                for (size_t other = 0; other < nodes.size(); ++other)
+                {
+                    if (echo || (other != index)) nodes[other].receive(endTime, data, baudRate);
+                }
+            }
+        }
+
+        if (length <= 0) std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+
+    bool passed = true;
+    for (const BusNode &node : nodes)
+    {
+        if (!node.report()) passed = false;
+    }
+    printf("Bus collisions: %u\n", collisionCount);
+    unlink(paths[1].c_str());
+    return (passed && (collisionCount == 0)) ? 0 : 1;
+}
@@ -0,0 +1,92 @@
+#! /bin/bash
+# builds the bus simulator with the bootloader nodes and the loader for Linux, programs the test firmware into
+# all nodes of the simulated RS-485 bus by the broadcast requests and verifies each node
+#
+# bus-simulator.sh [<node-count>] [<bus-simulator options>]
+#     <node-count> - the nodes with the addresses 1...<node-count> (default: 3)
+#     --stall=<scale> - the slower flash memory operations of the nodes, the loader shall slow down the broadcast
+#     --echo - the nodes receive their own responses
+set -e
+
+NODE_COUNT=${1:-3}
+shift || true
+SIMULATOR_OPTIONS="$*"
+
+cd "$(dirname "$0")"
+BUILDDIR=build
+CXX=${CXX:-g++}
+CXXFLAGS="-std=c++14 -O2 -w"
+
+rm -rf $BUILDDIR
+mkdir -p $BUILDDIR/flash
+
+echo "Building $NODE_COUNT nodes"
+nodes=""
+node_objects=""
+for ((address = 1; address <= NODE_COUNT; ++address))
+do
+	$CXX $CXXFLAGS -I. -Idevice -DNODE_NAMESPACE=node$address -DNODE_ADDRESS=$address -DCONFIG_FILE='"config-node.h"' \
+		-c node.cpp -o $BUILDDIR/node$address.o
+	node_objects="$node_objects $BUILDDIR/node$address.o"
+	nodes="$nodes${nodes:+,}$address"
+done
+$CXX $CXXFLAGS bus-simulator.cpp $node_objects -o $BUILDDIR/bus-simulator -lpthread
+
+echo "Building the loader"
+loader_objects=""
+for source in ../../Loader/*.cpp posix/SerialPort.cpp
+do
+	name=$(basename $source .cpp)
+	[[ $source == ../../Loader/SerialPort.cpp || $name == Stable ]] && continue
+	$CXX $CXXFLAGS -Iposix -I../../Loader -c $source -o $BUILDDIR/loader-$name.o
+	loader_objects="$loader_objects $BUILDDIR/loader-$name.o"
+done
+$CXX $CXXFLAGS $loader_objects -o $BUILDDIR/loader
+
+# the dsPIC30F6014A test firmware: the random program memory rows and data EEPROM words
+awk 'function hex(digits,    i, value)
+	{
+		for (i = 1; i <= length(digits); ++i) value = value * 16 + index("0123456789ABCDEF", substr(digits, i, 1)) - 1
+		return value
+	}
+	function record(address, type, data,    i, sum, line)
+	{
+		line = sprintf(":%02X%04X%02X", length(data) / 2, address, type)
+		sum = length(data) / 2 + int(address / 256) + address % 256 + type
+		for (i = 1; i <= length(data); i += 2) sum += hex(substr(data, i, 2))
+		print line data sprintf("%02X", (256 - sum % 256) % 256)
+	}
+	function word(address, value)
+	{
+		record((address * 2) % 65536, 0, sprintf("%02X%02X%02X00", value % 256, int(value / 256) % 256, int(value / 65536)))
+	}
+	BEGIN {
+		srand(1)
+		record(0, 4, "0000")
+		word(0, hex("040100")) # GOTO 0x000100
+		word(2, 0)
+		for (address = hex("000100"); address < hex("002000"); address += 2) word(address, int(rand() * hex("1000000")))
+		record(0, 4, "00FF")
+		for (address = hex("7FF000"); address < hex("7FF080"); address += 2) word(address, int(rand() * hex("10000")))
+		record(0, 1, "")
+	}' > $BUILDDIR/test.hex
+
+# starts the bus simulator for one loader run, the nodes are reset by the restart
+run_loader()
+{
+	local status=0
+	$BUILDDIR/bus-simulator $SIMULATOR_OPTIONS $BUILDDIR/flash $BUILDDIR/bus > $BUILDDIR/bus.log &
+	local simulator=$!
+	for ((i = 0; i < 50; ++i)); do [ -e $BUILDDIR/bus ] && break; sleep 0.1; done
+	$BUILDDIR/loader -t=10 "$@" $BUILDDIR/bus $BUILDDIR/test.hex || status=$?
+	kill -TERM $simulator
+	wait $simulator || status=1
+	cat $BUILDDIR/bus.log
+	return $status
+}
+
+echo "Programming the nodes $nodes"
+run_loader -p -n=$nodes
+echo "Verifying the nodes $nodes"
+run_loader -v -n=$nodes
+echo "Passed"
@@ -0,0 +1,28 @@
+// the bootloader config of the simulated bus nodes, NODE_ADDRESS is defined by the build script
+
+// === FCY ===
+#define FCY (7370000UL * 16 / 4) // FRC with PLL x16
+
+// === UART ===
+#define BOOT_UART UART2
+
+// === Watchdog timer ===
+#define WDT_ENABLED
+
+// === RS-485 multi-drop bus ===
+#define DE_TRIS TRISBbits.TRISB2
+#define DE_LAT LATBbits.LATB2
+#define DE_ON 1
+#define DE_OFF 0
+
+// === Optional requests ===
+#define READ_RANGE_USED
+#define COMPRESSED_WRITE_USED
+#define ROW_DIGESTS_USED
+#define ERASE_AVOIDANCE_USED
+
+// === RAM budget ===
+#define PACKET_BUFFER_SIZE 1024
+
+// === Waiting time at startup ===
+#define WAIT_DELAY_MS 10000 // the loader is started after the nodes
@@ -0,0 +1,530 @@
+// the dsPIC30F6014A model of one bus node, node.cpp includes it into the node namespace with the bootloader firmware:
+// the flash memory in a file, the NVM operations, Timer1 and the boot UART with the 4-byte receive FIFO,
+// the firmware is assumed to read the UART in time except while the program memory operations stall the CPU
+
+#include "xc.h"
+#include "libpic30.h"
+
+// the node config, defined by node.cpp after the firmware
+static double instructionClock();
+static UART &bootUart();
+static bool driverEnabled(); // the DE pin enables the RS-485 transceiver driver
+int firmwareMain(void);
+
+static void stallCpu(int64_t duration);
+
+static const uint32_t PROGRAM_MEMORY_SIZE = 0x18000; // PC address units
+static const uint32_t DATA_EEPROM_ADDRESS_BASE = 0x7FF000;
+static const uint32_t DATA_EEPROM_SIZE = 0x1000;
+static const uint32_t CONFIG_ADDRESS = 0xF80000;
+static const unsigned CONFIG_WORD_COUNT_MAX = 8;
+static const uint32_t DEVICE_ID_ADDRESS = 0xFF0000;
+static const uint32_t BOOTLOADER_BASE = 0x17800;
+static const uint32_t BOOTLOADER_IMAGE_SIZE = 0x800;
+static const size_t FLASH_WORD_COUNT = PROGRAM_MEMORY_SIZE / 2 + DATA_EEPROM_SIZE / 2 + CONFIG_WORD_COUNT_MAX + 2;
+static const int64_t FLASH_OPERATION_TIME = 2000000; // ns, the row erase or program operation
+static const unsigned UART_RX_BYTES_MAX = 5; // the FIFO and the shift register
+static const unsigned UART_TX_BYTES_MAX = 5;
+
+static std::recursive_mutex deviceMutex;
+typedef std::lock_guard<std::recursive_mutex> DeviceLock;
+
+struct DeviceStatistic
+{
+    unsigned programMemoryErase = 0;
+    unsigned programMemoryProgram = 0;
+    unsigned dataEepromWrite = 0;
+    unsigned overrun = 0;
+    unsigned txOverflow = 0; // the firmware has written to the full transmit FIFO
+    unsigned undrivenBytes = 0; // the bytes sent with the transceiver driver disabled
+    unsigned cutBytes = 0; // the driver has been disabled before the byte has been sent
+    unsigned nvmErrors = 0;
+    bool targetStarted = false;
+};
+
+static DeviceStatistic statistic;
+static uint32_t *flash; // 24-bit words
+static double stallScale = 1.0;
+
+// ---------- flash memory ----------
+
+static uint32_t *flashWord(uint32_t address)
+{
+    static uint32_t unimplemented;
+
+    address &= 0xFFFFFE;
+    if (address < PROGRAM_MEMORY_SIZE) return &flash[address / 2];
+    size_t index = PROGRAM_MEMORY_SIZE / 2;
+    if ((address >= DATA_EEPROM_ADDRESS_BASE) && (address < DATA_EEPROM_ADDRESS_BASE + DATA_EEPROM_SIZE))
+    {
+        return &flash[index + (address - DATA_EEPROM_ADDRESS_BASE) / 2];
+    }
+    index += DATA_EEPROM_SIZE / 2;
+    if ((address >= CONFIG_ADDRESS) && (address < CONFIG_ADDRESS + CONFIG_WORD_COUNT_MAX * 2))
+    {
+        return &flash[index + (address - CONFIG_ADDRESS) / 2];
+    }
+    index += CONFIG_WORD_COUNT_MAX;
+    if ((address >= DEVICE_ID_ADDRESS) && (address < DEVICE_ID_ADDRESS + 4))
+    {
+        return &flash[index + (address - DEVICE_ID_ADDRESS) / 2];
+    }
+    unimplemented = 0;
+    return &unimplemented;
+}
+
+static bool isDataEeprom(uint32_t address)
+{
+    return (address >= DATA_EEPROM_ADDRESS_BASE) && (address < DATA_EEPROM_ADDRESS_BASE + DATA_EEPROM_SIZE);
+}
+
+// the new device has the blank memory, the bootloader and the first row written by the programmer
+static void initFlash()
+{
+    static const uint16_t CONFIG_WORDS[] = { 0xC100, 0x803F, 0x87B3, 0x310F, 0x330F, 0x0007, 0xC003 };
+
+    for (uint32_t address = 0; address < PROGRAM_MEMORY_SIZE; address += 2) *flashWord(address) = 0xFFFFFF;
+    for (uint32_t address = 0; address < DATA_EEPROM_SIZE; address += 2)
+    {
+        *flashWord(DATA_EEPROM_ADDRESS_BASE + address) = 0xFFFF;
+    }
+    // GOTO bootloader, the vectors point to the jump table below the bootloader
+    *flashWord(0x000000) = 0x040000 | (BOOTLOADER_BASE & 0xFFFF);
+    *flashWord(0x000002) = BOOTLOADER_BASE >> 16;
+    for (uint32_t address = 0x000004; address < 0x000080; address += 2)
+    {
+        *flashWord(address) = BOOTLOADER_BASE + 0x08 + (address - 0x000004) * 2;
+    }
+    // the bootloader code is not executed by the model, the words only differ from the blank ones
+    for (uint32_t address = BOOTLOADER_BASE + 0x80; address < BOOTLOADER_BASE + BOOTLOADER_IMAGE_SIZE; address += 2)
+    {
+        *flashWord(address) = address;
+    }
+    for (unsigned i = 0; i < sizeof CONFIG_WORDS / sizeof CONFIG_WORDS[0]; ++i)
+    {
+        *flashWord(CONFIG_ADDRESS + i * 2) = CONFIG_WORDS[i];
+    }
+    *flashWord(DEVICE_ID_ADDRESS) = 0x02C3; // dsPIC30F6014A
+    *flashWord(DEVICE_ID_ADDRESS + 2) = 0x3001;
+}
+
+static void openFlash(const std::string &path)
+{
+    int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    struct stat fileStat;
+    if ((fd < 0) || (fstat(fd, &fileStat) != 0))
+    {
+        fprintf(stderr, "Flash memory file open error (%s)\n", path.c_str());
+        exit(1);
+    }
+    bool blank = (fileStat.st_size == 0);
+    if (ftruncate(fd, FLASH_WORD_COUNT * sizeof(uint32_t)) != 0)
+    {
+        fprintf(stderr, "Flash memory file write error (%s)\n", path.c_str());
+        exit(1);
+    }
+    flash = (uint32_t*)mmap(nullptr, FLASH_WORD_COUNT * sizeof(uint32_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (flash == MAP_FAILED)
+    {
+        fprintf(stderr, "Flash memory file map error (%s)\n", path.c_str());
+        exit(1);
+    }
+    close(fd);
+    if (blank) initFlash();
+}
+
+// ---------- registers ----------
+
+UART UART1, UART2;
+Reg TBLPAG, NVMCON, NVMADR, NVMADRU, NVMKEY, ADPCFG, PR1, T1CON, TMR1, OSCCON, RCON, INTCON1, INTCON2,
+    IEC0, IEC1, IFS0, IFS1, IPC2, IPC6, SR, CORCON, PSVPAG, TRISB, LATB, PORTB;
+IFS0bits_t IFS0bits;
+IFS1bits_t IFS1bits;
+IEC0bits_t IEC0bits;
+IEC1bits_t IEC1bits;
+IPC2bits_t IPC2bits;
+IPC6bits_t IPC6bits;
+INTCON2bits_t INTCON2bits;
+NVMCONbits_t NVMCONbits;
+TRISBbits_t TRISBbits;
+LATBbits_t LATBbits;
+PORTBbits_t PORTBbits;
+OSCCONbits_t OSCCONbits;
+RCONbits_t RCONbits;
+
+// the linker script symbols
+void BOOTLOADER_BASE_ADDRESS(void) {}
+void BOOTLOADER_SIZE(void) {}
+void DATA_EEPROM_ADDRESS(void) {}
+
+// ---------- NVM ----------
+
+static std::map<uint32_t, uint32_t> writeLatches;
+static int64_t nvmEndTime;
+
+uint16_t __builtin_tblrdl(uint16_t offset)
+{
+    return (uint16_t)*flashWord(((uint32_t)TBLPAG.value << 16) | offset);
+}
+
+uint16_t __builtin_tblrdh(uint16_t offset)
+{
+    uint32_t address = ((uint32_t)TBLPAG.value << 16) | offset;
+    return isDataEeprom(address) ? 0 : (uint16_t)(*flashWord(address) >> 16);
+}
+
+void __builtin_tblwtl(uint16_t offset, uint16_t data)
+{
+    uint32_t &latch = writeLatches.emplace(((uint32_t)TBLPAG.value << 16) | offset, 0xFFFFFF).first->second;
+    latch = (latch & 0xFF0000) | data;
+}
+
+void __builtin_tblwth(uint16_t offset, uint16_t data)
+{
+    uint32_t &latch = writeLatches.emplace(((uint32_t)TBLPAG.value << 16) | offset, 0xFFFFFF).first->second;
+    latch = (latch & 0x00FFFF) | ((uint32_t)(data & 0xFF) << 16);
+}
+
+static bool programLatches(size_t latchCount)
+{
+    bool valid = (writeLatches.size() == latchCount);
+    for (const std::pair<const uint32_t, uint32_t> &latch : writeLatches) *flashWord(latch.first) &= latch.second;
+    writeLatches.clear();
+    return valid;
+}
+
+void __builtin_write_NVM(void)
+{
+    uint32_t address = ((uint32_t)NVMADRU.value << 16) | NVMADR.value;
+    int64_t operationTime = (int64_t)(FLASH_OPERATION_TIME * stallScale);
+    bool valid = true;
+
+    switch (NVMCON.value & 0x7F)
+    {
+    case 0x41: // program memory row erase, the CPU is stalled
+        for (uint32_t i = 0; i < 0x40; i += 2) *flashWord((address & ~0x3Fu) + i) = 0xFFFFFF;
+        ++statistic.programMemoryErase;
+        stallCpu(operationTime);
+        return;
+    case 0x01: // program memory row program, the CPU is stalled
+        if (!programLatches(32)) ++statistic.nvmErrors;
+        ++statistic.programMemoryProgram;
+        stallCpu(operationTime);
+        return;
+    case 0x45: // data EEPROM row erase
+        for (uint32_t i = 0; i < 0x20; i += 2) *flashWord((address & ~0x1Fu) + i) = 0xFFFF;
+        break;
+    case 0x44: // data EEPROM word erase
+        *flashWord(address) = 0xFFFF;
+        break;
+    case 0x46: // data EEPROM bulk erase
+        for (uint32_t i = 0; i < DATA_EEPROM_SIZE; i += 2) *flashWord(DATA_EEPROM_ADDRESS_BASE + i) = 0xFFFF;
+        break;
+    case 0x05: // data EEPROM row program
+        valid = programLatches(16);
+        break;
+    case 0x04: // data EEPROM word program
+        valid = programLatches(1);
+        break;
+    default:
+        valid = false;
+        break;
+    }
+    if (!valid) ++statistic.nvmErrors;
+    ++statistic.dataEepromWrite;
+
+    // the CPU runs while the data EEPROM is written, WR is cleared at the end
+    NVMCON.value |= 0x8000;
+    nvmEndTime = busTime() + operationTime;
+}
+
+static uint16_t readNvmcon(Reg &reg)
+{
+    if (((reg.value & 0x8000) != 0) && (busTime() >= nvmEndTime)) reg.value &= ~0x8000;
+    return reg.value;
+}
+
+void __builtin_clrwdt(void)
+{
+}
+
+uint32_t __builtin_tbladdress(void (*function)(void))
+{
+    if (function == BOOTLOADER_BASE_ADDRESS) return BOOTLOADER_BASE;
+    if (function == BOOTLOADER_SIZE) return BOOTLOADER_IMAGE_SIZE;
+    if (function == DATA_EEPROM_ADDRESS) return DATA_EEPROM_ADDRESS_BASE;
+    return BOOTLOADER_BASE + BOOTLOADER_IMAGE_SIZE - 0x100; // the bootloader functions are not executed by the model
+}
+
+uint16_t __builtin_psvpage(const void *p)
+{
+    return 0;
+}
+
+void __builtin_write_OSCCONL(uint8_t value)
+{
+    // the oscillator is switched at once
+    OSCCON.value = (OSCCON.value & 0xFF00) | value;
+    if ((value & 0x01) != 0) OSCCON.value = (OSCCON.value & ~0x3001) | ((OSCCON.value & 0x0300) << 4);
+}
+
+void __builtin_write_OSCCONH(uint8_t value)
+{
+    OSCCON.value = (OSCCON.value & 0x30FF) | ((value & 0x03) << 8);
+}
+
+void __builtin_disi(unsigned count)
+{
+}
+
+void __delay32(unsigned long cycles)
+{
+    std::this_thread::sleep_for(std::chrono::nanoseconds((int64_t)(cycles * 1e9 / instructionClock())));
+}
+
+// ---------- Timer1 ----------
+
+static int64_t timerStartTime;
+
+static int64_t timerPeriod()
+{
+    static const unsigned PRESCALERS[] = { 1, 8, 64, 256 };
+    return (int64_t)((PR1.value + 1.0) * PRESCALERS[(T1CON.value >> 4) & 0x03] * 1e9 / instructionClock());
+}
+
+static uint16_t readIfs0(Reg &reg)
+{
+    if ((T1CON.value & 0x8000) != 0)
+    {
+        int64_t time = busTime();
+        if (timerStartTime == 0) timerStartTime = time;
+        int64_t period = timerPeriod();
+        if (time - timerStartTime >= period)
+        {
+            timerStartTime += (time - timerStartTime) / period * period;
+            reg.value |= 1 << 3; // T1IF
+        }
+    }
+    return reg.value;
+}
+
+static uint16_t readTmr1(Reg &reg)
+{
+    if ((T1CON.value & 0x8000) != 0)
+    {
+        int64_t period = timerPeriod();
+        if (timerStartTime == 0) timerStartTime = busTime();
+        reg.value = (uint16_t)((busTime() - timerStartTime) % period * (PR1.value + 1) / period);
+    }
+    return reg.value;
+}
+
+// ---------- UART ----------
+
+static std::multimap<int64_t, uint8_t> rxLine; // the bytes on the bus by the end time
+static std::deque<uint8_t> rxFifo;
+static bool rxOverrun;
+static std::deque<std::pair<int64_t, uint8_t>> txLine; // the bytes sent by the node by the end time
+static int64_t txEndTime;
+static std::deque<std::pair<int64_t, int64_t>> stalls; // the CPU stalls by the program memory operations
+static bool driver;
+
+static double uartBaudRate()
+{
+    return instructionClock() / (16.0 * (bootUart().uxbrg.value + 1));
+}
+
+static int64_t byteTime(double baudRate)
+{
+    return (int64_t)(10e9 / baudRate);
+}
+
+static bool uartEnabled()
+{
+    return (bootUart().uxmode.value & 0x8000) != 0;
+}
+
+static bool isStalled(int64_t time)
+{
+    for (const std::pair<int64_t, int64_t> &stall : stalls)
+    {
+        if ((time >= stall.first) && (time < stall.second)) return true;
+    }
+    return false;
+}
+
+static void stallCpu(int64_t duration)
+{
+    {
+        DeviceLock lock(deviceMutex);
+        int64_t time = busTime();
+        stalls.push_back(std::make_pair(time, time + duration));
+        if (stalls.size() > 16) stalls.pop_front();
+    }
+    std::this_thread::sleep_for(std::chrono::nanoseconds(duration));
+}
+
+static void updateReceiver()
+{
+    int64_t time = busTime();
+    while (!rxLine.empty() && (rxLine.begin()->first <= time))
+    {
+        int64_t endTime = rxLine.begin()->first;
+        uint8_t data = rxLine.begin()->second;
+        rxLine.erase(rxLine.begin());
+
+        if (!uartEnabled() || rxOverrun) continue;
+        if ((rxFifo.size() >= UART_RX_BYTES_MAX) && isStalled(endTime))
+        {
+            rxOverrun = true;
+            ++statistic.overrun;
+            continue;
+        }
+        rxFifo.push_back(data);
+    }
+}
+
+static unsigned txPendingBytes(int64_t time)
+{
+    unsigned count = 0;
+    for (auto it = txLine.rbegin(); (it != txLine.rend()) && (it->first > time); ++it) ++count;
+    return count;
+}
+
+static uint16_t readUxsta(Reg &reg)
+{
+    bool empty;
+    uint16_t value;
+    {
+        DeviceLock lock(deviceMutex);
+        updateReceiver();
+        unsigned txPending = txPendingBytes(busTime());
+        value = reg.value & ~((1 << 0) | (1 << 1) | (1 << 8) | (1 << 9));
+        if (!rxFifo.empty()) value |= 1 << 0; // URXDA
+        if (rxOverrun) value |= 1 << 1; // OERR
+        if (txPending == 0) value |= 1 << 8; // TRMT
+        if (txPending >= UART_TX_BYTES_MAX) value |= 1 << 9; // UTXBF
+        empty = rxFifo.empty();
+    }
+    // the firmware polls the receiver, the other nodes and the bus run meanwhile
+    if (empty) std::this_thread::yield();
+    return value;
+}
+
+static void writeUxsta(Reg &reg, uint16_t value)
+{
+    DeviceLock lock(deviceMutex);
+    // clearing OERR resets the FIFO
+    if (rxOverrun && ((value & (1 << 1)) == 0))
+    {
+        rxOverrun = false;
+        rxFifo.clear();
+    }
+    reg.value = value;
+}
+
+static uint16_t readUxrxreg(Reg &reg)
+{
+    DeviceLock lock(deviceMutex);
+    updateReceiver();
+    if (rxFifo.empty()) return 0;
+    uint8_t data = rxFifo.front();
+    rxFifo.pop_front();
+    return data;
+}
+
+static void writeUxtxreg(Reg &reg, uint16_t value)
+{
+    DeviceLock lock(deviceMutex);
+    int64_t time = busTime();
+    if (txPendingBytes(time) >= UART_TX_BYTES_MAX) ++statistic.txOverflow;
+    txEndTime = std::max(time, txEndTime) + byteTime(uartBaudRate());
+    if (!driver)
+    {
+        ++statistic.undrivenBytes;
+        return;
+    }
+    txLine.push_back(std::make_pair(txEndTime, (uint8_t)value));
+}
+
+static void writeLatb(Reg &reg, uint16_t value)
+{
+    DeviceLock lock(deviceMutex);
+    reg.value = value;
+    bool enabled = driverEnabled();
+    if (driver && !enabled)
+    {
+        // the bytes in the transmit FIFO and the shift register are cut
+        int64_t time = busTime();
+        while (!txLine.empty() && (txLine.back().first > time))
+        {
+            txLine.pop_back();
+            ++statistic.cutBytes;
+        }
+    }
+    driver = enabled;
+}
+
+// ---------- the node interface ----------
+
+void startTargetFirmware(void)
+{
+    {
+        DeviceLock lock(deviceMutex);
+        statistic.targetStarted = true;
+    }
+    for (;;) std::this_thread::sleep_for(std::chrono::seconds(1));
+}
+
+static void startNode(const std::string &flashPath, double scale)
+{
+    stallScale = scale;
+    openFlash(flashPath);
+
+    OSCCON.value = 0x1100; // FRC
+    RCON.value = 1 << 0; // POR
+    NVMCON.onRead = readNvmcon;
+    IFS0.onRead = readIfs0;
+    TMR1.onRead = readTmr1;
+    LATB.onWrite = writeLatb;
+    for (UART *uart : { &UART1, &UART2 })
+    {
+        uart->uxsta.onRead = readUxsta;
+        uart->uxsta.onWrite = writeUxsta;
+        uart->uxrxreg.onRead = readUxrxreg;
+        uart->uxtxreg.onWrite = writeUxtxreg;
+    }
+
+    std::thread(firmwareMain).detach();
+}
+
+static void receiveByte(int64_t time, uint8_t data, unsigned baudRate)
+{
+    DeviceLock lock(deviceMutex);
+    // the bytes at a different baud rate are received as the wrong ones
+    if (std::fabs(uartBaudRate() - baudRate) > baudRate * 0.03) data ^= 0x5A;
+    rxLine.insert(std::make_pair(time, data));
+}
+
+static bool transmitByte(int64_t time, uint8_t *data, int64_t *endTime)
+{
+    DeviceLock lock(deviceMutex);
+    if (txLine.empty() || (txLine.front().first > time)) return false;
+    *endTime = txLine.front().first;
+    *data = txLine.front().second;
+    txLine.pop_front();
+    return true;
+}
+
+static bool reportNode(unsigned address)
+{
+    DeviceLock lock(deviceMutex);
+    printf("Node %u: program memory erase = %u, program = %u, data EEPROM writes = %u, receive overruns = %u%s\n",
+        address, statistic.programMemoryErase, statistic.programMemoryProgram, statistic.dataEepromWrite,
+        statistic.overrun, statistic.targetStarted ? ", the target firmware started" : "");
+    if (statistic.txOverflow != 0) printf("Node %u: transmit FIFO overflows = %u\n", address, statistic.txOverflow);
+    if (statistic.undrivenBytes != 0) printf("Node %u: bytes sent without DE = %u\n", address, statistic.undrivenBytes);
+    if (statistic.cutBytes != 0) printf("Node %u: bytes cut by DE = %u\n", address, statistic.cutBytes);
+    if (statistic.nvmErrors != 0) printf("Node %u: wrong NVM operations = %u\n", address, statistic.nvmErrors);
+    return (statistic.txOverflow == 0) && (statistic.undrivenBytes == 0) && (statistic.cutBytes == 0) && (statistic.nvmErrors == 0);
+}
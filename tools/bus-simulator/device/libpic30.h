@@ -0,0 +1,6 @@
+#ifndef __LIBPIC30_H_INCLUDED_
+#define __LIBPIC30_H_INCLUDED_
+
+void __delay32(unsigned long cycles);
+
+#endif // __LIBPIC30_H_INCLUDED_
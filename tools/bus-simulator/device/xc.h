@@ -0,0 +1,112 @@
+// the dsPIC30F registers and builtins used by the bootloader firmware, the firmware is compiled as C++
+// on the PC and the registers call the device model (device-model.cpp) by the read and write hooks
+
+#ifndef __XC_H_INCLUDED_
+#define __XC_H_INCLUDED_
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct Reg
+{
+    uint16_t value = 0;
+    uint16_t (*onRead)(Reg &reg) = nullptr;
+    void (*onWrite)(Reg &reg, uint16_t value) = nullptr;
+
+    uint16_t get() { return onRead != nullptr ? onRead(*this) : value; }
+    void set(uint16_t x) { if (onWrite != nullptr) onWrite(*this, x); else value = x; }
+
+    operator uint16_t() { return get(); }
+    Reg &operator=(unsigned long x) { set((uint16_t)x); return *this; }
+    Reg &operator&=(unsigned long x) { set(get() & x); return *this; }
+    Reg &operator|=(unsigned long x) { set(get() | x); return *this; }
+    Reg &operator^=(unsigned long x) { set(get() ^ x); return *this; }
+    Reg &operator+=(unsigned long x) { set(get() + x); return *this; }
+    Reg &operator++() { set(get() + 1); return *this; }
+};
+
+struct Bit
+{
+    Reg *reg;
+    unsigned shift;
+    unsigned width;
+
+    Bit(Reg *r, unsigned s, unsigned w = 1) : reg(r), shift(s), width(w) {}
+
+    unsigned mask() const { return ((1u << width) - 1) << shift; }
+    operator unsigned() const { return (reg->get() & mask()) >> shift; }
+    Bit &operator=(unsigned long x) { reg->set((reg->get() & ~mask()) | ((x << shift) & mask())); return *this; }
+    Bit &operator^=(unsigned long x) { return *this = ((unsigned)*this ^ x); }
+};
+
+struct UART
+{
+    Reg uxmode;
+    Reg uxsta;
+    Reg uxtxreg;
+    Reg uxrxreg;
+    Reg uxbrg;
+};
+
+extern UART UART1, UART2;
+
+extern Reg TBLPAG, NVMCON, NVMADR, NVMADRU, NVMKEY, ADPCFG, PR1, T1CON, TMR1, OSCCON, RCON, INTCON1, INTCON2,
+    IEC0, IEC1, IFS0, IFS1, IPC2, IPC6, SR, CORCON, PSVPAG, TRISB, LATB, PORTB;
+
+struct IFS0bits_t { Bit T1IF{&IFS0, 3}, U1RXIF{&IFS0, 9}; };
+struct IFS1bits_t { Bit U2RXIF{&IFS1, 8}; };
+struct IEC0bits_t { Bit T1IE{&IEC0, 3}, U1RXIE{&IEC0, 9}; };
+struct IEC1bits_t { Bit U2RXIE{&IEC1, 8}; };
+struct IPC2bits_t { Bit U1RXIP{&IPC2, 4, 3}; };
+struct IPC6bits_t { Bit U2RXIP{&IPC6, 4, 3}; };
+struct INTCON2bits_t { Bit ALTIVT{&INTCON2, 15}; };
+struct NVMCONbits_t { Bit WR{&NVMCON, 15}, WREN{&NVMCON, 14}; };
+struct TRISBbits_t { Bit TRISB0{&TRISB, 0}, TRISB1{&TRISB, 1}, TRISB2{&TRISB, 2}, TRISB3{&TRISB, 3}; };
+struct LATBbits_t { Bit LATB0{&LATB, 0}, LATB1{&LATB, 1}, LATB2{&LATB, 2}, LATB3{&LATB, 3}; };
+struct PORTBbits_t { Bit RB0{&PORTB, 0}, RB1{&PORTB, 1}, RB2{&PORTB, 2}, RB3{&PORTB, 3}; };
+struct OSCCONbits_t { Bit OSWEN{&OSCCON, 0}, LOCK{&OSCCON, 5}, NOSC{&OSCCON, 8, 2}, COSC{&OSCCON, 12, 2}; };
+struct RCONbits_t { Bit POR{&RCON, 0}, BOR{&RCON, 1}, SWR{&RCON, 6}, EXTR{&RCON, 7}; };
+
+extern IFS0bits_t IFS0bits;
+extern IFS1bits_t IFS1bits;
+extern IEC0bits_t IEC0bits;
+extern IEC1bits_t IEC1bits;
+extern IPC2bits_t IPC2bits;
+extern IPC6bits_t IPC6bits;
+extern INTCON2bits_t INTCON2bits;
+extern NVMCONbits_t NVMCONbits;
+extern TRISBbits_t TRISBbits;
+extern LATBbits_t LATBbits;
+extern PORTBbits_t PORTBbits;
+extern OSCCONbits_t OSCCONbits;
+extern RCONbits_t RCONbits;
+
+uint16_t __builtin_tblrdl(uint16_t offset);
+uint16_t __builtin_tblrdh(uint16_t offset);
+void __builtin_tblwtl(uint16_t offset, uint16_t data);
+void __builtin_tblwth(uint16_t offset, uint16_t data);
+void __builtin_write_NVM(void);
+void __builtin_clrwdt(void);
+uint32_t __builtin_tbladdress(void (*function)(void));
+uint16_t __builtin_psvpage(const void *p);
+void __builtin_write_OSCCONL(uint8_t value);
+void __builtin_write_OSCCONH(uint8_t value);
+void __builtin_disi(unsigned count);
+
+// the node runs the target firmware, it does not return
+void startTargetFirmware(void);
+
+#define Nop() ((void)0)
+#define ClrWdt() __builtin_clrwdt()
+
+// the attributes of the PIC24 compiler
+#define space(x)
+#define interrupt
+#define no_auto_psv
+
+// the asm statement of startFirmware (the jump to the target firmware) calls startTargetFirmware,
+// the system headers shall be included before this file
+#define asm startTargetFirmware();
+#define volatile(...) ((void)0)
+
+#endif // __XC_H_INCLUDED_
@@ -0,0 +1,60 @@
+// one node of the bus: the device model and the bootloader firmware compiled into the NODE_NAMESPACE namespace
+// with NODE_ADDRESS and CONFIG_FILE, the bus simulator links one object of this file for each node
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include "bus-node.h"
+
+#ifndef NODE_NAMESPACE
+#error NODE_NAMESPACE shall be defined
+#endif
+
+namespace NODE_NAMESPACE
+{
+
+#include "device-model.cpp"
+
+#define main firmwareMain
+#include "../../Bootloader-firmware/main.c"
+#undef main
+
+static double instructionClock()
+{
+    return FCY;
+}
+
+static UART &bootUart()
+{
+    return BOOT_UART;
+}
+
+static bool driverEnabled()
+{
+    return ((unsigned)DE_TRIS == 0) && ((unsigned)DE_LAT == DE_ON);
+}
+
+static bool report()
+{
+    return reportNode(NODE_ADDRESS);
+}
+
+static const bool registered = (registerBusNode({ NODE_ADDRESS, startNode, receiveByte, transmitByte, report }), true);
+
+} // namespace NODE_NAMESPACE
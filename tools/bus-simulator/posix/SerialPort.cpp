@@ -0,0 +1,206 @@
+// the serial port of the loader on Linux (termios), the handle keeps the file descriptor
+
+#include "Stable.h"
+#include "SerialPort.h"
+#include "ErrorExit.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+const int READ_TIMEOUT = 10; // ms
+const int WRITE_TIMEOUT = 500; // ms
+
+// the pseudo terminal of the bus simulator is drained at once, so flush waits for the time of the written bytes
+// at the baud rate as a serial port does (the loader opens one port)
+static unsigned currentBaudRate = 115200;
+static uint64_t transmitEndTime; // us
+
+static uint64_t currentTime()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static int descriptor(HANDLE handle)
+{
+    return (int)(intptr_t)handle;
+}
+
+static bool baudRateSpeed(unsigned baudRate, speed_t *speed)
+{
+    static const struct { unsigned baudRate; speed_t speed; } SPEEDS[] =
+    {
+        { 9600, B9600 }, { 19200, B19200 }, { 38400, B38400 }, { 57600, B57600 }, { 115200, B115200 },
+        { 230400, B230400 }, { 460800, B460800 }, { 500000, B500000 }, { 576000, B576000 }, { 921600, B921600 },
+        { 1000000, B1000000 },
+    };
+
+    for (const auto &entry : SPEEDS)
+    {
+        if (entry.baudRate == baudRate)
+        {
+            *speed = entry.speed;
+            return true;
+        }
+    }
+    return false;
+}
+
+SerialPort::SerialPort()
+{
+}
+
+SerialPort::~SerialPort()
+{
+    close();
+}
+
+void SerialPort::open(const std::string &portName)
+{
+    assert(_handle == INVALID_HANDLE_VALUE);
+
+    _portName = portName;
+    int fd = ::open(_portName.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (fd < 0)
+    {
+        errorExit("Serial port open error (%s)", _portName.c_str());
+    }
+    _handle = (HANDLE)(intptr_t)fd;
+
+    termios tty;
+    if (tcgetattr(fd, &tty) != 0)
+    {
+        errorExit("Serial port setup error (%s)", _portName.c_str());
+    }
+    cfmakeraw(&tty);
+    tty.c_cflag |= CLOCAL | CREAD;
+    tty.c_cflag &= ~(CSTOPB | CRTSCTS);
+    tty.c_cc[VMIN] = 0;
+    tty.c_cc[VTIME] = 0;
+    cfsetispeed(&tty, B115200);
+    cfsetospeed(&tty, B115200);
+    if (tcsetattr(fd, TCSANOW, &tty) != 0)
+    {
+        errorExit("Serial port setup error (%s)", _portName.c_str());
+    }
+}
+
+void SerialPort::close()
+{
+    if (_handle == INVALID_HANDLE_VALUE) return;
+
+    if (::close(descriptor(_handle)) != 0)
+    {
+        errorExit("Serial port close error (%s)", _portName.c_str());
+    }
+
+    _handle = INVALID_HANDLE_VALUE;
+}
+
+bool SerialPort::setBaudRate(unsigned baudRate)
+{
+    assert(_handle != INVALID_HANDLE_VALUE);
+
+    speed_t speed;
+    if (!baudRateSpeed(baudRate, &speed)) return false;
+
+    termios tty;
+    if (tcgetattr(descriptor(_handle), &tty) != 0)
+    {
+        errorExit("Serial port setup error (%s)", _portName.c_str());
+    }
+    cfsetispeed(&tty, speed);
+    cfsetospeed(&tty, speed);
+    if (tcsetattr(descriptor(_handle), TCSANOW, &tty) != 0) return false;
+
+    currentBaudRate = baudRate;
+    return true;
+}
+
+void SerialPort::setFlowControl(bool enabled)
+{
+    assert(_handle != INVALID_HANDLE_VALUE);
+
+    termios tty;
+    if (tcgetattr(descriptor(_handle), &tty) != 0)
+    {
+        errorExit("Serial port setup error (%s)", _portName.c_str());
+    }
+    if (enabled) tty.c_cflag |= CRTSCTS;
+    else tty.c_cflag &= ~CRTSCTS;
+    if (tcsetattr(descriptor(_handle), TCSANOW, &tty) != 0)
+    {
+        errorExit("Serial port setup error (%s)", _portName.c_str());
+    }
+}
+
+bool SerialPort::read(uint8_t *data)
+{
+    assert(_handle != INVALID_HANDLE_VALUE);
+
+    pollfd request = { descriptor(_handle), POLLIN, 0 };
+    if (poll(&request, 1, READ_TIMEOUT) < 0)
+    {
+        errorExit("Serial port read error (%s)", _portName.c_str());
+    }
+    if ((request.revents & POLLIN) == 0) return false;
+
+    ssize_t length = ::read(descriptor(_handle), data, 1);
+    if ((length < 0) && (errno != EAGAIN))
+    {
+        errorExit("Serial port read error (%s)", _portName.c_str());
+    }
+
+    return length == 1;
+}
+
+void SerialPort::purge()
+{
+    assert(_handle != INVALID_HANDLE_VALUE);
+
+    if (tcflush(descriptor(_handle), TCIFLUSH) != 0)
+    {
+        errorExit("Serial port purge error (%s)", _portName.c_str());
+    }
+}
+
+void SerialPort::write(const void *buffer, size_t size)
+{
+    assert(_handle != INVALID_HANDLE_VALUE);
+
+    transmitEndTime = std::max(currentTime(), transmitEndTime) + (uint64_t)size * 10000000 / currentBaudRate;
+
+    const uint8_t *data = (const uint8_t*)buffer;
+    while (size != 0)
+    {
+        pollfd request = { descriptor(_handle), POLLOUT, 0 };
+        if (poll(&request, 1, WRITE_TIMEOUT) <= 0)
+        {
+            errorExit("Serial port write error (%s)", _portName.c_str());
+        }
+        ssize_t length = ::write(descriptor(_handle), data, size);
+        if (length < 0)
+        {
+            if (errno == EAGAIN) continue;
+            errorExit("Serial port write error (%s)", _portName.c_str());
+        }
+        data += length;
+        size -= length;
+    }
+}
+
+void SerialPort::flush()
+{
+    assert(_handle != INVALID_HANDLE_VALUE);
+
+    if (tcdrain(descriptor(_handle)) != 0)
+    {
+        errorExit("Serial port write error (%s)", _portName.c_str());
+    }
+    uint64_t time = currentTime();
+    if (transmitEndTime > time) usleep((useconds_t)(transmitEndTime - time));
+}
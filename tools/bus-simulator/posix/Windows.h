@@ -0,0 +1,69 @@
+// the Windows API used by the loader outside SerialPort.cpp and the C headers included by Windows.h,
+// the bus simulator test builds the loader on Linux with this file and posix/SerialPort.cpp
+
+#ifndef __WINDOWS_POSIX_H_INCLUDED_
+#define __WINDOWS_POSIX_H_INCLUDED_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <strings.h>
+#include <time.h>
+#include <wctype.h>
+
+typedef void *HANDLE;
+typedef unsigned long DWORD;
+
+#define INVALID_HANDLE_VALUE ((HANDLE)(intptr_t)-1)
+
+typedef union
+{
+    struct
+    {
+        DWORD LowPart;
+        long HighPart;
+    };
+    long long QuadPart;
+} LARGE_INTEGER;
+
+inline DWORD GetTickCount()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (DWORD)(now.tv_sec * 1000 + now.tv_nsec / 1000000);
+}
+
+inline void Sleep(DWORD milliseconds)
+{
+    timespec duration = { (time_t)(milliseconds / 1000), (long)(milliseconds % 1000) * 1000000 };
+    nanosleep(&duration, nullptr);
+}
+
+inline int QueryPerformanceCounter(LARGE_INTEGER *counter)
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    counter->QuadPart = (long long)now.tv_sec * 1000000000 + now.tv_nsec;
+    return 1;
+}
+
+inline int QueryPerformanceFrequency(LARGE_INTEGER *frequency)
+{
+    frequency->QuadPart = 1000000000;
+    return 1;
+}
+
+inline int stricmp(const char *a, const char *b)
+{
+    return strcasecmp(a, b);
+}
+
+template<size_t size>
+inline int vsprintf_s(char (&buffer)[size], const char *format, va_list args)
+{
+    return vsnprintf(buffer, size, format, args);
+}
+
+#endif // __WINDOWS_POSIX_H_INCLUDED_
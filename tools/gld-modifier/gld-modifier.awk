@@ -7,13 +7,14 @@ BEGIN {
 	print ""
 	printf "_BOOTLOADER_BASE_ADDRESS = 0x%X;\n", BOOTLOADER_ADDR
 	print "_BOOTLOADER_SIZE = 0x800;"
+	printf "_DATA_EEPROM_ADDRESS = 0x%X;\n", DATA_EEPROM_ADDR
 	mask = mask + "0x0001"
 	next
 }
 
 /^  data  \(a!xr\)   : ORIGIN = 0x800,         LENGTH = (.*)$/ {
 	print "/*", $0, "*/"
-	print "  data  (a!xr)   : ORIGIN = 0x800,         LENGTH = 0x100"
+	printf "  data  (a!xr)   : ORIGIN = 0x800,         LENGTH = 0x%X\n", BOOTLOADER_RAM_SIZE
 	mask = mask + "0x0002"
 	next
 }
@@ -5,8 +5,11 @@ SRCDIR="gld-original"
 DSTDIR="gld-modified"
 
 BOOTLOADER_SIZE=0x800
+# the bootloader data and stack, the config file PACKET_BUFFER_SIZE + 0x80 at least
+BOOTLOADER_RAM_SIZE=${BOOTLOADER_RAM_SIZE:-0x100}
 
 PLENREG="^ *program *\(xr\) *: *ORIGIN *= *0x100 *, *LENGTH *= *(.*) *$"
+EEREG="^ *eedata *: *ORIGIN *= *(0x[0-9A-F]*) *,"
 
 for srcfile in $SRCDIR/*.gld
 do
@@ -15,7 +18,11 @@ do
 	[[ `grep -m 1 -i -P "$PLENREG" $srcfile` =~ $PLENREG ]]
 	bootloader_addr=$(printf 0x%X $((${BASH_REMATCH[1]}+0x100-$BOOTLOADER_SIZE)))
 
+	# the devices without data EEPROM
+	data_eeprom_addr=0x800000
+	if [[ `grep -m 1 -i -P "$EEREG" $srcfile` =~ $EEREG ]]; then data_eeprom_addr=${BASH_REMATCH[1]}; fi
+
 	echo $dstfile $bootloader_addr
 
-	awk -f gld-modifier.awk BOOTLOADER_ADDR=$bootloader_addr $srcfile > $dstfile
+	awk -f gld-modifier.awk BOOTLOADER_ADDR=$bootloader_addr DATA_EEPROM_ADDR=$data_eeprom_addr BOOTLOADER_RAM_SIZE=$BOOTLOADER_RAM_SIZE $srcfile > $dstfile
 done